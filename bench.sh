@@ -0,0 +1,51 @@
+#!/bin/sh
+# Prints the overhead of tracing as a table, one tab separated row per
+# measurement: the ns per scope of every runtime variant (scope), and
+# the rate of the output formats (writer).  Traces go to /dev/null.
+#
+# Given the table of an earlier run, also lists the rows more than
+# BENCH_TOLERANCE percent (10 by default) worse and then fails:
+#   sh bench.sh > before.tsv; ...; sh bench.sh before.tsv
+set -e
+trace='-DCTRACE_FILE_NAME="/dev/null"'
+table=$(mktemp)
+trap 'rm -f $table' EXIT
+
+bench_scope ()
+{
+  variant=$1
+  shift
+  g++ -O2 -o bench_scope -DBENCH_VARIANT="\"$variant\"" "$trace" \
+    bench_scope.cpp "$@" -lpthread
+  ./bench_scope >> $table
+}
+
+printf 'bench\tvariant\tthreads\tdepth\tvalue\tunit\n' > $table
+bench_scope ctrace
+bench_scope ctrace_thread -DCTRACE_THREAD_SUPPORTED
+bench_scope runtime -DBENCH_RUNTIME runtime.cpp
+bench_scope runtime_android -DBENCH_RUNTIME runtime_android.cpp
+bench_scope runtime_sigprof -DBENCH_RUNTIME runtime_sigprof.cpp
+g++ -O2 -o bench_writer -DCTRACE_GZIP_OUTPUT bench_writer.cpp -lz
+./bench_writer >> $table
+rm -f bench_scope bench_writer
+cat $table
+
+if [ -n "$1" ]; then
+  awk -F '\t' -v tolerance="${BENCH_TOLERANCE:-10}" '
+    NR == FNR { before[$1 FS $2 FS $3 FS $4] = $5; next }
+    FNR == 1 { next }
+    {
+      old = before[$1 FS $2 FS $3 FS $4]
+      if (old <= 0)
+        next
+      # ns per scope grows when worse, events per second shrink.
+      worse = $6 == "events/s" ? (old - $5) / old : ($5 - old) / old
+      if (worse * 100 > tolerance)
+        {
+          printf "worse by %.0f%%:\t%s\t(was %s)\n", worse * 100, $0, old
+          failed = 1
+        }
+    }
+    END { exit failed }' "$1" $table >&2
+fi
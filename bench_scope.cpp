@@ -0,0 +1,126 @@
+// C Headers
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+// POSIX Headers
+#include <pthread.h>
+
+// Measures the cost of one traced scope on the thread that runs it, at
+// several nesting depths while 1..N threads trace concurrently.
+//
+// Built as is it uses C_TRACE_0 from ctrace.h, with or without
+// CTRACE_THREAD_SUPPORTED.  Built with BENCH_RUNTIME and linked with one
+// of the runtimes it calls __start_ctrace__ and __end_ctrace__ on a
+// frame of sizeof (CTrace), the way the plugin does.
+//
+// The cost is taken from the thread cpu clock, so it is meaningful on
+// machines with fewer cores than threads, and leaves out the writer.
+// It should stay flat as threads are added, since threads only touch
+// their own buffers.  Prints one row of bench.sh's table per run.
+
+#ifdef BENCH_RUNTIME
+#define CTRACE_THREAD_SUPPORTED
+#define CTRACE_LAYOUT_ONLY
+#endif // BENCH_RUNTIME
+#include "ctrace.h"
+
+#ifdef BENCH_RUNTIME
+extern "C" {
+extern void __start_ctrace__ (void *c, const char *name);
+extern void __end_ctrace__ (void *c, const char *name);
+}
+#endif // BENCH_RUNTIME
+
+#ifndef BENCH_VARIANT
+#define BENCH_VARIANT "ctrace"
+#endif // BENCH_VARIANT
+
+static const int kScopesPerThread = 60000;
+static const int kDepths[] = { 1, 10, 100 };
+
+static uint64_t
+ThreadNanoseconds ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+  return static_cast<uint64_t> (ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// depth nested scopes, each in its own call.
+static void __attribute__ ((noinline)) traced (int depth)
+{
+#ifdef BENCH_RUNTIME
+  union
+  {
+    char bytes_[sizeof (CTrace)];
+    uint64_t align_;
+  } frame;
+  __start_ctrace__ (&frame, "traced");
+  if (depth > 1)
+    traced (depth - 1);
+  __end_ctrace__ (&frame, "traced");
+#else
+  C_TRACE_0 ("bench", "traced");
+  if (depth > 1)
+    traced (depth - 1);
+#endif // BENCH_RUNTIME
+}
+
+struct Run
+{
+  int depth_;
+  uint64_t elapsed_;
+};
+
+static void *
+thread_start (void *arg)
+{
+  Run *run = static_cast<Run *> (arg);
+  uint64_t start = ThreadNanoseconds ();
+  for (int i = 0; i < kScopesPerThread / run->depth_; ++i)
+    traced (run->depth_);
+  run->elapsed_ = ThreadNanoseconds () - start;
+  return NULL;
+}
+
+int
+main (int argc, char **argv)
+{
+  int max_threads = argc > 1 ? atoi (argv[1]) : 64;
+#ifndef CTRACE_THREAD_SUPPORTED
+  // the single thread build of ctrace.h is not thread safe.
+  max_threads = 1;
+#endif // CTRACE_THREAD_SUPPORTED
+  for (size_t d = 0; d < sizeof (kDepths) / sizeof (kDepths[0]); ++d)
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+      {
+        int depth = kDepths[d];
+#ifdef CTRACE_THREAD_SUPPORTED
+        pthread_t tids[threads];
+#endif // CTRACE_THREAD_SUPPORTED
+        Run runs[threads];
+        for (int i = 0; i < threads; ++i)
+          {
+            runs[i].depth_ = depth;
+#ifdef CTRACE_THREAD_SUPPORTED
+            pthread_create (&tids[i], NULL, thread_start, &runs[i]);
+#else
+            thread_start (&runs[i]);
+#endif // CTRACE_THREAD_SUPPORTED
+          }
+        uint64_t total = 0;
+        for (int i = 0; i < threads; ++i)
+          {
+#ifdef CTRACE_THREAD_SUPPORTED
+            pthread_join (tids[i], NULL);
+#endif // CTRACE_THREAD_SUPPORTED
+            total += runs[i].elapsed_;
+          }
+        int scopes = kScopesPerThread / depth * depth;
+        printf ("scope\t%s\t%d\t%d\t%.1f\tns/scope\n", BENCH_VARIANT, threads,
+                depth, static_cast<double> (total) / threads / scopes);
+        fflush (stdout);
+      }
+  return 0;
+}
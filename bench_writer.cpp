@@ -0,0 +1,208 @@
+#define __STDC_FORMAT_MACROS
+// C Headers
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+// POSIX Headers
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ctrace_format.h"
+#include "ctrace_perfetto.h"
+#ifdef CTRACE_GZIP_OUTPUT
+#include "ctrace_gzip.h"
+#endif // CTRACE_GZIP_OUTPUT
+
+// Measures the sustained rate at which the writers turn records into
+// their output: one fprintf per record, as the writers used to, against
+// CTraceJson formatting into a reused buffer with a single write() per
+// batch, the binary format, the Perfetto protobuf ctrace_convert writes,
+// and with CTRACE_GZIP_OUTPUT (link with -lz) compressed JSON.  Prints
+// rows of bench.sh's table.
+
+static const int kRecords = 1000000;
+static const int kRecordsPerBatch = 4096;
+static const char *kFileName = "bench_writer.json";
+
+static uint64_t
+Nanoseconds ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t> (ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static void
+Report (const char *what, uint64_t ns)
+{
+  printf ("writer\t%s\t1\t0\t%.0f\tevents/s\n", what,
+          static_cast<double> (kRecords) * 1e9 / ns);
+}
+
+static void
+BenchPrintf ()
+{
+  FILE *f = fopen (kFileName, "w");
+  if (!f)
+    return;
+  uint64_t start = Nanoseconds ();
+  for (int i = 0; i < kRecords; ++i)
+    fprintf (f,
+             "%s{\"cat\":\"%s\", \"pid\":%d, \"tid\":%d, \"ts\":%" PRIu64 ", "
+             "\"ph\":\"X\", \"name\":\"%s\", \"dur\": %" PRIu64
+             ", \"tts\":%" PRIu64 ", \"tdur\":%" PRIu64 "}",
+             i ? ", " : "", "profile", 1234, 1235,
+             static_cast<uint64_t> (1000000000 + i * 7), "some_function",
+             static_cast<uint64_t> (i % 1000), static_cast<uint64_t> (i),
+             static_cast<uint64_t> (i % 100));
+  fclose (f);
+  Report ("fprintf", Nanoseconds () - start);
+}
+
+// Formats the records as JSON, a batch at a time, handing each batch
+// to write.
+template <typename Write>
+static void
+FormatJson (Write write)
+{
+  CTraceBytes out;
+  for (int i = 0; i < kRecords; ++i)
+    {
+      CTraceJson::AppendEvent (&out, i != 0, "profile", 1234, 1235,
+                               1000000000 + i * 7, "some_function", i % 1000,
+                               true, i, i % 100);
+      if ((i + 1) % kRecordsPerBatch == 0)
+        {
+          if (!write (out))
+            return;
+          out.size_ = 0;
+        }
+    }
+  if (out.size_)
+    write (out);
+}
+
+struct WriteFd
+{
+  WriteFd (int fd) : fd_ (fd) {}
+  bool
+  operator() (const CTraceBytes &out)
+  {
+    if (write (fd_, out.data_, out.size_) >= 0)
+      return true;
+    perror (kFileName);
+    return false;
+  }
+  int fd_;
+};
+
+static void
+BenchBatched ()
+{
+  int fd = open (kFileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return;
+  uint64_t start = Nanoseconds ();
+  FormatJson (WriteFd (fd));
+  close (fd);
+  Report ("json", Nanoseconds () - start);
+}
+
+static void
+BenchBinary ()
+{
+  int fd = open (kFileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return;
+  CTraceBinaryWriter writer;
+  CTraceBytes out;
+  uint64_t start = Nanoseconds ();
+  CTraceBinaryWriter::AppendHeader (&out);
+  for (int i = 0; i < kRecords; i += kRecordsPerBatch)
+    {
+      writer.BeginBlock (1234, 1235, true);
+      for (int j = i; j < i + kRecordsPerBatch && j < kRecords; ++j)
+        writer.AddEvent ("profile", "some_function", 1000000000 + j * 7,
+                         j % 1000, j, j % 100);
+      writer.EndBlock (&out);
+      if (write (fd, out.data_, out.size_) < 0)
+        {
+          perror (kFileName);
+          break;
+        }
+      out.size_ = 0;
+    }
+  close (fd);
+  Report ("binary", Nanoseconds () - start);
+}
+
+static void
+BenchPerfetto ()
+{
+  int fd = open (kFileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return;
+  CTracePerfettoWriter writer;
+  CTraceBytes out;
+  uint64_t start = Nanoseconds ();
+  for (int i = 0; i < kRecords; ++i)
+    {
+      writer.AppendEvent (&out, "profile", 1234, 1235, 1000000000 + i * 7,
+                          "some_function", i % 1000, true, i, i % 100);
+      if ((i + 1) % kRecordsPerBatch == 0)
+        {
+          if (write (fd, out.data_, out.size_) < 0)
+            {
+              perror (kFileName);
+              break;
+            }
+          out.size_ = 0;
+        }
+    }
+  if (out.size_ && write (fd, out.data_, out.size_) < 0)
+    perror (kFileName);
+  close (fd);
+  Report ("perfetto", Nanoseconds () - start);
+}
+
+#ifdef CTRACE_GZIP_OUTPUT
+struct WriteGzip
+{
+  WriteGzip (CTraceGzipFile *file) : file_ (file) {}
+  bool
+  operator() (const CTraceBytes &out)
+  {
+    file_->Append (out.data_, out.size_);
+    return true;
+  }
+  CTraceGzipFile *file_;
+};
+
+static void
+BenchGzip ()
+{
+  int fd = open (kFileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  CTraceGzipFile file;
+  if (fd < 0 || !file.Open (fd, CTraceGzipFile::Level ()))
+    return;
+  uint64_t start = Nanoseconds ();
+  FormatJson (WriteGzip (&file));
+  file.Close ();
+  Report ("json_gzip", Nanoseconds () - start);
+}
+#endif // CTRACE_GZIP_OUTPUT
+
+int
+main ()
+{
+  BenchPrintf ();
+  BenchBatched ();
+  BenchBinary ();
+  BenchPerfetto ();
+#ifdef CTRACE_GZIP_OUTPUT
+  BenchGzip ();
+#endif // CTRACE_GZIP_OUTPUT
+  unlink (kFileName);
+  return 0;
+}
@@ -7,41 +7,119 @@
 #include <unistd.h>
 #include <sys/syscall.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
 
+#include "ctrace_desc.h"
+
+// With CTRACE_BINARY_OUTPUT the trace is written in the compact format
+// of ctrace_format.h; ctrace_convert turns it back into JSON.  With
+// CTRACE_GZIP_OUTPUT the JSON is deflated into a .json.gz by the thread
+// that writes it (ctrace_gzip.h).
 #ifndef CTRACE_FILE_NAME
+#if defined(CTRACE_BINARY_OUTPUT)
+#define CTRACE_FILE_NAME "trace.ctrace"
+#elif defined(CTRACE_GZIP_OUTPUT)
+#define CTRACE_FILE_NAME "trace.json.gz"
+#else
 #define CTRACE_FILE_NAME "trace.json"
+#endif
 #endif // CTRACE_FILE_NAME
+#if defined(CTRACE_GZIP_OUTPUT)                                         \
+    && (defined(CTRACE_BINARY_OUTPUT) || defined(CTRACE_MMAP_OUTPUT))
+#error "CTRACE_GZIP_OUTPUT only writes JSON, through write()"
+#endif
 #ifdef CTRACE_THREAD_SUPPORTED
 #include <pthread.h>
-#define CURRENT_TIME_LOCK_VAR CTrace::Lock __my_lock__ (GetCurrentTimeLock ())
-#define SUBMIT_LOCK_VAR CTrace::Lock __my_submit_lock__ (GetSubmitLock ())
+#define SINK_LOCK_VAR CTrace::Lock __my_sink_lock__ (&mutex_)
 #else
-#define CURRENT_TIME_LOCK_VAR
-#define SUBMIT_LOCK_VAR
+#define SINK_LOCK_VAR
 #endif // CTRACE_THREAD_SUPPORTED
 
 #ifndef CTRACE_OMIT_JITTER
 #define CTRACE_OMIT_JITTER 0UL
 #endif // CTRACE_OMIT_JITTER
 
+// Number of raw events a thread collects before handing its buffer
+// to the sink.
+#ifndef CTRACE_EVENTS_PER_BUFFER
+#define CTRACE_EVENTS_PER_BUFFER 1024
+#endif // CTRACE_EVENTS_PER_BUFFER
+
+// With CTRACE_AGGREGATE calls only update per thread statistics (see
+// ctrace_stats.h) instead of being written out one by one.  Every
+// CTRACE_AGGREGATE_INTERVAL_MS, and at exit, the summary table is
+// rewritten to CTRACE_SUMMARY_FILE_NAME and counter tracks of the
+// busiest functions are added to the trace.  Self time is tracked for
+// the outermost CTRACE_AGGREGATE_MAX_DEPTH nested scopes.
+#ifdef CTRACE_AGGREGATE
+#ifndef CTRACE_AGGREGATE_INTERVAL_MS
+#define CTRACE_AGGREGATE_INTERVAL_MS 1000
+#endif // CTRACE_AGGREGATE_INTERVAL_MS
+#ifndef CTRACE_AGGREGATE_MAX_DEPTH
+#define CTRACE_AGGREGATE_MAX_DEPTH 256
+#endif // CTRACE_AGGREGATE_MAX_DEPTH
+#ifndef CTRACE_SUMMARY_FILE_NAME
+#define CTRACE_SUMMARY_FILE_NAME CTRACE_FILE_NAME ".summary"
+#endif // CTRACE_SUMMARY_FILE_NAME
+class CTraceStatTable;
+#endif // CTRACE_AGGREGATE
+
+// With CTRACE_FLIGHT_RECORDER the events only go to per thread rings in
+// memory, written out when a dump is asked for; see ctrace_flight.h.
+#ifdef CTRACE_FLIGHT_RECORDER
+#ifdef CTRACE_AGGREGATE
+#error "CTRACE_FLIGHT_RECORDER and CTRACE_AGGREGATE do not mix"
+#endif // CTRACE_AGGREGATE
+class CTraceFlightRing;
+#endif // CTRACE_FLIGHT_RECORDER
+
+// Unless the events are aggregated or kept in memory, a fatal signal
+// makes the sink write what the threads have collected, and the
+// outermost CTRACE_OPEN_SCOPES scopes each of them has open as "B"
+// events, before the process goes down; see ctrace_crash.h.
+#if !defined(CTRACE_AGGREGATE) && !defined(CTRACE_FLIGHT_RECORDER)
+#define CTRACE_FINISH_ON_CRASH
+#ifndef CTRACE_OPEN_SCOPES
+#define CTRACE_OPEN_SCOPES 128
+#endif // CTRACE_OPEN_SCOPES
+#endif
+
+// Unless built with CTRACE_COMPENSATE_OVERHEAD=0 the runtime times its
+// own scopes before the first one and takes their cost off the
+// timestamps; see ctrace_overhead.h.
+#ifndef CTRACE_COMPENSATE_OVERHEAD
+#define CTRACE_COMPENSATE_OVERHEAD 1
+#endif // CTRACE_COMPENSATE_OVERHEAD
+
 class CTrace
 {
 public:
   CTrace (const char *cat, const char *name);
+  CTrace (const CTraceFuncDesc *desc);
   ~CTrace ();
 
   void CommonInit ();
 
+  // A sample of the counter track called name, C_TRACE_COUNTER.
+  static void Counter (const char *cat, const char *name, int64_t value);
+
+  struct ThreadState;
+
   const char *cat_;
   const char *name_;
-  int pid_;
-  int tid_;
+  ThreadState *state_;
   uint64_t clock_;
   uint64_t clock_real_;
 #ifdef CTRACE_THREAD_SUPPORTED
   uint64_t clock_thread_;
   uint64_t clock_thread_real_;
 #endif
+  // what the scopes the thread finished had cost when this one began.
+  // Kept without CTRACE_COMPENSATE_OVERHEAD, so the plugin's frames fit
+  // either build.
+  uint64_t stolen_;
+  uint64_t stolen_thread_;
   static const int64_t kMillisecondsPerSecond = 1000;
   static const int64_t kMicrosecondsPerMillisecond = 1000;
   static const int64_t kMicrosecondsPerSecond = kMicrosecondsPerMillisecond
@@ -54,13 +132,93 @@ public:
   static const int64_t kNanosecondsPerSecond = kNanosecondsPerMicrosecond
                                                * kMicrosecondsPerSecond;
 
+  // A finished scope, as it is kept in the per thread buffers.  ts_ and
+  // dur_ are CTraceClock ticks, converted when the buffer is written.  A
+  // counter sample has its value packed in dur_ (CTraceCounter).
+  struct Event
+  {
+    const char *cat_;
+    const char *name_;
+    uint64_t ts_;
+    uint64_t dur_;
+#ifdef CTRACE_THREAD_SUPPORTED
+    uint64_t tts_;
+    uint64_t tdur_;
+#endif // CTRACE_THREAD_SUPPORTED
+  };
+
+  struct Buffer
+  {
+    Buffer *next_;
+    int pid_;
+    int tid_;
+    int count_;
+    Event events_[CTRACE_EVENTS_PER_BUFFER];
+  };
+
+  // Everything a thread owns.  current_ and current_thread_ are the
+  // latest timestamps handed out on this thread; they keep nested scopes
+  // strictly increasing without any cross thread synchronization.
+  struct ThreadState
+  {
+    Buffer *buffer_;
+    uint64_t current_;
+#ifdef CTRACE_THREAD_SUPPORTED
+    uint64_t current_thread_;
+#endif // CTRACE_THREAD_SUPPORTED
+    ThreadState *prev_;
+    ThreadState *next_;
+#ifdef CTRACE_AGGREGATE
+    // The statistics of the thread, and the time spent in traced
+    // callees of each open scope: wall ticks and thread microseconds.
+    CTraceStatTable *stats_;
+    int depth_;
+    uint64_t children_[CTRACE_AGGREGATE_MAX_DEPTH];
+#ifdef CTRACE_THREAD_SUPPORTED
+    uint64_t children_thread_[CTRACE_AGGREGATE_MAX_DEPTH];
+#endif // CTRACE_THREAD_SUPPORTED
+#endif // CTRACE_AGGREGATE
+#ifdef CTRACE_FLIGHT_RECORDER
+    CTraceFlightRing *ring_;
+#endif // CTRACE_FLIGHT_RECORDER
+#ifdef CTRACE_FINISH_ON_CRASH
+    int open_depth_;
+    const CTrace *open_[CTRACE_OPEN_SCOPES];
+#endif // CTRACE_FINISH_ON_CRASH
+#ifndef CTRACE_AGGREGATE
+    // the alternate stack the crash hooks run on, if the sink gave it.
+    void *crash_stack_;
+#endif // CTRACE_AGGREGATE
+#if CTRACE_COMPENSATE_OVERHEAD
+    // The scopes open, and the cost of those finished since the
+    // outermost of them began: 1/65536 wall ticks and thread
+    // microseconds.
+    int nesting_;
+    uint64_t stolen_;
+    uint64_t stolen_thread_;
+#endif // CTRACE_COMPENSATE_OVERHEAD
+  };
+
 private:
+  class Sink;
   static void Submit (const CTrace *);
-  static uint64_t &GetCurrentTime ();
+#if CTRACE_COMPENSATE_OVERHEAD
+  CTrace (ThreadState *state, const char *cat, const char *name);
+  static void Calibrate ();
+  static void RunCalibration (void *, int);
+  static uint64_t Behind (uint64_t real, uint64_t shown);
+#endif // CTRACE_COMPENSATE_OVERHEAD
+  static void Append (ThreadState *, const Event &);
+#ifdef CTRACE_FLIGHT_RECORDER
+  static void Record (ThreadState *, const Event &);
+#endif // CTRACE_FLIGHT_RECORDER
+#ifdef CTRACE_AGGREGATE
+  static void Account (ThreadState *, const CTrace *, uint64_t dur,
+                       uint64_t dur_thread);
+#endif // CTRACE_AGGREGATE
+  static ThreadState *GetThreadState ();
+  static Sink &GetSink ();
 #ifdef CTRACE_THREAD_SUPPORTED
-  static uint64_t GetCurrentThreadTime ();
-  static void SetCurrentThreadTime (uint64_t);
-  static pthread_key_t GetThreadTimeKey ();
   struct Lock
   {
     Lock (pthread_mutex_t *mutex) : mutex_ (mutex)
@@ -70,278 +228,1514 @@ private:
     ~Lock () { pthread_mutex_unlock (mutex_); }
     pthread_mutex_t *mutex_;
   };
-  static pthread_mutex_t *GetCurrentTimeLock ();
-  static pthread_mutex_t *GetSubmitLock ();
+  static pthread_key_t &GetThreadStateKey ();
+  static void MakeThreadStateKey ();
+  static void DeleteThreadState (void *);
 #endif // CTRACE_THREAD_SUPPORTED
 };
 
 #define C_TRACE_0(cat, name) CTrace __trace__ (cat, name)
+// Records value as the current one of the counter track called name,
+// which the viewers draw over the timeline of the process.  Like a
+// scope, it goes through the buffer of the thread.
+#define C_TRACE_COUNTER(cat, name, value) CTrace::Counter (cat, name, value)
 
-#ifdef CTRACE_THREAD_SUPPORTED
+// The gcc plugin only needs the layout of CTrace, and gcc's own headers
+// poison some of the libc functions used below.
+#ifndef CTRACE_LAYOUT_ONLY
+#include <pthread.h>
+#include "ctrace_clock.h"
+#include "ctrace_crash.h"
+#include "ctrace_fork.h"
+#include "ctrace_format.h"
+#include "ctrace_overhead.h"
+#ifdef CTRACE_AGGREGATE
+#include "ctrace_stats.h"
+#endif // CTRACE_AGGREGATE
+#ifdef CTRACE_FLIGHT_RECORDER
+#include "ctrace_flight.h"
+#endif // CTRACE_FLIGHT_RECORDER
+#ifdef CTRACE_MMAP_OUTPUT
+#include <fcntl.h>
+#include "ctrace_mmap.h"
+#endif // CTRACE_MMAP_OUTPUT
+#ifdef CTRACE_GZIP_OUTPUT
+#include <fcntl.h>
+#include "ctrace_gzip.h"
+#endif // CTRACE_GZIP_OUTPUT
 
-inline uint64_t
-CTrace::GetCurrentThreadTime ()
+// The sink owns the output file.  Threads append raw events to their
+// own buffer without any locking, and only hand a full buffer over to
+// the sink.  With thread support a background thread drains the handed
+// over buffers, formats them and does the I/O; otherwise the buffer is
+// written out in place.  Whoever formats and writes holds io_lock_,
+// which a crash takes over.  A forked child starts over, with a file of
+// its own (ctrace_fork.h).
+class CTrace::Sink
 {
-  pthread_key_t key = GetThreadTimeKey ();
-#ifdef __LP64__
-  return reinterpret_cast<uint64_t> (pthread_getspecific (key));
+public:
+  Sink ();
+  ~Sink ();
+
+  Buffer *NewBuffer ();
+  Buffer *Handoff (Buffer *);
+#ifdef CTRACE_THREAD_SUPPORTED
+  void Retire (Buffer *);
+#endif // CTRACE_THREAD_SUPPORTED
+  void Register (ThreadState *);
+  void Unregister (ThreadState *);
+#if defined(CTRACE_AGGREGATE) && !defined(CTRACE_THREAD_SUPPORTED)
+  // Without a drain thread the only thread dumps, between its scopes.
+  void
+  MaybeDump (uint64_t now)
+  {
+    if (now >= next_dump_)
+      Dump (now);
+  }
+#endif // CTRACE_AGGREGATE && !CTRACE_THREAD_SUPPORTED
+
+private:
+  bool Open ();
+  void Write (const Buffer *);
+#ifndef CTRACE_BINARY_OUTPUT
+  void Format (const Buffer *, const Event &);
+#endif // CTRACE_BINARY_OUTPUT
+  void Flush ();
+  void Close ();
+  bool IsOpen () const;
+  void Abandon ();
+  static void PrepareFork ();
+  static void ParentAfterFork ();
+  static void ChildAfterFork ();
+  void AfterFork ();
+#ifdef CTRACE_FINISH_ON_CRASH
+  static void HandleCrash (int);
+  void Crash ();
+#ifndef CTRACE_BINARY_OUTPUT
+  bool CrashRoom (const char *cat, const char *name);
+  void CrashWrite (const Buffer *);
+  void CrashWriteOpen (const ThreadState *);
+  void CrashFlush ();
+#endif // CTRACE_BINARY_OUTPUT
+#endif // CTRACE_FINISH_ON_CRASH
+
+#if defined(CTRACE_MMAP_OUTPUT)
+  CTraceMappedFile mapped_;
+#elif defined(CTRACE_GZIP_OUTPUT)
+  CTraceGzipFile gzip_;
 #else
-  uint64_t *pdata = static_cast<uint64_t *> (pthread_getspecific (key));
-  if (pdata)
+  FILE *f_;
+  // f_ is a file the trailer can be rewritten in after every flush, not
+  // a pipe.
+  bool seekable_;
+#endif
+  CTraceCrashLock io_lock_;
+  bool failed_;
+  bool needComma_;
+  Buffer *free_;
+  ThreadState *threads_;
+  // Formatted output not yet written out, reused across buffers.
+  CTraceBytes out_;
+#ifdef CTRACE_AGGREGATE
+  void Dump (uint64_t now);
+  void AddStats (ThreadState *);
+  void RetireStats (ThreadState *);
+
+  CTraceStatSummary summary_;
+  // what threads that are gone had collected.
+  CTraceStatTable *retired_;
+  uint64_t next_dump_;
+#endif // CTRACE_AGGREGATE
+#ifdef CTRACE_BINARY_OUTPUT
+  CTraceBinaryWriter binary_;
+#endif // CTRACE_BINARY_OUTPUT
+#ifdef CTRACE_THREAD_SUPPORTED
+  static void *DrainThread (void *);
+  void Drain ();
+  void StartDrain ();
+  void Queue (Buffer *);
+#ifdef CTRACE_AGGREGATE
+  bool WaitForDump ();
+#endif // CTRACE_AGGREGATE
+
+  pthread_mutex_t mutex_;
+  pthread_cond_t cond_;
+  pthread_t drain_thread_;
+  bool drain_started_;
+  bool closing_;
+  Buffer *pending_head_;
+  Buffer *pending_tail_;
+  // the rest of the batch the drain thread is writing.
+  Buffer *unwritten_;
+  // events lost for want of memory for a fresh buffer.
+  uint64_t dropped_;
+#endif // CTRACE_THREAD_SUPPORTED
+};
+
+inline CTrace::Sink::Sink ()
+    : io_lock_ (), failed_ (false), needComma_ (false), free_ (NULL),
+      threads_ (NULL)
+{
+#if !defined(CTRACE_MMAP_OUTPUT) && !defined(CTRACE_GZIP_OUTPUT)
+  f_ = NULL;
+  seekable_ = false;
+#endif
+#ifdef CTRACE_AGGREGATE
+  retired_ = NULL;
+  next_dump_ = CTraceClock::Now ()
+               + CTRACE_AGGREGATE_INTERVAL_MS * 1000
+                     * CTraceClock::TicksPerMicrosecond ();
+#endif // CTRACE_AGGREGATE
+#ifdef CTRACE_THREAD_SUPPORTED
+  pthread_mutex_init (&mutex_, NULL);
+  pthread_cond_init (&cond_, NULL);
+  drain_started_ = false;
+  closing_ = false;
+  pending_head_ = NULL;
+  pending_tail_ = NULL;
+  unwritten_ = NULL;
+  dropped_ = 0;
+#endif // CTRACE_THREAD_SUPPORTED
+#ifdef CTRACE_FINISH_ON_CRASH
+  if (CTRACE_CATCH_FATAL_SIGNALS)
+    CTraceCrash::AddHook (HandleCrash);
+#endif // CTRACE_FINISH_ON_CRASH
+  CTraceFork::Init ();
+  pthread_atfork (PrepareFork, ParentAfterFork, ChildAfterFork);
+}
+
+inline CTrace::Sink::~Sink () { Close (); }
+
+inline CTrace::Buffer *
+CTrace::Sink::NewBuffer ()
+{
+  Buffer *buffer;
+  {
+    SINK_LOCK_VAR;
+    buffer = free_;
+    if (buffer)
+      free_ = buffer->next_;
+  }
+  if (!buffer)
     {
-      return *pdata;
+      buffer = static_cast<Buffer *> (malloc (sizeof (Buffer)));
+      if (!buffer)
+        return NULL;
     }
-  else
+  buffer->next_ = NULL;
+  buffer->pid_ = getpid ();
+  buffer->tid_ = syscall (__NR_gettid, 0);
+  buffer->count_ = 0;
+  return buffer;
+}
+
+inline bool
+CTrace::Sink::IsOpen () const
+{
+#if defined(CTRACE_MMAP_OUTPUT)
+  return mapped_.IsOpen ();
+#elif defined(CTRACE_GZIP_OUTPUT)
+  return gzip_.IsOpen ();
+#else
+  return f_ != NULL;
+#endif
+}
+
+inline bool
+CTrace::Sink::Open ()
+{
+  if (IsOpen ())
+    return true;
+  if (failed_)
+    return false;
+  char path[PATH_MAX];
+  CTraceFork::FileName (CTRACE_FILE_NAME, path, sizeof (path));
+#if defined(CTRACE_MMAP_OUTPUT)
+#ifdef CTRACE_BINARY_OUTPUT
+  const uint8_t filler = 0;
+#else
+  const uint8_t filler = ' ';
+#endif // CTRACE_BINARY_OUTPUT
+  int fd = CTraceFork::Traces ()
+               ? open (path, O_RDWR | O_CREAT | O_TRUNC, 0644)
+               : -1;
+  if (fd < 0 || !mapped_.Open (fd, filler))
+#elif defined(CTRACE_GZIP_OUTPUT)
+  int fd = CTraceFork::Traces ()
+               ? open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+               : -1;
+  if (fd < 0 || !gzip_.Open (fd, CTraceGzipFile::Level ()))
+#else
+  f_ = CTraceFork::Traces () ? fopen (path, "w") : NULL;
+  if (!f_)
+#endif
     {
-      return 0;
+      failed_ = true;
+      return false;
     }
+#if !defined(CTRACE_MMAP_OUTPUT) && !defined(CTRACE_GZIP_OUTPUT)
+  seekable_ = fseek (f_, 0, SEEK_CUR) == 0;
 #endif
+  // a crash formats into out_ without growing it.
+  out_.Reserve (1 << 16);
+#ifdef CTRACE_BINARY_OUTPUT
+  CTraceBinaryWriter::AppendHeader (&out_);
+  CTraceOverhead::AppendBinaryMetadata (&out_);
+  binary_.AddDescriptors (CTraceFuncDescBegin (), CTraceFuncDescEnd ());
+#else
+  CTraceOverhead::AppendJsonHeader (&out_);
+  needComma_ = CTraceJson::AppendDescriptors (
+      &out_, false, getpid (), CTraceFuncDescBegin (), CTraceFuncDescEnd ());
+#endif // CTRACE_BINARY_OUTPUT
+  return true;
 }
 
+// Writes out what has been formatted so far with a single fwrite, or
+// copies it into the mapping and checkpoints it there.  Either way the
+// trailer follows, and the next flush writes over it: the file is
+// complete between flushes, even if the process is killed.  A gzip
+// stream only gets its trailer at Close.
 inline void
-CTrace::SetCurrentThreadTime (uint64_t time)
+CTrace::Sink::Flush ()
 {
-  pthread_key_t key = GetThreadTimeKey ();
-#ifdef __LP64__
-  pthread_setspecific (key, reinterpret_cast<const void *> (time));
+#if defined(CTRACE_MMAP_OUTPUT)
+  mapped_.Append (out_.data_, out_.size_);
+#ifdef CTRACE_BINARY_OUTPUT
+  mapped_.Checkpoint (kCTraceBinaryTrailer, sizeof (kCTraceBinaryTrailer));
 #else
-  uint64_t *pdata = static_cast<uint64_t *> (pthread_getspecific (key));
-  if (pdata)
+  mapped_.Checkpoint (kCTraceJsonTrailer, sizeof (kCTraceJsonTrailer));
+#endif // CTRACE_BINARY_OUTPUT
+  out_.size_ = 0;
+#elif defined(CTRACE_GZIP_OUTPUT)
+  gzip_.Append (out_.data_, out_.size_);
+  out_.size_ = 0;
+#else
+#ifdef CTRACE_BINARY_OUTPUT
+  const long trailer = sizeof (kCTraceBinaryTrailer);
+  if (seekable_)
+    CTraceBinaryWriter::AppendTrailer (&out_);
+#else
+  const long trailer = sizeof (kCTraceJsonTrailer);
+  if (seekable_)
+    CTraceJson::AppendTrailer (&out_);
+#endif // CTRACE_BINARY_OUTPUT
+  if (out_.size_)
+    fwrite (out_.data_, out_.size_, 1, f_);
+  out_.size_ = 0;
+  fflush (f_);
+  if (seekable_)
+    fseek (f_, -trailer, SEEK_CUR);
+#endif
+}
+
+inline void
+CTrace::Sink::Write (const Buffer *buffer)
+{
+#ifdef CTRACE_FLIGHT_RECORDER
+  // nothing reaches the buffers, and the trace file is not created.
+  if (!buffer->count_)
+    return;
+#endif // CTRACE_FLIGHT_RECORDER
+  if (!Open ())
+    return;
+#ifdef CTRACE_BINARY_OUTPUT
+#ifdef CTRACE_THREAD_SUPPORTED
+  binary_.BeginBlock (buffer->pid_, buffer->tid_, true);
+  for (int i = 0; i < buffer->count_; ++i)
     {
-      *pdata = time;
+      const Event &e = buffer->events_[i];
+      uint64_t ts = CTraceClock::ToMicroseconds (e.ts_);
+      if (CTraceCounter::Is (e.dur_))
+        {
+          binary_.AddCounter (&out_, buffer->pid_, buffer->tid_, e.cat_,
+                              e.name_, ts, CTraceCounter::Value (e.dur_));
+          continue;
+        }
+      uint64_t dur = CTraceClock::ToMicroseconds (e.ts_ + e.dur_) - ts;
+      binary_.AddEvent (e.cat_, e.name_, ts, dur, e.tts_, e.tdur_);
     }
+#else
+  binary_.BeginBlock (buffer->pid_, buffer->tid_, false);
+  for (int i = 0; i < buffer->count_; ++i)
+    {
+      const Event &e = buffer->events_[i];
+      uint64_t ts = CTraceClock::ToMicroseconds (e.ts_);
+      if (CTraceCounter::Is (e.dur_))
+        {
+          binary_.AddCounter (&out_, buffer->pid_, buffer->tid_, e.cat_,
+                              e.name_, ts, CTraceCounter::Value (e.dur_));
+          continue;
+        }
+      uint64_t dur = CTraceClock::ToMicroseconds (e.ts_ + e.dur_) - ts;
+      binary_.AddEvent (e.cat_, e.name_, ts, dur);
+    }
+#endif // CTRACE_THREAD_SUPPORTED
+  binary_.EndBlock (&out_);
+#else
+  for (int i = 0; i < buffer->count_; ++i)
+    Format (buffer, buffer->events_[i]);
+#endif // CTRACE_BINARY_OUTPUT
+  Flush ();
+}
+
+#ifndef CTRACE_BINARY_OUTPUT
+
+inline void
+CTrace::Sink::Format (const Buffer *buffer, const Event &e)
+{
+  uint64_t ts = CTraceClock::ToMicroseconds (e.ts_);
+  if (CTraceCounter::Is (e.dur_))
+    {
+      CTraceJson::AppendCounterValue (&out_, needComma_, e.cat_, buffer->pid_,
+                                      buffer->tid_, ts, e.name_,
+                                      CTraceCounter::Value (e.dur_));
+      needComma_ = true;
+      return;
+    }
+  uint64_t dur = CTraceClock::ToMicroseconds (e.ts_ + e.dur_) - ts;
+#ifdef CTRACE_THREAD_SUPPORTED
+  CTraceJson::AppendEvent (&out_, needComma_, e.cat_, buffer->pid_,
+                           buffer->tid_, ts, e.name_, dur, true, e.tts_,
+                           e.tdur_);
+#else
+  CTraceJson::AppendEvent (&out_, needComma_, e.cat_, buffer->pid_,
+                           buffer->tid_, ts, e.name_, dur, false, 0, 0);
+#endif // CTRACE_THREAD_SUPPORTED
+  needComma_ = true;
+}
+
+#endif // CTRACE_BINARY_OUTPUT
+
+#ifdef CTRACE_AGGREGATE
+
+inline void
+CTrace::Sink::AddStats (ThreadState *state)
+{
+  if (state->stats_)
+    summary_.Add (*state->stats_);
+}
+
+inline void
+CTrace::Sink::RetireStats (ThreadState *state)
+{
+  if (!state->stats_)
+    return;
+  if (!retired_)
+    retired_ = CTraceStatTable::New ();
+  if (retired_)
+    retired_->Merge (*state->stats_);
+  CTraceStatTable::Delete (state->stats_);
+  state->stats_ = NULL;
+}
+
+// Merges the tables of all threads, live or gone, rewrites the summary
+// and adds the counters to the trace.  Only the drain thread, or the
+// one that closes the sink, dumps: mutex_ keeps the tables from being
+// retired while they are merged, and is let go before any I/O.
+inline void
+CTrace::Sink::Dump (uint64_t now)
+{
+  {
+    SINK_LOCK_VAR;
+    next_dump_ = now
+                 + CTRACE_AGGREGATE_INTERVAL_MS * 1000
+                       * CTraceClock::TicksPerMicrosecond ();
+    if (!CTraceFork::Traces ())
+      return;
+    summary_.Begin ();
+    for (ThreadState *state = threads_; state; state = state->next_)
+      AddStats (state);
+    if (retired_)
+      summary_.Add (*retired_);
+  }
+  char path[PATH_MAX];
+  CTraceFork::FileName (CTRACE_SUMMARY_FILE_NAME, path, sizeof (path));
+  FILE *f = fopen (path, "w");
+  if (f)
+    {
+      summary_.WriteTable (f);
+      fclose (f);
+    }
+  CTraceCrashLock::Hold hold (&io_lock_);
+  if (!Open ())
+    return;
+#ifndef CTRACE_BINARY_OUTPUT
+  summary_.AppendCounters (&out_, needComma_, getpid (),
+                           CTraceClock::ToMicroseconds (now));
+  needComma_ = true;
+#endif // CTRACE_BINARY_OUTPUT
+  Flush ();
+}
+
+#endif // CTRACE_AGGREGATE
+
+#ifdef CTRACE_THREAD_SUPPORTED
+
+inline CTrace::Buffer *
+CTrace::Sink::Handoff (Buffer *buffer)
+{
+  Buffer *fresh = NewBuffer ();
+  SINK_LOCK_VAR;
+  if (closing_ || !fresh)
+    {
+      // Too late, the drain thread is gone, or out of memory.  Keep
+      // collecting into the same buffer so the hot path never sees NULL,
+      // and lose its events.
+      if (fresh)
+        {
+          fresh->next_ = free_;
+          free_ = fresh;
+        }
+      else
+        {
+          dropped_ += buffer->count_;
+        }
+      buffer->count_ = 0;
+      return buffer;
+    }
+  Queue (buffer);
+  return fresh;
+}
+
+// Takes the buffer of a thread that exits, without allocating: queued
+// if it has events, else back on the free list for the next thread.
+inline void
+CTrace::Sink::Retire (Buffer *buffer)
+{
+  SINK_LOCK_VAR;
+  if (!buffer->count_ || closing_)
+    {
+      buffer->next_ = free_;
+      free_ = buffer;
+      return;
+    }
+  buffer->next_ = NULL;
+  Queue (buffer);
+}
+
+// Hands a buffer to the drain thread.  Called with mutex_ held.
+inline void
+CTrace::Sink::Queue (Buffer *buffer)
+{
+  if (pending_tail_)
+    pending_tail_->next_ = buffer;
   else
+    pending_head_ = buffer;
+  pending_tail_ = buffer;
+  StartDrain ();
+  pthread_cond_signal (&cond_);
+}
+
+// Called with mutex_ held.
+inline void
+CTrace::Sink::StartDrain ()
+{
+  if (!drain_started_)
+    drain_started_
+        = pthread_create (&drain_thread_, NULL, DrainThread, this) == 0;
+}
+
+inline void
+CTrace::Sink::Register (ThreadState *state)
+{
+#ifdef CTRACE_AGGREGATE
+  state->stats_ = CTraceStatTable::New ();
+  state->depth_ = 0;
+#endif // CTRACE_AGGREGATE
+#ifdef CTRACE_FLIGHT_RECORDER
+  CTraceFlightRecorder::Install ();
+  state->ring_ = CTraceFlightRing::Claim (getpid (),
+                                          syscall (__NR_gettid, 0), true);
+#endif // CTRACE_FLIGHT_RECORDER
+#ifndef CTRACE_AGGREGATE
+  state->crash_stack_
+      = CTRACE_CATCH_FATAL_SIGNALS ? CTraceCrash::AddStack () : NULL;
+#endif // CTRACE_AGGREGATE
+#ifdef CTRACE_FINISH_ON_CRASH
+  // a crash can not open the file.
+  if (!IsOpen ())
     {
-      pdata = static_cast<uint64_t *> (malloc (sizeof (uint64_t)));
-      if (pdata)
+      CTraceCrashLock::Hold hold (&io_lock_);
+      Open ();
+    }
+#endif // CTRACE_FINISH_ON_CRASH
+  SINK_LOCK_VAR;
+  state->prev_ = NULL;
+  state->next_ = threads_;
+  if (threads_)
+    threads_->prev_ = state;
+  threads_ = state;
+#ifdef CTRACE_AGGREGATE
+  // the threads hand nothing over, but the dumps are due all the same.
+  StartDrain ();
+#endif // CTRACE_AGGREGATE
+}
+
+inline void
+CTrace::Sink::Unregister (ThreadState *state)
+{
+  SINK_LOCK_VAR;
+  if (state->prev_)
+    state->prev_->next_ = state->next_;
+  else
+    threads_ = state->next_;
+  if (state->next_)
+    state->next_->prev_ = state->prev_;
+#ifdef CTRACE_AGGREGATE
+  RetireStats (state);
+#endif // CTRACE_AGGREGATE
+#ifdef CTRACE_FLIGHT_RECORDER
+  if (state->ring_)
+    state->ring_->Release ();
+#endif // CTRACE_FLIGHT_RECORDER
+#ifndef CTRACE_AGGREGATE
+  CTraceCrash::RemoveStack (state->crash_stack_);
+#endif // CTRACE_AGGREGATE
+}
+
+inline void *
+CTrace::Sink::DrainThread (void *arg)
+{
+  static_cast<Sink *> (arg)->Drain ();
+  return NULL;
+}
+
+inline void
+CTrace::Sink::Drain ()
+{
+  pthread_mutex_lock (&mutex_);
+  while (true)
+    {
+      while (!pending_head_ && !closing_)
+        {
+#ifdef CTRACE_AGGREGATE
+          if (!WaitForDump ())
+            break;
+#else
+          pthread_cond_wait (&cond_, &mutex_);
+#endif // CTRACE_AGGREGATE
+        }
+#ifdef CTRACE_AGGREGATE
+      if (!closing_ && CTraceClock::Now () >= next_dump_)
         {
-          *pdata = time;
-          pthread_setspecific (key, pdata);
+          pthread_mutex_unlock (&mutex_);
+          Dump (CTraceClock::Now ());
+          pthread_mutex_lock (&mutex_);
         }
+#endif // CTRACE_AGGREGATE
+      Buffer *batch = pending_head_;
+      if (!batch)
+        {
+          if (closing_)
+            break;
+          continue;
+        }
+      // a crash writes whatever of the batch is left.
+      unwritten_ = batch;
+      pending_head_ = pending_tail_ = NULL;
+      pthread_mutex_unlock (&mutex_);
+
+      Buffer *last = batch;
+      for (Buffer *buffer = batch; buffer; buffer = buffer->next_)
+        {
+          CTraceCrashLock::Hold hold (&io_lock_);
+          Write (buffer);
+          unwritten_ = buffer->next_;
+          last = buffer;
+        }
+
+      pthread_mutex_lock (&mutex_);
+      last->next_ = free_;
+      free_ = batch;
     }
+  pthread_mutex_unlock (&mutex_);
+}
+
+#ifdef CTRACE_AGGREGATE
+
+// Waits on cond_ until the next dump is due at the latest.  Called with
+// mutex_ held; false if the dump is already due.
+inline bool
+CTrace::Sink::WaitForDump ()
+{
+  uint64_t now = CTraceClock::Now ();
+  if (now >= next_dump_)
+    return false;
+  uint64_t us
+      = (next_dump_ - now) / CTraceClock::TicksPerMicrosecond () + 1;
+  struct timespec deadline;
+  clock_gettime (CLOCK_REALTIME, &deadline);
+  uint64_t ns = deadline.tv_nsec + us % 1000000 * 1000;
+  deadline.tv_sec += us / 1000000 + ns / 1000000000;
+  deadline.tv_nsec = ns % 1000000000;
+  pthread_cond_timedwait (&cond_, &mutex_, &deadline);
+  return true;
+}
+
+#endif // CTRACE_AGGREGATE
+
+inline void
+CTrace::Sink::Close ()
+{
+  {
+    SINK_LOCK_VAR;
+    closing_ = true;
+    pthread_cond_signal (&cond_);
+  }
+  if (drain_started_)
+    pthread_join (drain_thread_, NULL);
+#ifdef CTRACE_AGGREGATE
+  Dump (CTraceClock::Now ());
+#endif // CTRACE_AGGREGATE
+  CTraceCrashLock::Hold hold (&io_lock_);
+  // The drain thread is gone, whatever is still pending or sits in
+  // the buffers of live threads is written here.
+  for (Buffer *buffer = pending_head_; buffer; buffer = buffer->next_)
+    Write (buffer);
+  pending_head_ = pending_tail_ = NULL;
+  for (ThreadState *state = threads_; state; state = state->next_)
+    {
+      Write (state->buffer_);
+      state->buffer_->count_ = 0;
+    }
+  if (IsOpen ())
+    {
+#if defined(CTRACE_MMAP_OUTPUT)
+      // The checkpoint of Flush leaves the trailer, and Close keeps it.
+      Flush ();
+      mapped_.Close ();
+#elif defined(CTRACE_GZIP_OUTPUT)
+      CTraceJson::AppendTrailer (&out_);
+      Flush ();
+      gzip_.Close ();
+#else
+      // Flush leaves the trailer behind unless f_ is a pipe.
+      if (!seekable_)
+#ifdef CTRACE_BINARY_OUTPUT
+        CTraceBinaryWriter::AppendTrailer (&out_);
+#else
+        CTraceJson::AppendTrailer (&out_);
+#endif // CTRACE_BINARY_OUTPUT
+      Flush ();
+      fclose (f_);
+      f_ = NULL;
 #endif
+    }
+  if (dropped_)
+    fprintf (stderr, "ctrace: %" PRIu64 " events dropped, out of memory\n",
+             dropped_);
+}
+
+inline void
+CTrace::MakeThreadStateKey ()
+{
+  pthread_key_create (&GetThreadStateKey (), DeleteThreadState);
+  // once, before the first scope.
+  CTraceClock::Calibrate ();
+#if CTRACE_COMPENSATE_OVERHEAD
+  Calibrate ();
+#endif // CTRACE_COMPENSATE_OVERHEAD
 }
 
-inline pthread_key_t
-CTrace::GetThreadTimeKey ()
+inline pthread_key_t &
+CTrace::GetThreadStateKey ()
 {
   static pthread_key_t key;
-  static bool inited = false;
+  return key;
+}
+
+inline void
+CTrace::DeleteThreadState (void *arg)
+{
+  ThreadState *state = static_cast<ThreadState *> (arg);
+  Sink &sink = GetSink ();
+  sink.Unregister (state);
+  sink.Retire (state->buffer_);
+  free (state);
+}
+
+inline CTrace::ThreadState *
+CTrace::GetThreadState ()
+{
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once (&once, MakeThreadStateKey);
+  ThreadState *state
+      = static_cast<ThreadState *> (pthread_getspecific (GetThreadStateKey ()));
+  if (state)
+    return state;
+  state = static_cast<ThreadState *> (malloc (sizeof (ThreadState)));
+  if (!state)
+    return NULL;
+  state->current_ = 0;
+  state->current_thread_ = 0;
+#ifdef CTRACE_FINISH_ON_CRASH
+  state->open_depth_ = 0;
+#endif // CTRACE_FINISH_ON_CRASH
+#if CTRACE_COMPENSATE_OVERHEAD
+  state->nesting_ = 0;
+#endif // CTRACE_COMPENSATE_OVERHEAD
+  state->buffer_ = GetSink ().NewBuffer ();
+  if (!state->buffer_)
+    {
+      free (state);
+      return NULL;
+    }
+  GetSink ().Register (state);
+  pthread_setspecific (GetThreadStateKey (), state);
+  return state;
+}
 
-  if (!inited)
+#else
+
+inline CTrace::Buffer *
+CTrace::Sink::Handoff (Buffer *buffer)
+{
+  CTraceCrashLock::Hold hold (&io_lock_);
+  Write (buffer);
+  buffer->count_ = 0;
+  return buffer;
+}
+
+inline void
+CTrace::Sink::Register (ThreadState *state)
+{
+#ifdef CTRACE_AGGREGATE
+  state->stats_ = CTraceStatTable::New ();
+  state->depth_ = 0;
+#endif // CTRACE_AGGREGATE
+#ifdef CTRACE_FLIGHT_RECORDER
+  CTraceFlightRecorder::Install ();
+  state->ring_ = CTraceFlightRing::Claim (getpid (),
+                                          syscall (__NR_gettid, 0), false);
+#endif // CTRACE_FLIGHT_RECORDER
+#ifndef CTRACE_AGGREGATE
+  state->crash_stack_
+      = CTRACE_CATCH_FATAL_SIGNALS ? CTraceCrash::AddStack () : NULL;
+#endif // CTRACE_AGGREGATE
+#ifdef CTRACE_FINISH_ON_CRASH
+  // a crash can not open the file.
+  Open ();
+#endif // CTRACE_FINISH_ON_CRASH
+  threads_ = state;
+}
+
+inline void
+CTrace::Sink::Unregister (ThreadState *)
+{
+  threads_ = NULL;
+}
+
+inline void
+CTrace::Sink::Close ()
+{
+#ifdef CTRACE_AGGREGATE
+  Dump (CTraceClock::Now ());
+#endif // CTRACE_AGGREGATE
+  CTraceCrashLock::Hold hold (&io_lock_);
+  if (threads_)
+    {
+      Write (threads_->buffer_);
+      threads_->buffer_->count_ = 0;
+    }
+  if (IsOpen ())
     {
-#ifdef __LP64__
-      pthread_key_create (&key, NULL);
+#if defined(CTRACE_MMAP_OUTPUT)
+      // The checkpoint of Flush leaves the trailer, and Close keeps it.
+      Flush ();
+      mapped_.Close ();
+#elif defined(CTRACE_GZIP_OUTPUT)
+      CTraceJson::AppendTrailer (&out_);
+      Flush ();
+      gzip_.Close ();
+#else
+      // Flush leaves the trailer behind unless f_ is a pipe.
+      if (!seekable_)
+#ifdef CTRACE_BINARY_OUTPUT
+        CTraceBinaryWriter::AppendTrailer (&out_);
 #else
-      pthread_key_create (&key, free);
+        CTraceJson::AppendTrailer (&out_);
+#endif // CTRACE_BINARY_OUTPUT
+      Flush ();
+      fclose (f_);
+      f_ = NULL;
 #endif
-      inited = true;
     }
-  return key;
 }
 
-inline pthread_mutex_t *
-CTrace::GetCurrentTimeLock ()
+inline CTrace::ThreadState *
+CTrace::GetThreadState ()
 {
-  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-  return &mutex;
+  static ThreadState state;
+  if (!state.buffer_)
+    {
+      CTraceClock::Calibrate ();
+#if CTRACE_COMPENSATE_OVERHEAD
+      Calibrate ();
+#endif // CTRACE_COMPENSATE_OVERHEAD
+      state.buffer_ = GetSink ().NewBuffer ();
+      if (!state.buffer_)
+        return NULL;
+      GetSink ().Register (&state);
+    }
+  return &state;
 }
 
-inline pthread_mutex_t *
-CTrace::GetSubmitLock ()
+#endif // CTRACE_THREAD_SUPPORTED
+
+// Lets go of the file without writing to it, the parent going on with
+// it.
+inline void
+CTrace::Sink::Abandon ()
 {
-  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-  return &mutex;
+#if defined(CTRACE_MMAP_OUTPUT)
+  mapped_.Abandon ();
+#elif defined(CTRACE_GZIP_OUTPUT)
+  gzip_.Abandon ();
+#else
+  // Flush leaves nothing in the FILE's buffer for fclose to write.
+  if (f_)
+    fclose (f_);
+  f_ = NULL;
+#endif
 }
+
+// Keeps the sink still across fork(), so the child gets a copy with no
+// buffer or batch half written.  Locks in the order Dump takes them.
+inline void
+CTrace::Sink::PrepareFork ()
+{
+  Sink &sink = GetSink ();
+#ifdef CTRACE_THREAD_SUPPORTED
+  pthread_mutex_lock (&sink.mutex_);
 #endif // CTRACE_THREAD_SUPPORTED
+  sink.io_lock_.Lock ();
+}
 
-inline CTrace::CTrace (const char *cat, const char *name)
+inline void
+CTrace::Sink::ParentAfterFork ()
 {
-  cat_ = cat;
-  name_ = name;
-  CommonInit ();
+  Sink &sink = GetSink ();
+  sink.io_lock_.Unlock ();
+#ifdef CTRACE_THREAD_SUPPORTED
+  pthread_mutex_unlock (&sink.mutex_);
+#endif // CTRACE_THREAD_SUPPORTED
 }
 
-inline CTrace::~CTrace () { Submit (this); }
+inline void
+CTrace::Sink::ChildAfterFork ()
+{
+  Sink &sink = GetSink ();
+  sink.io_lock_.Unlock ();
+#ifdef CTRACE_THREAD_SUPPORTED
+  pthread_mutex_unlock (&sink.mutex_);
+#endif // CTRACE_THREAD_SUPPORTED
+  sink.AfterFork ();
+}
 
+// In the child, where only the thread that forked is left: the events
+// collected so far and the file are the parent's, and the drain thread
+// is gone.  The child starts over with the scopes its thread has open,
+// and creates its own file the way the parent did.
 inline void
-CTrace::CommonInit ()
+CTrace::Sink::AfterFork ()
 {
-  pid_ = getpid ();
-  tid_ = syscall (__NR_gettid, 0);
+  int pid = getpid ();
+  int tid = syscall (__NR_gettid, 0);
+#ifdef CTRACE_THREAD_SUPPORTED
+  ThreadState *self = static_cast<ThreadState *> (
+      pthread_getspecific (GetThreadStateKey ()));
+  pthread_cond_init (&cond_, NULL);
+  drain_started_ = false;
+  closing_ = false;
+  // the buffers of the last batch already written are lost.
+  Buffer *batches[] = { pending_head_, unwritten_ };
+  for (int i = 0; i < 2; ++i)
+    while (Buffer *buffer = batches[i])
+      {
+        batches[i] = buffer->next_;
+        buffer->next_ = free_;
+        free_ = buffer;
+      }
+  pending_head_ = pending_tail_ = NULL;
+  unwritten_ = NULL;
+  ThreadState *state = threads_;
+  threads_ = NULL;
+  while (state)
+    {
+      ThreadState *next = state->next_;
+      if (state != self)
+        {
+#ifdef CTRACE_AGGREGATE
+          if (state->stats_)
+            CTraceStatTable::Delete (state->stats_);
+#else
+          CTraceCrash::DeleteStack (state->crash_stack_);
+#endif // CTRACE_AGGREGATE
+          free (state->buffer_);
+          free (state);
+        }
+      state = next;
+    }
+  if (self)
+    {
+      self->prev_ = self->next_ = NULL;
+      threads_ = self;
+    }
+#else
+  ThreadState *self = threads_;
+#endif // CTRACE_THREAD_SUPPORTED
+  if (self)
+    {
+      self->buffer_->count_ = 0;
+      self->buffer_->pid_ = pid;
+      self->buffer_->tid_ = tid;
+#ifdef CTRACE_AGGREGATE
+      if (self->stats_)
+        self->stats_->Clear ();
+#endif // CTRACE_AGGREGATE
+    }
+#ifdef CTRACE_AGGREGATE
+  if (retired_)
+    CTraceStatTable::Delete (retired_);
+  retired_ = NULL;
+  summary_.Reset ();
+#endif // CTRACE_AGGREGATE
+#ifdef CTRACE_FLIGHT_RECORDER
+  CTraceFlightRecorder::AfterFork (self ? self->ring_ : NULL, pid, tid);
+#endif // CTRACE_FLIGHT_RECORDER
+  Abandon ();
+  failed_ = false;
+  needComma_ = false;
+  out_.size_ = 0;
+#ifdef CTRACE_BINARY_OUTPUT
+  binary_.Reset ();
+#endif // CTRACE_BINARY_OUTPUT
+#if defined(CTRACE_AGGREGATE) && defined(CTRACE_THREAD_SUPPORTED)
+  // the child's dumps need a drain thread of their own.
+  if (self)
+    {
+      SINK_LOCK_VAR;
+      StartDrain ();
+    }
+#endif // CTRACE_AGGREGATE && CTRACE_THREAD_SUPPORTED
+}
 
-  struct timespec ts;
-  if (clock_gettime (CLOCK_MONOTONIC, &ts) != 0)
+#ifdef CTRACE_FINISH_ON_CRASH
+
+inline void
+CTrace::Sink::HandleCrash (int)
+{
+  GetSink ().Crash ();
+}
+
+// Writes what the threads have collected and the scopes they have open,
+// with async signal safe calls only.  Gives up if the writer does not
+// finish in time, or if the crash is its own.  The binary format has no
+// open scopes, and formatting its events interns names, which
+// allocates; that file already ends after the last buffer written.
+inline void
+CTrace::Sink::Crash ()
+{
+  if (!IsOpen () || !io_lock_.LockForCrash ())
+    return;
+#ifndef CTRACE_BINARY_OUTPUT
+#ifdef CTRACE_THREAD_SUPPORTED
+  for (Buffer *buffer = unwritten_; buffer; buffer = buffer->next_)
+    CrashWrite (buffer);
+  // the other threads keep handing buffers over.
+  Buffer *tail = pending_tail_;
+  for (Buffer *buffer = pending_head_; buffer; buffer = buffer->next_)
     {
-      clock_ = 0;
+      CrashWrite (buffer);
+      if (buffer == tail)
+        break;
     }
-  else
+#endif // CTRACE_THREAD_SUPPORTED
+  for (ThreadState *state = threads_; state; state = state->next_)
+    CrashWrite (state->buffer_);
+  for (ThreadState *state = threads_; state; state = state->next_)
+    CrashWriteOpen (state);
+  if (out_.size_ + sizeof (kCTraceJsonTrailer) > out_.capacity_)
+    CrashFlush ();
+  CTraceJson::AppendTrailer (&out_);
+  CrashFlush ();
+#endif // CTRACE_BINARY_OUTPUT
+#if defined(CTRACE_MMAP_OUTPUT)
+  mapped_.Close ();
+#elif defined(CTRACE_GZIP_OUTPUT)
+  // Close would free zlib's state.
+  gzip_.Finish ();
+#endif
+}
+
+#ifndef CTRACE_BINARY_OUTPUT
+
+// Makes room for an event without growing out_, which would call
+// realloc.
+inline bool
+CTrace::Sink::CrashRoom (const char *cat, const char *name)
+{
+  size_t need = CTraceJson::MaxStringSize (cat)
+                + CTraceJson::MaxStringSize (name) + 200;
+  if (need > out_.capacity_)
+    return false;
+  if (out_.size_ + need > out_.capacity_)
+    CrashFlush ();
+  return true;
+}
+
+// The thread may still be adding to the buffer.
+inline void
+CTrace::Sink::CrashWrite (const Buffer *buffer)
+{
+  int count = buffer->count_;
+  if (count > CTRACE_EVENTS_PER_BUFFER)
+    count = CTRACE_EVENTS_PER_BUFFER;
+  for (int i = 0; i < count; ++i)
     {
-      clock_ = (static_cast<uint64_t> (ts.tv_sec)
-                * CTrace::kMicrosecondsPerSecond)
-               + (static_cast<uint64_t> (ts.tv_nsec)
-                  / CTrace::kNanosecondsPerMicrosecond);
-      clock_real_ = clock_;
+      const Event &e = buffer->events_[i];
+      if (e.name_ && CrashRoom (e.cat_, e.name_))
+        Format (buffer, e);
     }
+}
+
+// The thread may still be running, so a scope is only used if it is
+// still open once its fields have been read.
+inline void
+CTrace::Sink::CrashWriteOpen (const ThreadState *state)
+{
+  int depth = state->open_depth_;
+  if (depth > CTRACE_OPEN_SCOPES)
+    depth = CTRACE_OPEN_SCOPES;
+  for (int i = 0; i < depth; ++i)
+    {
+      const CTrace *scope = state->open_[i];
+      const char *cat = scope->cat_;
+      const char *name = scope->name_;
+      uint64_t ts = scope->clock_;
+#ifdef CTRACE_THREAD_SUPPORTED
+      uint64_t tts = scope->clock_thread_;
+#endif // CTRACE_THREAD_SUPPORTED
+      __sync_synchronize ();
+      if (state->open_depth_ <= i || state->open_[i] != scope)
+        break;
+      if (!CrashRoom (cat, name))
+        continue;
 #ifdef CTRACE_THREAD_SUPPORTED
-  struct timespec ts_thread;
-  if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts_thread) != 0)
+      CTraceJson::AppendBegin (&out_, needComma_, cat, state->buffer_->pid_,
+                               state->buffer_->tid_,
+                               CTraceClock::ToMicroseconds (ts), name, true,
+                               tts);
+#else
+      CTraceJson::AppendBegin (&out_, needComma_, cat, state->buffer_->pid_,
+                               state->buffer_->tid_,
+                               CTraceClock::ToMicroseconds (ts), name, false,
+                               0);
+#endif // CTRACE_THREAD_SUPPORTED
+      needComma_ = true;
+    }
+}
+
+// Flush with write() for the FILE, whose buffer is empty after every
+// Flush.
+inline void
+CTrace::Sink::CrashFlush ()
+{
+#if defined(CTRACE_MMAP_OUTPUT)
+  mapped_.Append (out_.data_, out_.size_);
+#elif defined(CTRACE_GZIP_OUTPUT)
+  gzip_.Append (out_.data_, out_.size_);
+#else
+  const uint8_t *data = out_.data_;
+  size_t size = out_.size_;
+  while (size)
     {
-      clock_thread_ = 0;
+      ssize_t written = write (fileno (f_), data, size);
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written <= 0)
+        break;
+      data += written;
+      size -= written;
     }
-  else
+#endif
+  out_.size_ = 0;
+}
+
+#endif // CTRACE_BINARY_OUTPUT
+
+#endif // CTRACE_FINISH_ON_CRASH
+
+inline CTrace::Sink &
+CTrace::GetSink ()
+{
+  static Sink sink;
+  return sink;
+}
+
+inline void
+CTrace::Append (ThreadState *state, const Event &event)
+{
+  Buffer *buffer = state->buffer_;
+  buffer->events_[buffer->count_++] = event;
+  if (buffer->count_ == CTRACE_EVENTS_PER_BUFFER)
+    state->buffer_ = GetSink ().Handoff (buffer);
+}
+
+#ifdef CTRACE_FLIGHT_RECORDER
+
+inline void
+CTrace::Record (ThreadState *state, const Event &event)
+{
+  if (!state->ring_)
+    return;
+  CTraceFlightEvent e;
+  e.cat_ = event.cat_;
+  e.name_ = event.name_;
+  e.ts_ = event.ts_;
+  e.dur_ = event.dur_;
+#ifdef CTRACE_THREAD_SUPPORTED
+  e.tts_ = event.tts_;
+  e.tdur_ = event.tdur_;
+#else
+  e.tts_ = e.tdur_ = 0;
+#endif // CTRACE_THREAD_SUPPORTED
+  state->ring_->Push (e);
+}
+
+#endif // CTRACE_FLIGHT_RECORDER
+
+#ifdef CTRACE_AGGREGATE
+
+inline void
+CTrace::Account (ThreadState *state, const CTrace *This, uint64_t dur,
+                 uint64_t dur_thread)
+{
+  uint64_t children = 0;
+  uint64_t children_thread = 0;
+  int depth = --state->depth_;
+  if (depth < CTRACE_AGGREGATE_MAX_DEPTH)
     {
-      clock_thread_ = (static_cast<uint64_t> (ts_thread.tv_sec)
-                       * CTrace::kMicrosecondsPerSecond)
-                      + (static_cast<uint64_t> (ts_thread.tv_nsec)
-                         / CTrace::kNanosecondsPerMicrosecond);
-      clock_thread_real_ = clock_thread_;
+      children = state->children_[depth];
+#ifdef CTRACE_THREAD_SUPPORTED
+      children_thread = state->children_thread_[depth];
+#endif // CTRACE_THREAD_SUPPORTED
     }
-  {
-    uint64_t current_thread = GetCurrentThreadTime ();
-    if (this->clock_thread_ <= current_thread)
-      this->clock_thread_ = current_thread + 1;
-    SetCurrentThreadTime (this->clock_thread_);
-  }
+  if (depth > 0 && depth <= CTRACE_AGGREGATE_MAX_DEPTH)
+    {
+      state->children_[depth - 1] += dur;
+#ifdef CTRACE_THREAD_SUPPORTED
+      state->children_thread_[depth - 1] += dur_thread;
 #endif // CTRACE_THREAD_SUPPORTED
-  {
-    CURRENT_TIME_LOCK_VAR;
-    uint64_t &current = GetCurrentTime ();
+    }
+  if (!state->stats_)
+    return;
+  CTraceStat *stat = state->stats_->Find (This->cat_, This->name_);
+  uint64_t start = CTraceClock::ToMicroseconds (This->clock_);
+  uint64_t self = dur > children ? dur - children : 0;
+  stat->AddCall ();
+  stat->AddTimes (CTraceClock::ToMicroseconds (This->clock_ + dur) - start,
+                  CTraceClock::ToMicroseconds (This->clock_ + self) - start,
+                  dur_thread,
+                  dur_thread > children_thread ? dur_thread - children_thread
+                                               : 0);
+}
 
-    if (this->clock_ <= current)
-      this->clock_ = current + 1;
-    current = this->clock_;
-  }
+#endif // CTRACE_AGGREGATE
+
+inline CTrace::CTrace (const char *cat, const char *name)
+{
+  cat_ = cat;
+  name_ = name;
+  state_ = GetThreadState ();
+  CommonInit ();
 }
 
-inline uint64_t &
-CTrace::GetCurrentTime ()
+inline CTrace::CTrace (const CTraceFuncDesc *desc)
 {
-  static uint64_t current = 0;
-  return current;
+  cat_ = desc->cat_;
+  name_ = desc->name_;
+  state_ = GetThreadState ();
+  CommonInit ();
+}
+
+#if CTRACE_COMPENSATE_OVERHEAD
+
+inline CTrace::CTrace (ThreadState *state, const char *cat, const char *name)
+{
+  cat_ = cat;
+  name_ = name;
+  state_ = state;
+  CommonInit ();
 }
 
 inline void
-CTrace::Submit (const CTrace *This)
+CTrace::RunCalibration (void *arg, int count)
 {
-  uint64_t dur, now;
+  ThreadState *state = static_cast<ThreadState *> (arg);
+  for (int i = 0; i < count; ++i)
+    {
+      {
+        CTrace scope (state, "ctrace", "calibration");
+      }
+      state->buffer_->count_ = 0;
+    }
+}
 
-  timespec ts;
-  if (clock_gettime (CLOCK_MONOTONIC, &ts) != 0)
+// How far a timestamp shown is behind the real one, as a cost.
+inline uint64_t
+CTrace::Behind (uint64_t real, uint64_t shown)
+{
+  return real > shown ? (real - shown) << CTraceOverhead::kFractionBits : 0;
+}
+
+// Times scopes on a thread state of their own, which the sink never
+// sees: it has no ring or statistics, and its buffer is emptied before
+// it fills.
+inline void
+CTrace::Calibrate ()
+{
+  ThreadState *state
+      = static_cast<ThreadState *> (calloc (1, sizeof (ThreadState)));
+  Buffer *buffer = static_cast<Buffer *> (calloc (1, sizeof (Buffer)));
+  if (state && buffer)
     {
-      now = 0;
+      state->buffer_ = buffer;
+      CTraceOverhead::Calibrate (RunCalibration, state);
     }
-  else
+  free (buffer);
+  free (state);
+}
+
+#endif // CTRACE_COMPENSATE_OVERHEAD
+
+inline CTrace::~CTrace () { Submit (this); }
+
+// Kept even when the scopes are only aggregated, and never left out as
+// jitter.  Inside compensated scopes the sample goes on their clock.
+inline void
+CTrace::Counter (const char *cat, const char *name, int64_t value)
+{
+  ThreadState *state = GetThreadState ();
+  if (!state)
+    return;
+  Event event;
+  event.cat_ = cat;
+  event.name_ = name;
+  event.ts_ = CTraceClock::Now ();
+  event.dur_ = CTraceCounter::Pack (value);
+#if CTRACE_COMPENSATE_OVERHEAD
+  if (state->nesting_)
+    event.ts_ -= state->stolen_ >> CTraceOverhead::kFractionBits;
+#endif // CTRACE_COMPENSATE_OVERHEAD
+  // not before the scopes the thread already finished.
+  if (event.ts_ < state->current_)
+    event.ts_ = state->current_;
+#ifdef CTRACE_THREAD_SUPPORTED
+  event.tts_ = event.tdur_ = 0;
+#endif // CTRACE_THREAD_SUPPORTED
+#ifdef CTRACE_FLIGHT_RECORDER
+  Record (state, event);
+#else
+  Append (state, event);
+#endif // CTRACE_FLIGHT_RECORDER
+}
+
+inline void
+CTrace::CommonInit ()
+{
+  clock_ = CTraceClock::Now ();
+  clock_real_ = clock_;
+  stolen_ = stolen_thread_ = 0;
+#if CTRACE_COMPENSATE_OVERHEAD
+  if (state_)
     {
-      now = (static_cast<uint64_t> (ts.tv_sec)
-             * CTrace::kMicrosecondsPerSecond)
-            + (static_cast<uint64_t> (ts.tv_nsec)
-               / CTrace::kNanosecondsPerMicrosecond);
+      if (state_->nesting_++ == 0)
+        state_->stolen_ = state_->stolen_thread_ = 0;
+      stolen_ = state_->stolen_;
+      stolen_thread_ = state_->stolen_thread_;
+      clock_ -= stolen_ >> CTraceOverhead::kFractionBits;
     }
+#endif // CTRACE_COMPENSATE_OVERHEAD
+#ifdef CTRACE_THREAD_SUPPORTED
+  clock_thread_ = CTraceClock::ThreadNow ();
+  clock_thread_real_ = clock_thread_;
+  if (state_)
+    {
+#if CTRACE_COMPENSATE_OVERHEAD
+      uint64_t stolen_thread = stolen_thread_ >> CTraceOverhead::kFractionBits;
+      clock_thread_ = clock_thread_ > stolen_thread
+                          ? clock_thread_ - stolen_thread
+                          : 0;
+#endif // CTRACE_COMPENSATE_OVERHEAD
+      uint64_t &current_thread = state_->current_thread_;
+      if (this->clock_thread_ <= current_thread)
+        {
+          this->clock_thread_ = current_thread + 1;
+#if CTRACE_COMPENSATE_OVERHEAD
+          // See below.
+          stolen_thread_ = Behind (clock_thread_real_, clock_thread_);
+          state_->stolen_thread_ = stolen_thread_;
+#endif // CTRACE_COMPENSATE_OVERHEAD
+        }
+      current_thread = this->clock_thread_;
+    }
+#endif // CTRACE_THREAD_SUPPORTED
+  if (state_)
+    {
+      uint64_t &current = state_->current_;
+
+      if (this->clock_ <= current)
+        {
+          this->clock_ = current + CTraceClock::TicksPerMicrosecond ();
+#if CTRACE_COMPENSATE_OVERHEAD
+          // Compensated, a scope starts about where the one before ended,
+          // and often gets held back this way.  A start held back is less
+          // behind the clock, and the scopes after it take less off
+          // theirs.
+          stolen_ = Behind (clock_real_, clock_);
+          state_->stolen_ = stolen_;
+#endif // CTRACE_COMPENSATE_OVERHEAD
+        }
+      current = this->clock_;
+#ifdef CTRACE_FINISH_ON_CRASH
+      int depth = state_->open_depth_;
+      if (depth < CTRACE_OPEN_SCOPES)
+        state_->open_[depth] = this;
+      state_->open_depth_ = depth + 1;
+#endif // CTRACE_FINISH_ON_CRASH
+#ifdef CTRACE_FLIGHT_RECORDER
+      if (state_->ring_)
+#ifdef CTRACE_THREAD_SUPPORTED
+        state_->ring_->Open (cat_, name_, clock_, clock_thread_);
+#else
+        state_->ring_->Open (cat_, name_, clock_, 0);
+#endif // CTRACE_THREAD_SUPPORTED
+#endif // CTRACE_FLIGHT_RECORDER
+#ifdef CTRACE_AGGREGATE
+      int depth = state_->depth_++;
+      if (depth < CTRACE_AGGREGATE_MAX_DEPTH)
+        {
+          state_->children_[depth] = 0;
+#ifdef CTRACE_THREAD_SUPPORTED
+          state_->children_thread_[depth] = 0;
+#endif // CTRACE_THREAD_SUPPORTED
+        }
+#endif // CTRACE_AGGREGATE
+    }
+}
+
+inline void
+CTrace::Submit (const CTrace *This)
+{
+  uint64_t dur, now;
+
+  now = CTraceClock::Now ();
   if (now <= This->clock_real_)
-    dur = 1;
+    dur = CTraceClock::TicksPerMicrosecond ();
   else
     dur = now - This->clock_real_;
 
-  if (dur < CTRACE_OMIT_JITTER)
+#ifdef CTRACE_FLIGHT_RECORDER
+  if (This->state_ && This->state_->ring_)
+    This->state_->ring_->Close ();
+#endif // CTRACE_FLIGHT_RECORDER
+#ifdef CTRACE_FINISH_ON_CRASH
+  if (This->state_)
+    This->state_->open_depth_--;
+#endif // CTRACE_FINISH_ON_CRASH
+#if CTRACE_COMPENSATE_OVERHEAD
+  // The callees' cost comes off the end, and this scope's goes to the
+  // caller, even if it is left out below.
+#ifdef CTRACE_THREAD_SUPPORTED
+  uint64_t stolen_thread = 0;
+#endif // CTRACE_THREAD_SUPPORTED
+  if (This->state_)
+    {
+      ThreadState *state = This->state_;
+      const int bits = CTraceOverhead::kFractionBits;
+      uint64_t stolen = (state->stolen_ >> bits) - (This->stolen_ >> bits);
+#ifdef CTRACE_THREAD_SUPPORTED
+      stolen_thread = (state->stolen_thread_ >> bits)
+                      - (This->stolen_thread_ >> bits);
+#endif // CTRACE_THREAD_SUPPORTED
+      dur = dur > stolen ? dur - stolen : CTraceClock::TicksPerMicrosecond ();
+      state->stolen_ += CTraceOverhead::Scope ();
+      state->stolen_thread_ += CTraceOverhead::ScopeThread ();
+      state->nesting_--;
+    }
+#endif // CTRACE_COMPENSATE_OVERHEAD
+#ifndef CTRACE_AGGREGATE
+  // statistics want every call.
+  if (dur < CTRACE_OMIT_JITTER * CTraceClock::TicksPerMicrosecond ())
     return;
+#endif // CTRACE_AGGREGATE
 
+  ThreadState *state = This->state_;
+  if (!state)
+    return;
   {
-    CURRENT_TIME_LOCK_VAR;
-    uint64_t &current = GetCurrentTime ();
+    uint64_t &current = state->current_;
     if (dur + This->clock_ < current)
       {
         dur = current - This->clock_;
+#if CTRACE_COMPENSATE_OVERHEAD
+        state->stolen_ = Behind (now, current) + CTraceOverhead::Scope ();
+#endif // CTRACE_COMPENSATE_OVERHEAD
       }
     current = This->clock_ + dur;
   }
 
 #ifdef CTRACE_THREAD_SUPPORTED
-  timespec ts_thread;
   uint64_t now_thread, dur_thread;
-  if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts_thread) != 0)
-    {
-      now_thread = 0;
-    }
-  else
-    {
-      now_thread = (static_cast<uint64_t> (ts_thread.tv_sec)
-                    * CTrace::kMicrosecondsPerSecond)
-                   + (static_cast<uint64_t> (ts_thread.tv_nsec)
-                      / CTrace::kNanosecondsPerMicrosecond);
-    }
+  now_thread = CTraceClock::ThreadNow ();
   if (now_thread <= This->clock_thread_real_)
     dur_thread = 1;
   else
     dur_thread = now_thread - This->clock_thread_real_;
+#if CTRACE_COMPENSATE_OVERHEAD
+  dur_thread = dur_thread > stolen_thread ? dur_thread - stolen_thread : 1;
+#endif // CTRACE_COMPENSATE_OVERHEAD
   {
-    uint64_t current = GetCurrentThreadTime ();
+    uint64_t &current = state->current_thread_;
     if (dur_thread + This->clock_thread_ < current)
       {
         dur_thread = current - This->clock_thread_;
+#if CTRACE_COMPENSATE_OVERHEAD
+        state->stolen_thread_
+            = Behind (now_thread, current) + CTraceOverhead::ScopeThread ();
+#endif // CTRACE_COMPENSATE_OVERHEAD
       }
-    SetCurrentThreadTime (This->clock_thread_ + dur_thread);
+    current = This->clock_thread_ + dur_thread;
   }
 
 #endif // CTRACE_THREAD_SUPPORTED
-  {
-    SUBMIT_LOCK_VAR;
-    static FILE *f;
-    static bool isInit = false;
-    struct FileSink
-    {
-      FileSink () : f_ (NULL) {}
-      ~FileSink ()
-      {
-        if (f_)
-          {
-            fprintf (f_, "]}");
-            fclose (f_);
-          }
-      }
-      FILE *f_;
-    };
-    static FileSink fsink;
-    static bool needComma = false;
-
-    if (!isInit)
-      {
-        f = fopen (CTRACE_FILE_NAME, "w");
-        if (!f)
-          return;
-        fprintf (f, "{\"traceEvents\": [");
-        fsink.f_ = f;
-        isInit = true;
-      }
-
-    if (!needComma)
-      {
-        needComma = true;
-      }
-    else
-      {
-        fprintf (f, ", ");
-      }
+#ifdef CTRACE_AGGREGATE
 #ifdef CTRACE_THREAD_SUPPORTED
-    fprintf (f, "{\"cat\":\"%s\", \"pid\":%d, \"tid\":%d, \"ts\":%" PRIu64
-                ", \"ph\":\"X\", \"name\":\"%s\", \"dur\":%" PRIu64
-                ", \"tts\":%" PRIu64 ", \"tdur\":%" PRIu64 "}",
-             This->cat_, This->pid_, This->tid_, This->clock_, This->name_,
-             dur, This->clock_thread_, dur_thread);
-
+  Account (state, This, dur, dur_thread);
 #else
-    fprintf (f, "{\"cat\":\"%s\", \"pid\":%d, \"tid\":%d, \"ts\":%" PRIu64 ", "
-                "\"ph\":\"X\", \"name\":\"%s\", \"dur\": %" PRIu64 "}",
-             This->cat_, This->pid_, This->tid_, This->clock_, This->name_,
-             dur);
+  Account (state, This, dur, 0);
 #endif // CTRACE_THREAD_SUPPORTED
-    static int flushCount = 0;
-    if (flushCount++ == 5)
-      {
-        fflush (f);
-        flushCount = 0;
-      }
-  }
+#ifndef CTRACE_THREAD_SUPPORTED
+  GetSink ().MaybeDump (now);
+#endif // CTRACE_THREAD_SUPPORTED
+  return;
+#endif // CTRACE_AGGREGATE
+  Event event;
+  event.cat_ = This->cat_;
+  event.name_ = This->name_;
+  event.ts_ = This->clock_;
+  event.dur_ = dur;
+#ifdef CTRACE_THREAD_SUPPORTED
+  event.tts_ = This->clock_thread_;
+  event.tdur_ = dur_thread;
+#endif // CTRACE_THREAD_SUPPORTED
+#ifdef CTRACE_FLIGHT_RECORDER
+  Record (state, event);
+#else
+  Append (state, event);
+#endif // CTRACE_FLIGHT_RECORDER
 }
 
+#endif // CTRACE_LAYOUT_ONLY
 #endif /* CTRACE_H */
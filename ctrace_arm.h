@@ -0,0 +1,84 @@
+#ifndef CTRACE_ARM_H
+#define CTRACE_ARM_H
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The armed flag.  Every runtime declares it through this header; the
+// one file of the runtime that defines CTRACE_ARM_IMPLEMENTATION before
+// including it also gets the definitions.
+//
+// Code built with -fplugin-arg-gentrace-armed loads __ctrace_armed__
+// once on function entry and only calls __start_ctrace__ and
+// __end_ctrace__ (or the _fn_ variants) if it was set, so a disarmed
+// binary pays a load and a predicted branch per call.  Since the entry
+// and the exit of one call use the same load, toggling the flag never
+// unbalances the runtime: calls that started disarmed end untraced.
+//
+// The flag starts set unless CTRACE_ARMED=0 is in the environment.  A
+// runtime built with -DCTRACE_ARM_SIGNAL=<signal> toggles it on that
+// signal, and the program itself can use ctrace_set_armed.  Code built
+// without the option is always traced.
+
+// Signal toggling the flag, 0 for none.  Off by default, so linking a
+// runtime never takes a signal away from the program.
+#ifndef CTRACE_ARM_SIGNAL
+#define CTRACE_ARM_SIGNAL 0
+#endif // CTRACE_ARM_SIGNAL
+
+extern "C" {
+extern volatile sig_atomic_t __ctrace_armed__;
+void ctrace_set_armed (int armed);
+int ctrace_armed ();
+}
+
+#ifdef CTRACE_ARM_IMPLEMENTATION
+
+extern "C" {
+volatile sig_atomic_t __ctrace_armed__ = 1;
+
+void
+ctrace_set_armed (int armed)
+{
+  __ctrace_armed__ = armed != 0;
+}
+
+int
+ctrace_armed ()
+{
+  return __ctrace_armed__;
+}
+}
+
+namespace
+{
+void
+ToggleArmed (int)
+{
+  __ctrace_armed__ = !__ctrace_armed__;
+}
+
+struct CTraceArmInitializer
+{
+  CTraceArmInitializer ()
+  {
+    const char *armed = getenv ("CTRACE_ARMED");
+    if (armed && *armed)
+      __ctrace_armed__ = strcmp (armed, "0") != 0;
+    if (CTRACE_ARM_SIGNAL)
+      {
+        struct sigaction action;
+        memset (&action, 0, sizeof (action));
+        action.sa_handler = ToggleArmed;
+        action.sa_flags = SA_RESTART;
+        sigemptyset (&action.sa_mask);
+        sigaction (CTRACE_ARM_SIGNAL, &action, NULL);
+      }
+  }
+};
+CTraceArmInitializer ctrace_arm_initializer;
+}
+
+#endif // CTRACE_ARM_IMPLEMENTATION
+
+#endif /* CTRACE_ARM_H */
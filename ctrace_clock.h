@@ -0,0 +1,228 @@
+#ifndef CTRACE_CLOCK_H
+#define CTRACE_CLOCK_H
+#include <stdint.h>
+#include <time.h>
+#if defined(CTRACE_CLOCK_TSC) && (defined(__i386__) || defined(__x86_64__))
+#include <cpuid.h>
+#endif
+
+// The wall clock of the runtimes.
+//
+// Timestamps are taken in ticks on the hot path and converted to
+// microseconds only when they are written out.  By default a tick is a
+// CLOCK_MONOTONIC microsecond.  With CTRACE_CLOCK_TSC a tick is a read
+// of the invariant time stamp counter (rdtsc on x86, cntvct_el0 on
+// ARM64), calibrated once against CLOCK_MONOTONIC by Calibrate, which
+// the runtimes call before their first scope.  If the counter is not
+// invariant the clock falls back to clock_gettime.
+//
+// The thread cpu clock has no cheap counter and always comes from
+// CLOCK_THREAD_CPUTIME_ID, in microseconds.
+
+// How long the TSC is calibrated against CLOCK_MONOTONIC.
+#ifndef CTRACE_TSC_CALIBRATION_US
+#define CTRACE_TSC_CALIBRATION_US 10000
+#endif // CTRACE_TSC_CALIBRATION_US
+
+// What the calibration found.  Zero until then, which is the
+// clock_gettime clock.
+struct CTraceClockCalibration
+{
+  bool calibrated_;
+  bool counter_;
+  uint64_t ticks_per_us_;
+  uint64_t base_ticks_;
+  uint64_t base_us_;
+  double us_per_tick_;
+};
+
+// The one calibration of the program.  A static member of a template
+// can be defined in a header, so every file including it shares the
+// object, and being zero initialized it is read without any guard.
+template <int N> struct CTraceClockState
+{
+  static CTraceClockCalibration calibration_;
+};
+
+template <int N> CTraceClockCalibration CTraceClockState<N>::calibration_;
+
+class CTraceClock
+{
+public:
+  // Calibrates the counter, the first time only.  Takes
+  // CTRACE_TSC_CALIBRATION_US with CTRACE_CLOCK_TSC.
+  static void Calibrate ();
+  // Current wall time in ticks.
+  static uint64_t Now ();
+  // Current thread cpu time in microseconds.
+  static uint64_t ThreadNow ();
+  // Ticks in one microsecond, rounded up.  Used to keep nested
+  // timestamps one microsecond apart.
+  static uint64_t TicksPerMicrosecond ();
+  // Converts a tick timestamp into a CLOCK_MONOTONIC microsecond.
+  static uint64_t ToMicroseconds (uint64_t ticks);
+  // Whether the TSC backend is in use.
+  static bool UsesCounter ();
+
+  static uint64_t MonotonicMicroseconds ();
+
+private:
+  static uint64_t ReadCounter ();
+  static bool HasInvariantCounter ();
+};
+
+inline uint64_t
+CTraceClock::MonotonicMicroseconds ()
+{
+  struct timespec ts;
+  if (clock_gettime (CLOCK_MONOTONIC, &ts) != 0)
+    return 0;
+  return static_cast<uint64_t> (ts.tv_sec) * 1000000
+         + static_cast<uint64_t> (ts.tv_nsec) / 1000;
+}
+
+inline uint64_t
+CTraceClock::ThreadNow ()
+{
+  struct timespec ts;
+  if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+    return 0;
+  return static_cast<uint64_t> (ts.tv_sec) * 1000000
+         + static_cast<uint64_t> (ts.tv_nsec) / 1000;
+}
+
+#ifdef CTRACE_CLOCK_TSC
+
+inline uint64_t
+CTraceClock::ReadCounter ()
+{
+#if defined(__i386__) || defined(__x86_64__)
+  uint32_t lo, hi;
+  __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+  return (static_cast<uint64_t> (hi) << 32) | lo;
+#elif defined(__aarch64__)
+  uint64_t value;
+  __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r"(value));
+  return value;
+#else
+  return 0;
+#endif
+}
+
+inline bool
+CTraceClock::HasInvariantCounter ()
+{
+#if defined(__i386__) || defined(__x86_64__)
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid (0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007)
+    return false;
+  __get_cpuid (0x80000007, &eax, &ebx, &ecx, &edx);
+  // Invariant TSC: constant rate in all P-, C- and T-states.
+  return (edx & (1u << 8)) != 0;
+#elif defined(__aarch64__)
+  // The generic timer counts at a constant frequency by definition.
+  return true;
+#else
+  return false;
+#endif
+}
+
+inline void
+CTraceClock::Calibrate ()
+{
+  CTraceClockCalibration &c = CTraceClockState<0>::calibration_;
+  if (c.calibrated_)
+    return;
+  c.calibrated_ = true;
+  if (!HasInvariantCounter ())
+    return;
+
+  uint64_t start_us = MonotonicMicroseconds ();
+  uint64_t start_ticks = ReadCounter ();
+  uint64_t end_us;
+  do
+    end_us = MonotonicMicroseconds ();
+  while (end_us - start_us < CTRACE_TSC_CALIBRATION_US);
+  uint64_t end_ticks = ReadCounter ();
+  if (end_ticks <= start_ticks)
+    return;
+
+  double ticks_per_us = static_cast<double> (end_ticks - start_ticks)
+                        / static_cast<double> (end_us - start_us);
+  if (ticks_per_us < 1.0)
+    return;
+  c.ticks_per_us_ = static_cast<uint64_t> (ticks_per_us) + 1;
+  c.us_per_tick_ = 1.0 / ticks_per_us;
+  c.base_ticks_ = end_ticks;
+  c.base_us_ = end_us;
+  c.counter_ = true;
+}
+
+inline uint64_t
+CTraceClock::Now ()
+{
+  if (CTraceClockState<0>::calibration_.counter_)
+    return ReadCounter ();
+  return MonotonicMicroseconds ();
+}
+
+inline uint64_t
+CTraceClock::TicksPerMicrosecond ()
+{
+  const CTraceClockCalibration &c = CTraceClockState<0>::calibration_;
+  return c.counter_ ? c.ticks_per_us_ : 1;
+}
+
+inline uint64_t
+CTraceClock::ToMicroseconds (uint64_t ticks)
+{
+  const CTraceClockCalibration &c = CTraceClockState<0>::calibration_;
+  if (!c.counter_)
+    return ticks;
+  if (ticks >= c.base_ticks_)
+    return c.base_us_
+           + static_cast<uint64_t> ((ticks - c.base_ticks_) * c.us_per_tick_);
+  return c.base_us_
+         - static_cast<uint64_t> ((c.base_ticks_ - ticks) * c.us_per_tick_);
+}
+
+inline bool
+CTraceClock::UsesCounter ()
+{
+  return CTraceClockState<0>::calibration_.counter_;
+}
+
+#else
+
+inline void
+CTraceClock::Calibrate ()
+{
+}
+
+inline uint64_t
+CTraceClock::Now ()
+{
+  return MonotonicMicroseconds ();
+}
+
+inline uint64_t
+CTraceClock::TicksPerMicrosecond ()
+{
+  return 1;
+}
+
+inline uint64_t
+CTraceClock::ToMicroseconds (uint64_t ticks)
+{
+  return ticks;
+}
+
+inline bool
+CTraceClock::UsesCounter ()
+{
+  return false;
+}
+
+#endif // CTRACE_CLOCK_TSC
+
+#endif /* CTRACE_CLOCK_H */
@@ -0,0 +1,133 @@
+// C Headers
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ctrace_format.h"
+#include "ctrace_perfetto.h"
+
+// Converts a binary trace written with CTRACE_BINARY_OUTPUT into the
+// chrome://tracing JSON format, or with -p into a Perfetto protobuf
+// trace (ctrace_perfetto.h), which the Perfetto UI and trace_processor
+// load much faster.  Events are streamed, so traces larger than memory
+// convert fine.
+//
+//   ctrace_convert [-p] <trace.ctrace> [<trace.json>|<trace.pftrace>]
+//
+// The output goes to stdout when no output file is given.  Perfetto has
+// no place for the metadata of the trace, nor for the source of the
+// functions, which are left out.
+
+// Converted events are written out in chunks of this size.
+static const size_t kFlushBytes = 1 << 20;
+
+static void
+Flush (FILE *out, CTraceBytes *json)
+{
+  fwrite (json->data_, json->size_, 1, out);
+  json->size_ = 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  bool perfetto = argc > 1 && strcmp (argv[1], "-p") == 0;
+  if (perfetto)
+    {
+      argv[1] = argv[0];
+      argc--;
+      argv++;
+    }
+  if (argc != 2 && argc != 3)
+    {
+      fprintf (stderr, "usage: %s [-p] <trace.ctrace> [<output>]\n",
+               argv[0]);
+      return 1;
+    }
+  FILE *in = fopen (argv[1], "rb");
+  if (!in)
+    {
+      perror (argv[1]);
+      return 1;
+    }
+  FILE *out = argc == 3 ? fopen (argv[2], "wb") : stdout;
+  if (!out)
+    {
+      perror (argv[2]);
+      return 1;
+    }
+
+  CTraceBinaryReader reader (in);
+  if (!reader.ReadHeader ())
+    {
+      fprintf (stderr, "%s: not a binary trace\n", argv[1]);
+      return 1;
+    }
+  CTraceBinaryReader::Event event;
+  CTraceBytes json;
+  if (perfetto)
+    {
+      CTracePerfettoWriter writer;
+      while (reader.Next (&event))
+        {
+          if (event.counter_)
+            writer.AppendCounter (&json, event.pid_, event.tid_, event.ts_,
+                                  event.name_, event.value_);
+          else
+            writer.AppendEvent (&json, event.cat_, event.pid_, event.tid_,
+                                event.ts_, event.name_, event.dur_,
+                                event.has_thread_time_, event.tts_,
+                                event.tdur_);
+          if (json.size_ >= kFlushBytes)
+            Flush (out, &json);
+        }
+      Flush (out, &json);
+      fclose (in);
+      if (out != stdout)
+        fclose (out);
+      return 0;
+    }
+  bool needComma = false;
+  int pid = 0;
+  CTraceJson::AppendHeader (&json);
+  while (reader.Next (&event))
+    {
+      if (!needComma)
+        pid = event.pid_;
+      if (event.counter_)
+        CTraceJson::AppendCounterValue (&json, needComma, event.cat_,
+                                        event.pid_, event.tid_, event.ts_,
+                                        event.name_, event.value_);
+      else
+        CTraceJson::AppendEvent (&json, needComma, event.cat_, event.pid_,
+                                 event.tid_, event.ts_, event.name_,
+                                 event.dur_, event.has_thread_time_,
+                                 event.tts_, event.tdur_);
+      needComma = true;
+      if (json.size_ >= kFlushBytes)
+        Flush (out, &json);
+    }
+  // the meta and name chunks can come anywhere, so the metadata and the
+  // sources go after the events.
+  reader.AppendSources (&json, needComma, pid);
+  json.PutRaw ("]");
+  size_t count = reader.MetadataCount ();
+  if (count)
+    {
+      const char *keys[count];
+      uint64_t values[count];
+      for (size_t i = 0; i < count; ++i)
+        {
+          keys[i] = reader.MetadataKey (i);
+          values[i] = reader.MetadataValue (i);
+        }
+      json.PutRaw (", ");
+      CTraceJson::AppendOtherData (&json, keys, values, count);
+    }
+  json.PutRaw ("}\n");
+  Flush (out, &json);
+  fclose (in);
+  if (out != stdout)
+    fclose (out);
+  return 0;
+}
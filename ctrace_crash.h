@@ -0,0 +1,236 @@
+#ifndef CTRACE_CRASH_H
+#define CTRACE_CRASH_H
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Fatal signal handling shared by the runtimes.
+//
+// On SIGSEGV, SIGBUS, SIGFPE, SIGILL or SIGABRT the hooks the runtimes
+// added run in order, then the handler that was there before gets the
+// signal.  The hooks may only use async signal safe calls.  Only the
+// first thread to crash runs them; another one that crashes meanwhile
+// waits for the process to go down.  The handler runs on an alternate
+// stack, so that it also runs when a thread overflowed its own; the
+// runtimes give one to every thread they trace.
+
+// Whether the runtimes finish their trace on a fatal signal.
+#ifndef CTRACE_CATCH_FATAL_SIGNALS
+#define CTRACE_CATCH_FATAL_SIGNALS 1
+#endif // CTRACE_CATCH_FATAL_SIGNALS
+
+// Size of the alternate stack of a thread.
+#ifndef CTRACE_CRASH_STACK_SIZE
+#define CTRACE_CRASH_STACK_SIZE (64 * 1024)
+#endif // CTRACE_CRASH_STACK_SIZE
+
+// How long a hook waits for a writer to finish its batch.
+#ifndef CTRACE_CRASH_WAIT_MS
+#define CTRACE_CRASH_WAIT_MS 1000
+#endif // CTRACE_CRASH_WAIT_MS
+
+// A lock a crash hook can take.  Writers hold it while they format and
+// write; the hook waits a bounded time for them, gives up at once if it
+// interrupted the holder itself, and keeps it.  Once the hook waits no
+// writer takes it again.  Zero initialized.
+struct CTraceCrashLock
+{
+  void
+  Lock ()
+  {
+    int self = syscall (__NR_gettid, 0);
+    while (wanted_ || !__sync_bool_compare_and_swap (&holder_, 0, self))
+      Pause ();
+  }
+
+  void
+  Unlock ()
+  {
+    __sync_lock_release (&holder_);
+  }
+
+  bool
+  LockForCrash ()
+  {
+    int self = syscall (__NR_gettid, 0);
+    wanted_ = 1;
+    for (int waited = 0;; ++waited)
+      {
+        if (__sync_bool_compare_and_swap (&holder_, 0, self))
+          return true;
+        if (holder_ == self || waited >= CTRACE_CRASH_WAIT_MS)
+          return false;
+        Pause ();
+      }
+  }
+
+  // Sleeps a millisecond.
+  static void
+  Pause ()
+  {
+    struct timespec delay = { 0, 1000000 };
+    nanosleep (&delay, NULL);
+  }
+
+  volatile int holder_;
+  volatile int wanted_;
+
+  struct Hold
+  {
+    Hold (CTraceCrashLock *lock) : lock_ (lock) { lock_->Lock (); }
+    ~Hold () { lock_->Unlock (); }
+    CTraceCrashLock *lock_;
+  };
+};
+
+class CTraceCrash
+{
+public:
+  typedef void (*Hook) (int signo);
+
+  // Installs the handlers with the first hook.  Not for signal handlers.
+  static void
+  AddHook (Hook hook)
+  {
+    State &state = Get ();
+    int index = __sync_fetch_and_add (&state.hooks_size_, 1);
+    if (index >= kMaxHooks)
+      return;
+    state.hooks_[index] = hook;
+    if (index != 0)
+      return;
+    struct sigaction action;
+    memset (&action, 0, sizeof (action));
+    action.sa_handler = Handle;
+    action.sa_flags = SA_ONSTACK;
+    sigemptyset (&action.sa_mask);
+    // a fault in a hook then kills the process instead of looping.
+    for (int i = 0; i < kSignals; ++i)
+      sigaddset (&action.sa_mask, Signal (i));
+    for (int i = 0; i < kSignals; ++i)
+      sigaction (Signal (i), &action, &state.previous_[i]);
+  }
+
+  // Maps an alternate stack, NULL if that fails.
+  static void *
+  NewStack ()
+  {
+    void *stack = mmap (NULL, CTRACE_CRASH_STACK_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return stack == MAP_FAILED ? NULL : stack;
+  }
+
+  static void
+  DeleteStack (void *stack)
+  {
+    if (stack)
+      munmap (stack, CTRACE_CRASH_STACK_SIZE);
+  }
+
+  // Makes stack the alternate stack of the calling thread, unless the
+  // thread already has one.  Returns whether the thread took it.
+  static bool
+  UseStack (void *stack)
+  {
+    stack_t current;
+    if (!stack || sigaltstack (NULL, &current) != 0
+        || !(current.ss_flags & SS_DISABLE))
+      return false;
+    stack_t alternate;
+    memset (&alternate, 0, sizeof (alternate));
+    alternate.ss_sp = stack;
+    alternate.ss_size = CTRACE_CRASH_STACK_SIZE;
+    return sigaltstack (&alternate, NULL) == 0;
+  }
+
+  // Takes stack back from the calling thread, if it uses it, so that
+  // another thread can.
+  static void
+  LeaveStack (void *stack)
+  {
+    stack_t current;
+    if (!stack || sigaltstack (NULL, &current) != 0 || current.ss_sp != stack
+        || (current.ss_flags & (SS_DISABLE | SS_ONSTACK)))
+      return;
+    stack_t none;
+    memset (&none, 0, sizeof (none));
+    none.ss_flags = SS_DISABLE;
+    sigaltstack (&none, NULL);
+  }
+
+  // A stack of its own for the calling thread, NULL if it has one
+  // already or none can be had.  Goes with RemoveStack.
+  static void *
+  AddStack ()
+  {
+    void *stack = NewStack ();
+    if (UseStack (stack))
+      return stack;
+    DeleteStack (stack);
+    return NULL;
+  }
+
+  static void
+  RemoveStack (void *stack)
+  {
+    LeaveStack (stack);
+    DeleteStack (stack);
+  }
+
+private:
+  static const int kSignals = 5;
+  static const int kMaxHooks = 4;
+
+  struct State
+  {
+    int hooks_size_;
+    Hook hooks_[kMaxHooks];
+    int crashing_;
+    struct sigaction previous_[kSignals];
+  };
+
+  static State &
+  Get ()
+  {
+    static State state;
+    return state;
+  }
+
+  static int
+  Signal (int i)
+  {
+    static const int signals[kSignals]
+        = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+    return signals[i];
+  }
+
+  // Runs the hooks, then puts the previous handler back and raises the
+  // signal again; it is delivered to that handler once this one
+  // returns.
+  static void
+  Handle (int signo)
+  {
+    State &state = Get ();
+    if (__sync_bool_compare_and_swap (&state.crashing_, 0, 1))
+      {
+        int size = state.hooks_size_;
+        for (int i = 0; i < size && i < kMaxHooks; ++i)
+          if (state.hooks_[i])
+            state.hooks_[i](signo);
+      }
+    else
+      {
+        while (true)
+          CTraceCrashLock::Pause ();
+      }
+    for (int i = 0; i < kSignals; ++i)
+      if (Signal (i) == signo)
+        sigaction (signo, &state.previous_[i], NULL);
+    raise (signo);
+  }
+};
+
+#endif /* CTRACE_CRASH_H */
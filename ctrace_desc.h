@@ -0,0 +1,43 @@
+#ifndef CTRACE_DESC_H
+#define CTRACE_DESC_H
+#include <stddef.h>
+#include <stdint.h>
+
+// Static description of an instrumented function.  The gcc plugin
+// emits one per function into the ctrace_fdesc section and passes its
+// address to __start_ctrace_fn__/__end_ctrace_fn__, so events only
+// carry a pointer and the names, with the file and line the function
+// is defined at, can be written once per trace.  The same function may
+// have a descriptor in several objects.
+//
+// The plugin builds the same layout by hand, keep them in sync.
+struct CTraceFuncDesc
+{
+  const char *name_;
+  const char *cat_;
+  const char *file_;
+  uint32_t line_;
+};
+
+#define CTRACE_FDESC_SECTION "ctrace_fdesc"
+
+// Bounds of the section, provided by the linker when any object has
+// descriptors.
+extern "C" {
+extern const CTraceFuncDesc __start_ctrace_fdesc[] __attribute__ ((weak));
+extern const CTraceFuncDesc __stop_ctrace_fdesc[] __attribute__ ((weak));
+}
+
+inline const CTraceFuncDesc *
+CTraceFuncDescBegin ()
+{
+  return __start_ctrace_fdesc;
+}
+
+inline const CTraceFuncDesc *
+CTraceFuncDescEnd ()
+{
+  return __start_ctrace_fdesc ? __stop_ctrace_fdesc : __start_ctrace_fdesc;
+}
+
+#endif /* CTRACE_DESC_H */
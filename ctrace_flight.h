@@ -0,0 +1,393 @@
+#ifndef CTRACE_FLIGHT_H
+#define CTRACE_FLIGHT_H
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ctrace_clock.h"
+#include "ctrace_crash.h"
+#include "ctrace_format.h"
+#include "ctrace_overhead.h"
+
+// Flight recorder, used by the runtimes when built with
+// CTRACE_FLIGHT_RECORDER instead of writing events to the trace file.
+//
+// Every thread owns a ring of its latest finished events that
+// overwrites the oldest one when full, plus the scopes it has open.
+// Nothing is written until a dump: CTRACE_FLIGHT_RECORDER_SIGNAL, a
+// call to CTraceFlightRecorder::Dump or a fatal signal writes every ring
+// to CTRACE_FLIGHT_RECORDER_PREFIX<pid>-<n>.json.  Scopes still open at
+// that point are written as "B" events without an end, which the trace
+// viewers show as not finished; a finished scope never loses its start,
+// since it is only stored once it ends.
+//
+// A dump only uses async signal safe calls.  It reads the rings while
+// their threads keep going, and leaves out the events overwritten
+// while it copied them.
+
+// Memory of each thread's ring.
+#ifndef CTRACE_FLIGHT_RECORDER_BYTES
+#define CTRACE_FLIGHT_RECORDER_BYTES (1 << 20)
+#endif // CTRACE_FLIGHT_RECORDER_BYTES
+
+// Open scopes kept per thread, deeper ones are not shown as open.
+#ifndef CTRACE_FLIGHT_RECORDER_DEPTH
+#define CTRACE_FLIGHT_RECORDER_DEPTH 128
+#endif // CTRACE_FLIGHT_RECORDER_DEPTH
+
+#ifndef CTRACE_FLIGHT_RECORDER_SIGNAL
+#define CTRACE_FLIGHT_RECORDER_SIGNAL SIGUSR2
+#endif // CTRACE_FLIGHT_RECORDER_SIGNAL
+
+#ifndef CTRACE_FLIGHT_RECORDER_PREFIX
+#define CTRACE_FLIGHT_RECORDER_PREFIX "flight-"
+#endif // CTRACE_FLIGHT_RECORDER_PREFIX
+
+// ts_ and dur_ are CTraceClock ticks, tts_ and tdur_ microseconds.  A
+// counter sample has its value packed in dur_ (CTraceCounter).
+struct CTraceFlightEvent
+{
+  const char *cat_;
+  const char *name_;
+  uint64_t ts_;
+  uint64_t dur_;
+  uint64_t tts_;
+  uint64_t tdur_;
+};
+
+// A thread's events.  Rings are never unmapped: a thread that exits
+// releases its ring, which keeps its events until a new thread claims
+// it, and a dump can walk the list of all rings without any lock.
+class CTraceFlightRing
+{
+public:
+  // Reuses a released ring or maps a new one.  Not for signal handlers.
+  static CTraceFlightRing *
+  Claim (int pid, int tid, bool has_thread_time)
+  {
+    CTraceFlightRing *ring;
+    for (ring = Head (); ring; ring = ring->next_)
+      if (!ring->owned_
+          && __sync_bool_compare_and_swap (&ring->owned_, 0, 1))
+        break;
+    if (!ring)
+      {
+        void *memory = mmap (NULL, CTRACE_FLIGHT_RECORDER_BYTES,
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+          return NULL;
+        ring = static_cast<CTraceFlightRing *> (memory);
+        ring->owned_ = 1;
+        do
+          ring->next_ = Head ();
+        while (!__sync_bool_compare_and_swap (&Head (), ring->next_, ring));
+      }
+    ring->pid_ = pid;
+    ring->tid_ = tid;
+    ring->has_thread_time_ = has_thread_time;
+    ring->depth_ = 0;
+    ring->head_ = 0;
+    return ring;
+  }
+
+  void
+  Release ()
+  {
+    __sync_synchronize ();
+    owned_ = 0;
+  }
+
+  void
+  Push (const CTraceFlightEvent &event)
+  {
+    events_[head_ % Capacity ()] = event;
+    // publishes the event before the index.
+    __sync_synchronize ();
+    head_++;
+  }
+
+  // A scope starts; a zero ts_ means it has none yet, and is not shown
+  // until SetOpenTime gives it one.
+  void
+  Open (const char *cat, const char *name, uint64_t ts, uint64_t tts)
+  {
+    int depth = depth_;
+    if (depth < CTRACE_FLIGHT_RECORDER_DEPTH)
+      {
+        open_[depth].cat_ = cat;
+        open_[depth].name_ = name;
+        open_[depth].ts_ = ts;
+        open_[depth].tts_ = tts;
+        __sync_synchronize ();
+      }
+    depth_ = depth + 1;
+  }
+
+  void
+  SetOpenTime (int depth, uint64_t ts, uint64_t tts)
+  {
+    if (depth < CTRACE_FLIGHT_RECORDER_DEPTH)
+      {
+        open_[depth].tts_ = tts;
+        open_[depth].ts_ = ts;
+      }
+  }
+
+  void
+  Close ()
+  {
+    if (depth_ > 0)
+      depth_--;
+  }
+
+  static size_t
+  Capacity ()
+  {
+    return (CTRACE_FLIGHT_RECORDER_BYTES - sizeof (CTraceFlightRing))
+               / sizeof (CTraceFlightEvent)
+           + 1;
+  }
+
+  static CTraceFlightRing *&
+  Head ()
+  {
+    static CTraceFlightRing *head;
+    return head;
+  }
+
+  CTraceFlightRing *next_;
+  volatile int owned_;
+  int pid_;
+  int tid_;
+  bool has_thread_time_;
+  volatile int depth_;
+  volatile uint64_t head_;
+  struct OpenScope
+  {
+    const char *cat_;
+    const char *name_;
+    volatile uint64_t ts_;
+    uint64_t tts_;
+  } open_[CTRACE_FLIGHT_RECORDER_DEPTH];
+  // Capacity () of them, to the end of the mapping.
+  CTraceFlightEvent events_[1];
+};
+
+// Dumps the rings, see above.
+class CTraceFlightRecorder
+{
+public:
+  // Sets up the dump buffer and the signal handlers.  Called by the
+  // runtimes before the first ring is claimed.
+  static void
+  Install ()
+  {
+    State &state = Get ();
+    if (!__sync_bool_compare_and_swap (&state.installed_, 0, 1))
+      return;
+    state.out_ = new CTraceBytes;
+    state.out_->Reserve (kBufferBytes);
+    struct sigaction action;
+    memset (&action, 0, sizeof (action));
+    sigemptyset (&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    if (CTRACE_FLIGHT_RECORDER_SIGNAL)
+      {
+        action.sa_handler = HandleDump;
+        sigaction (CTRACE_FLIGHT_RECORDER_SIGNAL, &action, NULL);
+      }
+    if (CTRACE_CATCH_FATAL_SIGNALS)
+      CTraceCrash::AddHook (HandleDump);
+  }
+
+  // Writes every ring to a new file.  Async signal safe.  Returns false
+  // if another dump is running or the file can not be written.
+  static bool
+  Dump ()
+  {
+    State &state = Get ();
+    if (!state.out_ || !__sync_bool_compare_and_swap (&state.busy_, 0, 1))
+      return false;
+    int saved_errno = errno;
+    char path[sizeof (CTRACE_FLIGHT_RECORDER_PREFIX) + 48];
+    char *p = CTraceJson::PutRaw (path, CTRACE_FLIGHT_RECORDER_PREFIX);
+    p = CTraceJson::PutUint (p, getpid ());
+    *p++ = '-';
+    p = CTraceJson::PutUint (p, state.dumps_++);
+    p = CTraceJson::PutRaw (p, ".json");
+    *p = '\0';
+    int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0;
+    if (ok)
+      {
+        CTraceBytes *out = state.out_;
+        bool comma = false;
+        out->size_ = 0;
+        CTraceOverhead::AppendJsonHeader (out);
+        DumpDescriptors (fd, out, &comma);
+        for (CTraceFlightRing *ring = CTraceFlightRing::Head (); ring;
+             ring = ring->next_)
+          DumpRing (fd, out, ring, &comma);
+        CTraceJson::AppendTrailer (out);
+        ok = Write (fd, out);
+        close (fd);
+      }
+    errno = saved_errno;
+    __sync_synchronize ();
+    state.busy_ = 0;
+    return ok;
+  }
+
+  // In the child of a fork: every ring but keep, the ring of the thread
+  // that forked, now pid and tid, is gone with its thread, and the events
+  // of all of them belong to the parent.  The scopes keep has open stay.
+  static void
+  AfterFork (CTraceFlightRing *keep, int pid, int tid)
+  {
+    for (CTraceFlightRing *ring = CTraceFlightRing::Head (); ring;
+         ring = ring->next_)
+      {
+        ring->head_ = 0;
+        if (ring == keep)
+          {
+            ring->pid_ = pid;
+            ring->tid_ = tid;
+            continue;
+          }
+        ring->depth_ = 0;
+        ring->owned_ = 0;
+      }
+    // a dump another thread was writing.
+    Get ().busy_ = 0;
+  }
+
+private:
+  static const size_t kBufferBytes = 1 << 16;
+
+  struct State
+  {
+    int installed_;
+    int busy_;
+    uint64_t dumps_;
+    CTraceBytes *out_;
+  };
+
+  // Zero initialized, so a handler never runs a constructor.
+  static State &
+  Get ()
+  {
+    static State state;
+    return state;
+  }
+
+  static void
+  HandleDump (int)
+  {
+    Dump ();
+  }
+
+  static bool
+  Write (int fd, CTraceBytes *out)
+  {
+    const uint8_t *data = out->data_;
+    size_t size = out->size_;
+    out->size_ = 0;
+    while (size)
+      {
+        ssize_t written = write (fd, data, size);
+        if (written < 0 && errno == EINTR)
+          continue;
+        if (written <= 0)
+          return false;
+        data += written;
+        size -= written;
+      }
+    return true;
+  }
+
+  // Makes room for an event without growing the buffer, which would
+  // call realloc.
+  static bool
+  Room (int fd, CTraceBytes *out, const char *cat, const char *name,
+        const char *file = "")
+  {
+    size_t need = CTraceJson::MaxStringSize (cat)
+                  + CTraceJson::MaxStringSize (name)
+                  + CTraceJson::MaxStringSize (file) + 256;
+    if (need > out->capacity_)
+      return false;
+    if (out->size_ + need > out->capacity_)
+      Write (fd, out);
+    return true;
+  }
+
+  // The source of every function, as the trace files have it.
+  static void
+  DumpDescriptors (int fd, CTraceBytes *out, bool *comma)
+  {
+    const CTraceFuncDesc *end = CTraceFuncDescEnd ();
+    for (const CTraceFuncDesc *desc = CTraceFuncDescBegin (); desc < end;
+         ++desc)
+      {
+        if (!Room (fd, out, desc->cat_, desc->name_, desc->file_))
+          continue;
+        CTraceJson::AppendSource (out, *comma, getpid (), desc->cat_,
+                                  desc->name_, desc->file_, desc->line_);
+        *comma = true;
+      }
+  }
+
+  static void
+  DumpRing (int fd, CTraceBytes *out, CTraceFlightRing *ring, bool *comma)
+  {
+    const size_t capacity = CTraceFlightRing::Capacity ();
+    uint64_t head = ring->head_;
+    __sync_synchronize ();
+    for (uint64_t i = head > capacity ? head - capacity : 0; i < head; ++i)
+      {
+        CTraceFlightEvent e = ring->events_[i % capacity];
+        __sync_synchronize ();
+        // the thread may have come round to this slot meanwhile.
+        if (ring->head_ >= i + capacity)
+          continue;
+        if (!e.name_ || !Room (fd, out, e.cat_, e.name_))
+          continue;
+        uint64_t ts = CTraceClock::ToMicroseconds (e.ts_);
+        if (CTraceCounter::Is (e.dur_))
+          {
+            CTraceJson::AppendCounterValue (out, *comma, e.cat_, ring->pid_,
+                                            ring->tid_, ts, e.name_,
+                                            CTraceCounter::Value (e.dur_));
+            *comma = true;
+            continue;
+          }
+        uint64_t dur = CTraceClock::ToMicroseconds (e.ts_ + e.dur_) - ts;
+        CTraceJson::AppendEvent (out, *comma, e.cat_, ring->pid_, ring->tid_,
+                                 ts, e.name_, dur, ring->has_thread_time_,
+                                 e.tts_, e.tdur_);
+        *comma = true;
+      }
+    int depth = ring->depth_;
+    if (depth > CTRACE_FLIGHT_RECORDER_DEPTH)
+      depth = CTRACE_FLIGHT_RECORDER_DEPTH;
+    for (int i = 0; i < depth; ++i)
+      {
+        const CTraceFlightRing::OpenScope &open = ring->open_[i];
+        uint64_t ts = open.ts_;
+        if (!ts || !open.name_ || !Room (fd, out, open.cat_, open.name_))
+          continue;
+        CTraceJson::AppendBegin (out, *comma, open.cat_, ring->pid_,
+                                 ring->tid_, CTraceClock::ToMicroseconds (ts),
+                                 open.name_, ring->has_thread_time_,
+                                 open.tts_);
+        *comma = true;
+      }
+  }
+};
+
+#endif /* CTRACE_FLIGHT_H */
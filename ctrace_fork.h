@@ -0,0 +1,88 @@
+#ifndef CTRACE_FORK_H
+#define CTRACE_FORK_H
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ctrace_format.h"
+
+// fork() support shared by the runtimes.
+//
+// A child of a traced process starts with a copy of the runtime: the
+// buffers hold events the parent writes, the output file is the
+// parent's, and the threads that write the trace are gone.  The runtimes
+// register pthread_atfork handlers.  Before the fork they take their
+// locks, so the copy has no batch half written.  In the child they drop
+// what the parent owns, start their threads again and trace into a file
+// of their own, created with the first batch so that a child that execs
+// or _exits right away leaves none: CTRACE_FILE_NAME with the pid in
+// front of the extension, trace.json becoming trace.<pid>.json.  A crash
+// before that batch loses what the child collected.  The summary and
+// folded stacks files are named the same way.  ctrace_merge puts the
+// traces of a process tree back on one timeline.
+//
+// With CTRACE_TRACE_CHILDREN=0 a child traces nothing.
+
+#ifndef CTRACE_TRACE_CHILDREN
+#define CTRACE_TRACE_CHILDREN 1
+#endif // CTRACE_TRACE_CHILDREN
+
+class CTraceFork
+{
+public:
+  // Remembers the process the tracing started in.  The first call
+  // counts.
+  static void
+  Init ()
+  {
+    __sync_bool_compare_and_swap (&Get (), 0, getpid ());
+  }
+
+  // Whether this process was forked from the one that started tracing.
+  static bool
+  IsChild ()
+  {
+    return Get () != 0 && Get () != getpid ();
+  }
+
+  // Whether this process writes a trace at all.
+  static bool
+  Traces ()
+  {
+    return CTRACE_TRACE_CHILDREN || !IsChild ();
+  }
+
+  // The name of a file of this process: name itself in the process that
+  // started tracing, name with ".<pid>" before its extension in a child.
+  static void
+  FileName (const char *name, char *path, size_t size)
+  {
+    size_t length = strlen (name);
+    if (!IsChild () || length + 24 > size)
+      {
+        snprintf (path, size, "%s", name);
+        return;
+      }
+    const char *base = strrchr (name, '/');
+    base = base ? base + 1 : name;
+    const char *extension = strchr (base, '.');
+    size_t stem = extension ? extension - name : length;
+    memcpy (path, name, stem);
+    char *p = path + stem;
+    *p++ = '.';
+    p = CTraceJson::PutUint (p, getpid ());
+    memcpy (p, name + stem, length - stem + 1);
+  }
+
+private:
+  static volatile int &
+  Get ()
+  {
+    static volatile int pid;
+    return pid;
+  }
+};
+
+#endif /* CTRACE_FORK_H */
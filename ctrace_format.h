@@ -0,0 +1,1250 @@
+#ifndef CTRACE_FORMAT_H
+#define CTRACE_FORMAT_H
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ctrace_desc.h"
+
+// Compact binary trace format.
+//
+// A file starts with the magic "CTRB" and a version byte, followed by
+// chunks.  Every chunk starts with a one byte tag:
+//
+//   'N' name:   varint id, string category, string name
+//               [, string file, varint line]            (version 4)
+//   'T' thread: varint pid, varint tid, varint flags, then events
+//   'M' meta:   string key, varint value                (version 2)
+//   'C' counter: varint pid, varint tid, varint name id, varint ts,
+//               zigzag varint value                     (version 3)
+//
+// A string is a varint length followed by the bytes.  An event is
+//
+//   varint (name id + 1), zigzag varint ts delta, varint dur
+//   [, zigzag varint tts delta, varint tdur]     if flags & kThreadTime
+//
+// and a zero name field ends the thread chunk.  The ts and tts deltas
+// are relative to the previous event of the same chunk (0 for the
+// first one).  A name chunk always precedes the first event using it.
+// A zero tag, or the end of the file, ends the trace.  Functions with a
+// plugin emitted descriptor are named up front, with the file and line
+// they are defined at; other names have an empty file and line 0.  Meta
+// chunks describe the trace as a whole, such as the runtime's own cost
+// per scope.  Counter chunks are one sample of the counter track called
+// by their name.
+//
+// ctrace_convert turns such a file back into chrome://tracing JSON.
+
+static const char kCTraceMagic[4] = { 'C', 'T', 'R', 'B' };
+static const uint8_t kCTraceVersion = 4;
+static const uint8_t kCTraceNameTag = 'N';
+static const uint8_t kCTraceThreadTag = 'T';
+static const uint8_t kCTraceMetaTag = 'M';
+static const uint8_t kCTraceCounterTag = 'C';
+static const uint64_t kCTraceThreadTime = 1;
+static const char kCTraceBinaryTrailer[1] = { 0 };
+static const char kCTraceJsonTrailer[2] = { ']', '}' };
+
+// A growable byte buffer.
+struct CTraceBytes
+{
+  CTraceBytes () : data_ (NULL), size_ (0), capacity_ (0) {}
+  ~CTraceBytes () { free (data_); }
+
+  bool
+  Reserve (size_t more)
+  {
+    if (size_ + more <= capacity_)
+      return true;
+    size_t capacity = capacity_ ? capacity_ : 4096;
+    while (capacity < size_ + more)
+      capacity *= 2;
+    uint8_t *data = static_cast<uint8_t *> (realloc (data_, capacity));
+    if (!data)
+      return false;
+    data_ = data;
+    capacity_ = capacity;
+    return true;
+  }
+
+  void
+  PutByte (uint8_t byte)
+  {
+    if (Reserve (1))
+      data_[size_++] = byte;
+  }
+
+  void
+  PutVarint (uint64_t value)
+  {
+    if (!Reserve (10))
+      return;
+    while (value >= 0x80)
+      {
+        data_[size_++] = static_cast<uint8_t> (value) | 0x80;
+        value >>= 7;
+      }
+    data_[size_++] = static_cast<uint8_t> (value);
+  }
+
+  void
+  PutZigzag (int64_t value)
+  {
+    PutVarint ((static_cast<uint64_t> (value) << 1)
+               ^ static_cast<uint64_t> (value >> 63));
+  }
+
+  void
+  PutBytes (const void *bytes, size_t length)
+  {
+    if (!Reserve (length))
+      return;
+    memcpy (data_ + size_, bytes, length);
+    size_ += length;
+  }
+
+  void
+  PutRaw (const char *str)
+  {
+    PutBytes (str, strlen (str));
+  }
+
+  void
+  PutString (const char *str)
+  {
+    size_t length = strlen (str);
+    PutVarint (length);
+    PutBytes (str, length);
+  }
+
+  uint8_t *data_;
+  size_t size_;
+  size_t capacity_;
+
+private:
+  CTraceBytes (const CTraceBytes &);
+  void operator= (const CTraceBytes &);
+};
+
+// How the runtimes keep a counter sample among the complete events of
+// their buffers: a duration with the top bit set, the value in the other
+// 63, which no real duration comes near.
+struct CTraceCounter
+{
+  static const uint64_t kFlag = 1ull << 63;
+
+  static uint64_t
+  Pack (int64_t value)
+  {
+    return static_cast<uint64_t> (value) | kFlag;
+  }
+
+  static bool
+  Is (uint64_t dur)
+  {
+    return (dur & kFlag) != 0;
+  }
+
+  static int64_t
+  Value (uint64_t dur)
+  {
+    return static_cast<int64_t> (dur << 1) >> 1;
+  }
+};
+
+// Hand written JSON formatting of trace events, much cheaper than
+// printf.  Appends to a CTraceBytes.
+struct CTraceJson
+{
+  static char *
+  PutUint (char *p, uint64_t value)
+  {
+    char digits[20];
+    int n = 0;
+    do
+      {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+      }
+    while (value);
+    while (n)
+      *p++ = digits[--n];
+    return p;
+  }
+
+  static char *
+  PutInt (char *p, int64_t value)
+  {
+    if (value < 0)
+      {
+        *p++ = '-';
+        return PutUint (p, -static_cast<uint64_t> (value));
+      }
+    return PutUint (p, value);
+  }
+
+  // Copies a literal without quoting it.
+  static char *
+  PutRaw (char *p, const char *str)
+  {
+    while (*str)
+      *p++ = *str++;
+    return p;
+  }
+
+  // Quotes and escapes a string.  Needs 6 bytes per input byte plus 2.
+  static char *
+  PutString (char *p, const char *str)
+  {
+    static const char hex[] = "0123456789abcdef";
+    *p++ = '"';
+    for (; *str; ++str)
+      {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\')
+          {
+            *p++ = '\\';
+            *p++ = c;
+          }
+        else if (c < 0x20)
+          {
+            p = PutRaw (p, "\\u00");
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 0xf];
+          }
+        else
+          {
+            *p++ = c;
+          }
+      }
+    *p++ = '"';
+    return p;
+  }
+
+  static size_t
+  MaxStringSize (const char *str)
+  {
+    return strlen (str) * 6 + 2;
+  }
+
+  // Appends a complete ("X") event, preceded by a comma unless it is the
+  // first event of the trace.
+  static void
+  AppendEvent (CTraceBytes *out, bool comma, const char *cat, int pid,
+               int tid, uint64_t ts, const char *name, uint64_t dur,
+               bool has_thread_time, uint64_t tts, uint64_t tdur)
+  {
+    if (!out->Reserve (MaxStringSize (cat) + MaxStringSize (name) + 200))
+      return;
+    char *p = reinterpret_cast<char *> (out->data_ + out->size_);
+    if (comma)
+      p = PutRaw (p, ", ");
+    p = PutRaw (p, "{\"cat\":");
+    p = PutString (p, cat);
+    p = PutRaw (p, ", \"pid\":");
+    p = PutInt (p, pid);
+    p = PutRaw (p, ", \"tid\":");
+    p = PutInt (p, tid);
+    p = PutRaw (p, ", \"ts\":");
+    p = PutUint (p, ts);
+    p = PutRaw (p, ", \"ph\":\"X\", \"name\":");
+    p = PutString (p, name);
+    p = PutRaw (p, ", \"dur\":");
+    p = PutUint (p, dur);
+    if (has_thread_time)
+      {
+        p = PutRaw (p, ", \"tts\":");
+        p = PutUint (p, tts);
+        p = PutRaw (p, ", \"tdur\":");
+        p = PutUint (p, tdur);
+      }
+    *p++ = '}';
+    out->size_ = reinterpret_cast<uint8_t *> (p) - out->data_;
+  }
+
+  // Appends a begin ("B") event without an end, for a scope that was
+  // still open when the trace was cut; the viewers show it as not
+  // finished.
+  static void
+  AppendBegin (CTraceBytes *out, bool comma, const char *cat, int pid,
+               int tid, uint64_t ts, const char *name, bool has_thread_time,
+               uint64_t tts)
+  {
+    if (!out->Reserve (MaxStringSize (cat) + MaxStringSize (name) + 200))
+      return;
+    char *p = reinterpret_cast<char *> (out->data_ + out->size_);
+    if (comma)
+      p = PutRaw (p, ", ");
+    p = PutRaw (p, "{\"cat\":");
+    p = PutString (p, cat);
+    p = PutRaw (p, ", \"pid\":");
+    p = PutInt (p, pid);
+    p = PutRaw (p, ", \"tid\":");
+    p = PutInt (p, tid);
+    p = PutRaw (p, ", \"ts\":");
+    p = PutUint (p, ts);
+    p = PutRaw (p, ", \"ph\":\"B\", \"name\":");
+    p = PutString (p, name);
+    if (has_thread_time)
+      {
+        p = PutRaw (p, ", \"tts\":");
+        p = PutUint (p, tts);
+      }
+    p = PutRaw (p, ", \"args\":{\"truncated\":true}}");
+    out->size_ = reinterpret_cast<uint8_t *> (p) - out->data_;
+  }
+
+  // Appends a counter ("C") event: one track called name, with a
+  // series per key.
+  static void
+  AppendCounter (CTraceBytes *out, bool comma, int pid, uint64_t ts,
+                 const char *name, const char *const *keys,
+                 const uint64_t *values, size_t count)
+  {
+    size_t size = MaxStringSize (name) + 100;
+    for (size_t i = 0; i < count; ++i)
+      size += MaxStringSize (keys[i]) + 24;
+    if (!out->Reserve (size))
+      return;
+    char *p = reinterpret_cast<char *> (out->data_ + out->size_);
+    if (comma)
+      p = PutRaw (p, ", ");
+    p = PutRaw (p, "{\"pid\":");
+    p = PutInt (p, pid);
+    p = PutRaw (p, ", \"ts\":");
+    p = PutUint (p, ts);
+    p = PutRaw (p, ", \"ph\":\"C\", \"name\":");
+    p = PutString (p, name);
+    p = PutRaw (p, ", \"args\":{");
+    for (size_t i = 0; i < count; ++i)
+      {
+        if (i)
+          p = PutRaw (p, ", ");
+        p = PutString (p, keys[i]);
+        *p++ = ':';
+        p = PutUint (p, values[i]);
+      }
+    p = PutRaw (p, "}}");
+    out->size_ = reinterpret_cast<uint8_t *> (p) - out->data_;
+  }
+
+  // Appends a counter ("C") event of one series, the sample of a counter
+  // the program recorded.
+  static void
+  AppendCounterValue (CTraceBytes *out, bool comma, const char *cat,
+                      int pid, int tid, uint64_t ts, const char *name,
+                      int64_t value)
+  {
+    if (!out->Reserve (MaxStringSize (cat) + MaxStringSize (name) + 200))
+      return;
+    char *p = reinterpret_cast<char *> (out->data_ + out->size_);
+    if (comma)
+      p = PutRaw (p, ", ");
+    p = PutRaw (p, "{\"cat\":");
+    p = PutString (p, cat);
+    p = PutRaw (p, ", \"pid\":");
+    p = PutInt (p, pid);
+    p = PutRaw (p, ", \"tid\":");
+    p = PutInt (p, tid);
+    p = PutRaw (p, ", \"ts\":");
+    p = PutUint (p, ts);
+    p = PutRaw (p, ", \"ph\":\"C\", \"name\":");
+    p = PutString (p, name);
+    p = PutRaw (p, ", \"args\":{\"value\":");
+    p = PutInt (p, value);
+    p = PutRaw (p, "}}");
+    out->size_ = reinterpret_cast<uint8_t *> (p) - out->data_;
+  }
+
+  // Appends a metadata ("M") event naming the source location of a
+  // function, once per descriptor, for the post-processing to look up
+  // by cat and name.  The viewers ignore it.
+  static void
+  AppendSource (CTraceBytes *out, bool comma, int pid, const char *cat,
+                const char *name, const char *file, uint32_t line)
+  {
+    if (!out->Reserve (MaxStringSize (cat) + MaxStringSize (name)
+                       + MaxStringSize (file) + 200))
+      return;
+    char *p = reinterpret_cast<char *> (out->data_ + out->size_);
+    if (comma)
+      p = PutRaw (p, ", ");
+    p = PutRaw (p, "{\"pid\":");
+    p = PutInt (p, pid);
+    p = PutRaw (p, ", \"tid\":0, \"ph\":\"M\", \"name\":\"ctrace_source\", "
+                   "\"args\":{\"cat\":");
+    p = PutString (p, cat);
+    p = PutRaw (p, ", \"name\":");
+    p = PutString (p, name);
+    p = PutRaw (p, ", \"file\":");
+    p = PutString (p, file);
+    p = PutRaw (p, ", \"line\":");
+    p = PutUint (p, line);
+    p = PutRaw (p, "}}");
+    out->size_ = reinterpret_cast<uint8_t *> (p) - out->data_;
+  }
+
+  // The source of every function of [begin, end).  Returns whether it
+  // appended any, so the next event knows whether it needs a comma.
+  static bool
+  AppendDescriptors (CTraceBytes *out, bool comma, int pid,
+                     const CTraceFuncDesc *begin, const CTraceFuncDesc *end)
+  {
+    for (const CTraceFuncDesc *desc = begin; desc < end; ++desc)
+      {
+        AppendSource (out, comma, pid, desc->cat_, desc->name_, desc->file_,
+                      desc->line_);
+        comma = true;
+      }
+    return comma;
+  }
+
+  // Appends "otherData":{...} with a number per key, the dictionary the
+  // viewers show as the metadata of the trace.
+  static void
+  AppendOtherData (CTraceBytes *out, const char *const *keys,
+                   const uint64_t *values, size_t count)
+  {
+    size_t size = 32;
+    for (size_t i = 0; i < count; ++i)
+      size += MaxStringSize (keys[i]) + 24;
+    if (!out->Reserve (size))
+      return;
+    char *p = reinterpret_cast<char *> (out->data_ + out->size_);
+    p = PutRaw (p, "\"otherData\":{");
+    for (size_t i = 0; i < count; ++i)
+      {
+        if (i)
+          p = PutRaw (p, ", ");
+        p = PutString (p, keys[i]);
+        *p++ = ':';
+        p = PutUint (p, values[i]);
+      }
+    *p++ = '}';
+    out->size_ = reinterpret_cast<uint8_t *> (p) - out->data_;
+  }
+
+  static void
+  AppendHeader (CTraceBytes *out)
+  {
+    out->PutRaw ("{\"traceEvents\": [");
+  }
+
+  // The header with metadata in front of the events, so the trailer
+  // stays the same.
+  static void
+  AppendHeader (CTraceBytes *out, const char *const *keys,
+                const uint64_t *values, size_t count)
+  {
+    out->PutByte ('{');
+    AppendOtherData (out, keys, values, count);
+    out->PutRaw (", \"traceEvents\": [");
+  }
+
+  static void
+  AppendTrailer (CTraceBytes *out)
+  {
+    out->PutBytes (kCTraceJsonTrailer, sizeof (kCTraceJsonTrailer));
+  }
+};
+
+// Encodes events into the binary format.  Names and categories are
+// interned by pointer, so they must be string literals or otherwise
+// stay alive and unchanged for the whole trace.
+class CTraceBinaryWriter
+{
+public:
+  CTraceBinaryWriter () : slots_ (NULL), mask_ (0), used_ (0), next_id_ (0)
+  {
+  }
+  ~CTraceBinaryWriter () { free (slots_); }
+
+  static void
+  AppendHeader (CTraceBytes *out)
+  {
+    out->PutBytes (kCTraceMagic, sizeof (kCTraceMagic));
+    out->PutByte (kCTraceVersion);
+  }
+
+  static void
+  AppendTrailer (CTraceBytes *out)
+  {
+    out->PutBytes (kCTraceBinaryTrailer, sizeof (kCTraceBinaryTrailer));
+  }
+
+  static void
+  AppendMetadata (CTraceBytes *out, const char *key, uint64_t value)
+  {
+    out->PutByte (kCTraceMetaTag);
+    out->PutString (key);
+    out->PutVarint (value);
+  }
+
+  // Forgets every name, for a new file.
+  void
+  Reset ()
+  {
+    if (slots_)
+      memset (slots_, 0, (mask_ + 1) * sizeof (Slot));
+    used_ = 0;
+    next_id_ = 0;
+    names_.size_ = 0;
+    block_.size_ = 0;
+  }
+
+  // Names every function of [begin, end) up front, with its source
+  // location, so the events of the trace only carry ids.
+  void
+  AddDescriptors (const CTraceFuncDesc *begin, const CTraceFuncDesc *end)
+  {
+    for (const CTraceFuncDesc *desc = begin; desc < end; ++desc)
+      Intern (desc->cat_, desc->name_, desc->file_, desc->line_);
+  }
+
+  void
+  BeginBlock (int pid, int tid, bool has_thread_time)
+  {
+    block_.PutByte (kCTraceThreadTag);
+    block_.PutVarint (pid);
+    block_.PutVarint (tid);
+    block_.PutVarint (has_thread_time ? kCTraceThreadTime : 0);
+    has_thread_time_ = has_thread_time;
+    last_ts_ = 0;
+    last_tts_ = 0;
+  }
+
+  void
+  AddEvent (const char *cat, const char *name, uint64_t ts, uint64_t dur,
+            uint64_t tts = 0, uint64_t tdur = 0)
+  {
+    block_.PutVarint (Intern (cat, name) + 1);
+    block_.PutZigzag (static_cast<int64_t> (ts - last_ts_));
+    block_.PutVarint (dur);
+    last_ts_ = ts;
+    if (has_thread_time_)
+      {
+        block_.PutZigzag (static_cast<int64_t> (tts - last_tts_));
+        block_.PutVarint (tdur);
+        last_tts_ = tts;
+      }
+  }
+
+  // Appends a counter chunk, after the names it is the first to use.
+  // Can come between the events of a block, which is still written in
+  // one piece.
+  void
+  AddCounter (CTraceBytes *out, int pid, int tid, const char *cat,
+              const char *name, uint64_t ts, int64_t value)
+  {
+    uint64_t id = Intern (cat, name);
+    out->PutBytes (names_.data_, names_.size_);
+    names_.size_ = 0;
+    out->PutByte (kCTraceCounterTag);
+    out->PutVarint (pid);
+    out->PutVarint (tid);
+    out->PutVarint (id);
+    out->PutVarint (ts);
+    out->PutZigzag (value);
+  }
+
+  // Appends the names first used by this block, then the block itself.
+  void
+  EndBlock (CTraceBytes *out)
+  {
+    block_.PutVarint (0);
+    out->PutBytes (names_.data_, names_.size_);
+    out->PutBytes (block_.data_, block_.size_);
+    names_.size_ = 0;
+    block_.size_ = 0;
+  }
+
+private:
+  struct Slot
+  {
+    const char *cat_;
+    const char *name_;
+    uint64_t id_;
+  };
+
+  uint64_t
+  Intern (const char *cat, const char *name, const char *file = "",
+          uint32_t line = 0)
+  {
+    const Slot *slot = Find (cat, name);
+    if (slot)
+      return slot->id_;
+    uint64_t id = next_id_++;
+    Insert (cat, name, file, line, id);
+    return id;
+  }
+
+  const Slot *
+  Find (const char *cat, const char *name) const
+  {
+    if (!slots_)
+      return NULL;
+    size_t i = Hash (cat, name) & mask_;
+    while (slots_[i].name_)
+      {
+        if (slots_[i].name_ == name && slots_[i].cat_ == cat)
+          return &slots_[i];
+        i = (i + 1) & mask_;
+      }
+    return NULL;
+  }
+
+  // Names id even when the table can not grow, so the events using it
+  // stay readable; the pair then gets another id on its next use.
+  void
+  Insert (const char *cat, const char *name, const char *file,
+          uint32_t line, uint64_t id)
+  {
+    names_.PutByte (kCTraceNameTag);
+    names_.PutVarint (id);
+    names_.PutString (cat);
+    names_.PutString (name);
+    names_.PutString (file);
+    names_.PutVarint (line);
+    if ((used_ + 1) * 2 > mask_ + 1 && !Grow ())
+      return;
+    size_t i = Hash (cat, name) & mask_;
+    while (slots_[i].name_)
+      i = (i + 1) & mask_;
+    slots_[i].cat_ = cat;
+    slots_[i].name_ = name;
+    slots_[i].id_ = id;
+    used_++;
+  }
+
+  static size_t
+  Hash (const char *cat, const char *name)
+  {
+    uintptr_t h = reinterpret_cast<uintptr_t> (name) * 31
+                  + reinterpret_cast<uintptr_t> (cat);
+    return (h >> 4) ^ (h >> 16);
+  }
+
+  bool
+  Grow ()
+  {
+    size_t size = slots_ ? (mask_ + 1) * 2 : 256;
+    Slot *slots = static_cast<Slot *> (calloc (size, sizeof (Slot)));
+    if (!slots)
+      return false;
+    for (size_t i = 0; slots_ && i <= mask_; ++i)
+      {
+        if (!slots_[i].name_)
+          continue;
+        size_t j = Hash (slots_[i].cat_, slots_[i].name_) & (size - 1);
+        while (slots[j].name_)
+          j = (j + 1) & (size - 1);
+        slots[j] = slots_[i];
+      }
+    free (slots_);
+    slots_ = slots;
+    mask_ = size - 1;
+    return true;
+  }
+
+  CTraceBytes names_;
+  CTraceBytes block_;
+  Slot *slots_;
+  size_t mask_;
+  size_t used_;
+  uint64_t next_id_;
+  bool has_thread_time_;
+  uint64_t last_ts_;
+  uint64_t last_tts_;
+
+  CTraceBinaryWriter (const CTraceBinaryWriter &);
+  void operator= (const CTraceBinaryWriter &);
+};
+
+// Decodes a binary trace from a FILE, one event at a time.
+class CTraceBinaryReader
+{
+public:
+  struct Event
+  {
+    int pid_;
+    int tid_;
+    const char *cat_;
+    const char *name_;
+    uint64_t ts_;
+    uint64_t dur_;
+    bool has_thread_time_;
+    uint64_t tts_;
+    uint64_t tdur_;
+    // a counter sample, with value_ and no duration.
+    bool counter_;
+    int64_t value_;
+  };
+
+  CTraceBinaryReader (FILE *f)
+      : f_ (f), version_ (0), names_ (NULL), names_size_ (0), meta_ (NULL),
+        meta_size_ (0), in_block_ (false)
+  {
+  }
+
+  ~CTraceBinaryReader ()
+  {
+    for (size_t i = 0; i < names_size_; ++i)
+      {
+        free (names_[i].cat_);
+        free (names_[i].name_);
+        free (names_[i].file_);
+      }
+    free (names_);
+    for (size_t i = 0; i < meta_size_; ++i)
+      free (meta_[i].key_);
+    free (meta_);
+  }
+
+  // Takes this and the previous versions, which lack the meta and the
+  // counter chunks, or the source of the names.
+  bool
+  ReadHeader ()
+  {
+    char magic[sizeof (kCTraceMagic)];
+    if (fread (magic, sizeof (magic), 1, f_) != 1
+        || memcmp (magic, kCTraceMagic, sizeof (magic)) != 0)
+      return false;
+    version_ = fgetc (f_);
+    return version_ >= 1 && version_ <= kCTraceVersion;
+  }
+
+  // The meta chunks read so far.
+  size_t
+  MetadataCount () const
+  {
+    return meta_size_;
+  }
+
+  const char *
+  MetadataKey (size_t i) const
+  {
+    return meta_[i].key_;
+  }
+
+  uint64_t
+  MetadataValue (size_t i) const
+  {
+    return meta_[i].value_;
+  }
+
+  // The ids named so far, some of which may be unused.
+  size_t
+  NameCount () const
+  {
+    return names_size_;
+  }
+
+  const char *
+  NameCategory (size_t id) const
+  {
+    return names_[id].cat_;
+  }
+
+  const char *
+  NameName (size_t id) const
+  {
+    return names_[id].name_;
+  }
+
+  // The file the function called id is defined at, NULL unless it had
+  // a descriptor.
+  const char *
+  NameFile (size_t id) const
+  {
+    return names_[id].file_;
+  }
+
+  uint32_t
+  NameLine (size_t id) const
+  {
+    return names_[id].line_;
+  }
+
+  // Appends the source of every name read so far that has one, the way
+  // CTraceJson::AppendDescriptors does for the JSON traces.  Returns
+  // whether the next event needs a comma.
+  bool
+  AppendSources (CTraceBytes *json, bool comma, int pid) const
+  {
+    for (size_t id = 0; id < names_size_; ++id)
+      {
+        if (!names_[id].file_)
+          continue;
+        CTraceJson::AppendSource (json, comma, pid, names_[id].cat_,
+                                  names_[id].name_, names_[id].file_,
+                                  names_[id].line_);
+        comma = true;
+      }
+    return comma;
+  }
+
+  // Returns false at the end of the trace.  A truncated trace simply
+  // ends early.
+  bool
+  Next (Event *event)
+  {
+    while (true)
+      {
+        if (in_block_)
+          {
+            uint64_t id;
+            if (!GetVarint (&id))
+              return false;
+            if (id == 0)
+              {
+                in_block_ = false;
+                continue;
+              }
+            if (id > names_size_ || !names_[id - 1].name_)
+              return false;
+            int64_t delta;
+            event->pid_ = pid_;
+            event->tid_ = tid_;
+            event->cat_ = names_[id - 1].cat_;
+            event->name_ = names_[id - 1].name_;
+            if (!GetZigzag (&delta) || !GetVarint (&event->dur_))
+              return false;
+            last_ts_ += delta;
+            event->ts_ = last_ts_;
+            event->has_thread_time_ = (flags_ & kCTraceThreadTime) != 0;
+            event->counter_ = false;
+            event->value_ = 0;
+            if (event->has_thread_time_)
+              {
+                if (!GetZigzag (&delta) || !GetVarint (&event->tdur_))
+                  return false;
+                last_tts_ += delta;
+                event->tts_ = last_tts_;
+              }
+            else
+              {
+                event->tts_ = event->tdur_ = 0;
+              }
+            return true;
+          }
+        int tag = fgetc (f_);
+        if (tag == kCTraceNameTag)
+          {
+            if (!ReadName ())
+              return false;
+          }
+        else if (tag == kCTraceMetaTag)
+          {
+            if (!ReadMeta ())
+              return false;
+          }
+        else if (tag == kCTraceCounterTag)
+          {
+            return ReadCounter (event);
+          }
+        else if (tag == kCTraceThreadTag)
+          {
+            uint64_t pid, tid;
+            if (!GetVarint (&pid) || !GetVarint (&tid)
+                || !GetVarint (&flags_))
+              return false;
+            pid_ = static_cast<int> (pid);
+            tid_ = static_cast<int> (tid);
+            last_ts_ = last_tts_ = 0;
+            in_block_ = true;
+          }
+        else
+          {
+            return false;
+          }
+      }
+  }
+
+private:
+  struct Name
+  {
+    char *cat_;
+    char *name_;
+    char *file_;
+    uint32_t line_;
+  };
+
+  struct Meta
+  {
+    char *key_;
+    uint64_t value_;
+  };
+
+  bool
+  ReadName ()
+  {
+    uint64_t id, line = 0;
+    char *cat, *name, *file = NULL;
+    if (!GetVarint (&id) || id > (1u << 30))
+      return false;
+    cat = GetString ();
+    name = cat ? GetString () : NULL;
+    if (name && version_ >= 4)
+      {
+        file = GetString ();
+        if (!file || !GetVarint (&line))
+          {
+            free (name);
+            name = NULL;
+          }
+      }
+    if (!name)
+      {
+        free (cat);
+        free (file);
+        return false;
+      }
+    if (id >= names_size_)
+      {
+        size_t size = id + 1 > names_size_ * 2 ? id + 1 : names_size_ * 2;
+        Name *names
+            = static_cast<Name *> (realloc (names_, size * sizeof (Name)));
+        if (!names)
+          return false;
+        memset (names + names_size_, 0, (size - names_size_) * sizeof (Name));
+        names_ = names;
+        names_size_ = size;
+      }
+    free (names_[id].cat_);
+    free (names_[id].name_);
+    free (names_[id].file_);
+    names_[id].cat_ = cat;
+    names_[id].name_ = name;
+    // an empty file is a name without a descriptor.
+    if (file && !*file)
+      {
+        free (file);
+        file = NULL;
+      }
+    names_[id].file_ = file;
+    names_[id].line_ = static_cast<uint32_t> (line);
+    return true;
+  }
+
+  bool
+  ReadMeta ()
+  {
+    uint64_t value;
+    char *key = GetString ();
+    if (!key || !GetVarint (&value))
+      {
+        free (key);
+        return false;
+      }
+    Meta *meta = static_cast<Meta *> (
+        realloc (meta_, (meta_size_ + 1) * sizeof (Meta)));
+    if (!meta)
+      {
+        free (key);
+        return false;
+      }
+    meta_ = meta;
+    meta_[meta_size_].key_ = key;
+    meta_[meta_size_].value_ = value;
+    meta_size_++;
+    return true;
+  }
+
+  bool
+  ReadCounter (Event *event)
+  {
+    uint64_t pid, tid, id;
+    if (!GetVarint (&pid) || !GetVarint (&tid) || !GetVarint (&id)
+        || id >= names_size_ || !names_[id].name_
+        || !GetVarint (&event->ts_) || !GetZigzag (&event->value_))
+      return false;
+    event->pid_ = static_cast<int> (pid);
+    event->tid_ = static_cast<int> (tid);
+    event->cat_ = names_[id].cat_;
+    event->name_ = names_[id].name_;
+    event->dur_ = 0;
+    event->has_thread_time_ = false;
+    event->tts_ = event->tdur_ = 0;
+    event->counter_ = true;
+    return true;
+  }
+
+  bool
+  GetVarint (uint64_t *value)
+  {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+      {
+        int c = fgetc (f_);
+        if (c == EOF)
+          return false;
+        result |= static_cast<uint64_t> (c & 0x7f) << shift;
+        if (!(c & 0x80))
+          {
+            *value = result;
+            return true;
+          }
+      }
+    return false;
+  }
+
+  bool
+  GetZigzag (int64_t *value)
+  {
+    uint64_t raw;
+    if (!GetVarint (&raw))
+      return false;
+    *value = static_cast<int64_t> (raw >> 1) ^ -static_cast<int64_t> (raw & 1);
+    return true;
+  }
+
+  char *
+  GetString ()
+  {
+    uint64_t length;
+    if (!GetVarint (&length) || length > (1u << 20))
+      return NULL;
+    char *str = static_cast<char *> (malloc (length + 1));
+    if (!str)
+      return NULL;
+    if (length && fread (str, length, 1, f_) != 1)
+      {
+        free (str);
+        return NULL;
+      }
+    str[length] = '\0';
+    return str;
+  }
+
+  FILE *f_;
+  int version_;
+  Name *names_;
+  size_t names_size_;
+  Meta *meta_;
+  size_t meta_size_;
+  bool in_block_;
+  int pid_;
+  int tid_;
+  uint64_t flags_;
+  uint64_t last_ts_;
+  uint64_t last_tts_;
+
+  CTraceBinaryReader (const CTraceBinaryReader &);
+  void operator= (const CTraceBinaryReader &);
+};
+
+// Numbers by key, the "otherData" of one or more traces.  A key keeps
+// the first value it is given.
+class CTraceOtherData
+{
+public:
+  CTraceOtherData () : keys_ (NULL), values_ (NULL), size_ (0) {}
+
+  ~CTraceOtherData ()
+  {
+    for (size_t i = 0; i < size_; ++i)
+      free (keys_[i]);
+    free (keys_);
+    free (values_);
+  }
+
+  void
+  Add (const char *key, size_t length, uint64_t value)
+  {
+    for (size_t i = 0; i < size_; ++i)
+      if (strlen (keys_[i]) == length && memcmp (keys_[i], key, length) == 0)
+        return;
+    char **keys
+        = static_cast<char **> (realloc (keys_, (size_ + 1) * sizeof (char *)));
+    if (!keys)
+      return;
+    keys_ = keys;
+    uint64_t *values = static_cast<uint64_t *> (
+        realloc (values_, (size_ + 1) * sizeof (uint64_t)));
+    if (!values)
+      return;
+    values_ = values;
+    keys_[size_] = static_cast<char *> (malloc (length + 1));
+    if (!keys_[size_])
+      return;
+    memcpy (keys_[size_], key, length);
+    keys_[size_][length] = '\0';
+    values_[size_++] = value;
+  }
+
+  // Adds the pairs of a JSON object of numbers, {"key":1,...}.
+  void
+  AddObject (const char *json, size_t size)
+  {
+    const char *end = json + size;
+    const char *p = json;
+    while (p < end)
+      {
+        const char *key
+            = static_cast<const char *> (memchr (p, '"', end - p));
+        if (!key)
+          return;
+        key++;
+        const char *close
+            = static_cast<const char *> (memchr (key, '"', end - key));
+        if (!close)
+          return;
+        p = close + 1;
+        while (p < end && (*p == ' ' || *p == ':'))
+          p++;
+        char *number_end;
+        uint64_t value = strtoull (p, &number_end, 10);
+        if (number_end != p)
+          Add (key, close - key, value);
+        p = number_end;
+      }
+  }
+
+  size_t
+  Count () const
+  {
+    return size_;
+  }
+
+  const char *
+  Key (size_t i) const
+  {
+    return keys_[i];
+  }
+
+  uint64_t
+  Value (size_t i) const
+  {
+    return values_[i];
+  }
+
+  // Appends , "otherData":{...}, to follow the events, if there is any.
+  void
+  AppendTo (CTraceBytes *out) const
+  {
+    if (!size_)
+      return;
+    out->PutRaw (", ");
+    CTraceJson::AppendOtherData (out, keys_, values_, size_);
+  }
+
+private:
+  char **keys_;
+  uint64_t *values_;
+  size_t size_;
+
+  CTraceOtherData (const CTraceOtherData &);
+  void operator= (const CTraceOtherData &);
+};
+
+// Reads the events of a JSON trace without parsing them: Next hands out
+// the text of one element of "traceEvents" at a time.  Only nesting and
+// strings are tracked, so a trace cut short by a kill or a crash simply
+// ends with its last complete event.  The numbers of "otherData" are
+// kept on the way, whichever side of the events it is on.
+class CTraceJsonReader
+{
+public:
+  CTraceJsonReader (FILE *f)
+      : f_ (f), depth_ (0), in_string_ (false), escaped_ (false),
+        in_events_ (false), in_other_data_ (false), copying_ (false)
+  {
+  }
+
+  // Returns false at the end of the trace.  event is not NUL terminated.
+  bool
+  Next (CTraceBytes *event)
+  {
+    int c;
+    while ((c = getc_unlocked (f_)) != EOF)
+      {
+        if (copying_)
+          event->PutByte (c);
+        if (in_string_)
+          {
+            if (escaped_)
+              escaped_ = false;
+            else if (c == '\\')
+              escaped_ = true;
+            else if (c == '"')
+              in_string_ = false;
+            if (depth_ == 1 && in_string_)
+              key_.PutByte (c);
+            continue;
+          }
+        switch (c)
+          {
+          case '"':
+            in_string_ = true;
+            if (depth_ == 1)
+              key_.size_ = 0;
+            break;
+          case '[':
+          case '{':
+            if (depth_ == 1)
+              {
+                key_.PutByte ('\0');
+                const char *key = reinterpret_cast<const char *> (key_.data_);
+                in_events_ = c == '[' && strcmp (key, "traceEvents") == 0;
+                in_other_data_ = c == '{' && strcmp (key, "otherData") == 0;
+                key_.size_ = 0;
+              }
+            if (!copying_
+                && ((depth_ == 2 && in_events_)
+                    || (depth_ == 1 && in_other_data_)))
+              {
+                copying_ = true;
+                event->size_ = 0;
+                event->PutByte (c);
+              }
+            depth_++;
+            break;
+          case ']':
+          case '}':
+            depth_--;
+            if (copying_ && depth_ == 2 && in_events_)
+              {
+                copying_ = false;
+                return true;
+              }
+            if (copying_ && depth_ == 1 && in_other_data_)
+              {
+                other_data_.AddObject (
+                    reinterpret_cast<const char *> (event->data_),
+                    event->size_);
+                event->size_ = 0;
+                copying_ = false;
+              }
+            if (depth_ == 1)
+              in_events_ = in_other_data_ = false;
+            break;
+          }
+      }
+    return false;
+  }
+
+  // The "otherData" read so far.
+  const CTraceOtherData &
+  OtherData () const
+  {
+    return other_data_;
+  }
+
+private:
+  FILE *f_;
+  // the last string of the outermost object, the key of what follows.
+  CTraceBytes key_;
+  CTraceOtherData other_data_;
+  int depth_;
+  bool in_string_;
+  bool escaped_;
+  bool in_events_;
+  bool in_other_data_;
+  bool copying_;
+
+  CTraceJsonReader (const CTraceJsonReader &);
+  void operator= (const CTraceJsonReader &);
+};
+
+#endif /* CTRACE_FORMAT_H */
@@ -0,0 +1,158 @@
+#ifndef CTRACE_GZIP_H
+#define CTRACE_GZIP_H
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// Gzip compressed trace output, used by the runtimes when built with
+// CTRACE_GZIP_OUTPUT (link with -lz).
+//
+// The formatted batches are deflated on the thread that writes them,
+// never on a traced one, and the file only sees whole chunks of
+// compressed output.  The result is a .json.gz that chrome://tracing
+// and the Perfetto UI load as is.  Unlike the plain file it is only
+// complete once closed: a process that is killed leaves a stream cut
+// at the last chunk written, which `zcat` still reads up to there.
+
+// zlib's compression level, 1 (fastest) to 9 (smallest).  The
+// CTRACE_GZIP_LEVEL environment variable overrides it.
+#ifndef CTRACE_GZIP_LEVEL
+#define CTRACE_GZIP_LEVEL 6
+#endif // CTRACE_GZIP_LEVEL
+
+class CTraceGzipFile
+{
+public:
+  CTraceGzipFile () : fd_ (-1), finished_ (false)
+  {
+    memset (&stream_, 0, sizeof (stream_));
+  }
+  ~CTraceGzipFile () { Close (); }
+
+  bool
+  IsOpen () const
+  {
+    return fd_ >= 0;
+  }
+
+  static int
+  Level ()
+  {
+    const char *level = getenv ("CTRACE_GZIP_LEVEL");
+    if (level && *level >= '0' && *level <= '9' && !level[1])
+      return *level - '0';
+    return CTRACE_GZIP_LEVEL;
+  }
+
+  // Takes over fd.  On failure fd is closed.
+  bool
+  Open (int fd, int level)
+  {
+    // 16 more window bits ask for the gzip header and trailer.
+    if (deflateInit2 (&stream_, level, Z_DEFLATED, 15 + 16, 8,
+                      Z_DEFAULT_STRATEGY)
+        != Z_OK)
+      {
+        close (fd);
+        return false;
+      }
+    fd_ = fd;
+    finished_ = false;
+    return true;
+  }
+
+  void
+  Append (const void *data, size_t size)
+  {
+    if (fd_ < 0 || finished_ || !size)
+      return;
+    stream_.next_in = static_cast<Bytef *> (const_cast<void *> (data));
+    stream_.avail_in = size;
+    Deflate (Z_NO_FLUSH);
+  }
+
+  // Writes out the rest of the stream and the gzip trailer.  Only
+  // computes and calls write(), so a crash can use it.
+  void
+  Finish ()
+  {
+    if (fd_ < 0 || finished_)
+      return;
+    stream_.avail_in = 0;
+    Deflate (Z_FINISH);
+    finished_ = true;
+  }
+
+  void
+  Close ()
+  {
+    if (fd_ < 0)
+      return;
+    Finish ();
+    deflateEnd (&stream_);
+    close (fd_);
+    fd_ = -1;
+  }
+
+  // Lets go of a stream another process goes on writing, the parent
+  // after a fork, without writing anything.
+  void
+  Abandon ()
+  {
+    if (fd_ < 0)
+      return;
+    deflateEnd (&stream_);
+    close (fd_);
+    fd_ = -1;
+  }
+
+private:
+  static const size_t kChunkBytes = 1 << 16;
+
+  // Runs deflate until it has taken all of the input, or ended the
+  // stream, writing every chunk it fills.
+  void
+  Deflate (int flush)
+  {
+    while (true)
+      {
+        stream_.next_out = chunk_;
+        stream_.avail_out = kChunkBytes;
+        int status = deflate (&stream_, flush);
+        Write (chunk_, kChunkBytes - stream_.avail_out);
+        if (status == Z_STREAM_END || status == Z_STREAM_ERROR)
+          return;
+        if (flush == Z_NO_FLUSH && stream_.avail_in == 0
+            && stream_.avail_out != 0)
+          return;
+      }
+  }
+
+  void
+  Write (const uint8_t *data, size_t size)
+  {
+    while (size)
+      {
+        ssize_t written = write (fd_, data, size);
+        if (written < 0 && errno == EINTR)
+          continue;
+        if (written <= 0)
+          return;
+        data += written;
+        size -= written;
+      }
+  }
+
+  int fd_;
+  bool finished_;
+  z_stream stream_;
+  uint8_t chunk_[kChunkBytes];
+
+  CTraceGzipFile (const CTraceGzipFile &);
+  void operator= (const CTraceGzipFile &);
+};
+
+#endif /* CTRACE_GZIP_H */
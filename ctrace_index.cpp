@@ -0,0 +1,504 @@
+// C Headers
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// POSIX Headers
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ctrace_format.h"
+#include "ctrace_store.h"
+
+// Builds the indexed store of ctrace_store.h out of traces, JSON or
+// binary, so that ctrace_query can cut windows out of them.  Several
+// traces, such as those of a process tree, go into one store.
+//
+//   ctrace_index <trace.ctidx> <trace>...
+//
+// The text of the events is spooled to a temporary file while they are
+// read, and about 40 bytes per event are kept in memory to sort them.
+
+// What the sort needs of an event; its text is at offset_ in the spool.
+struct Entry
+{
+  uint64_t ts_;
+  uint64_t dur_;
+  uint64_t offset_;
+  uint32_t size_;
+  uint32_t name_;
+  uint32_t thread_;
+};
+
+// Ids by content, for names and threads.
+class Ids
+{
+public:
+  Ids () : slots_ (NULL), mask_ (0), used_ (0) {}
+  ~Ids () { free (slots_); }
+
+  // Returns the id of key, or used () if it is new.  keys holds the
+  // keys of the ids handed out so far, at offsets[id].
+  uint32_t
+  Find (const CTraceBytes &keys, const uint64_t *offsets,
+        const uint8_t *key, size_t size, bool *added)
+  {
+    *added = false;
+    if ((used_ + 1) * 2 > mask_ + 1 && !Grow (keys, offsets))
+      return used_;
+    size_t i = Hash (key, size) & mask_;
+    while (slots_[i])
+      {
+        uint32_t id = slots_[i] - 1;
+        if (offsets[id + 1] - offsets[id] == size
+            && memcmp (keys.data_ + offsets[id], key, size) == 0)
+          return id;
+        i = (i + 1) & mask_;
+      }
+    slots_[i] = ++used_;
+    *added = true;
+    return used_ - 1;
+  }
+
+private:
+  static size_t
+  Hash (const uint8_t *key, size_t size)
+  {
+    // FNV-1a.
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i)
+      h = (h ^ key[i]) * 1099511628211ull;
+    return static_cast<size_t> (h ^ (h >> 32));
+  }
+
+  bool
+  Grow (const CTraceBytes &keys, const uint64_t *offsets)
+  {
+    size_t size = slots_ ? (mask_ + 1) * 2 : 1024;
+    uint32_t *slots
+        = static_cast<uint32_t *> (calloc (size, sizeof (uint32_t)));
+    if (!slots)
+      return false;
+    for (uint32_t id = 0; id < used_; ++id)
+      {
+        size_t j = Hash (keys.data_ + offsets[id],
+                         offsets[id + 1] - offsets[id])
+                   & (size - 1);
+        while (slots[j])
+          j = (j + 1) & (size - 1);
+        slots[j] = id + 1;
+      }
+    free (slots_);
+    slots_ = slots;
+    mask_ = size - 1;
+    return true;
+  }
+
+  // id + 1 of the key, 0 if empty.
+  uint32_t *slots_;
+  size_t mask_;
+  uint32_t used_;
+
+  Ids (const Ids &);
+  void operator= (const Ids &);
+};
+
+// Interned keys: the bytes of all of them, and where each one starts,
+// with one more offset for the end of the last.
+struct KeySet
+{
+  KeySet () : offsets_ (NULL), count_ (0), capacity_ (0) {}
+  ~KeySet () { free (offsets_); }
+
+  uint32_t
+  Intern (const void *key, size_t size)
+  {
+    if (count_ + 2 > capacity_)
+      {
+        size_t capacity = capacity_ ? capacity_ * 2 : 1024;
+        uint64_t *offsets = static_cast<uint64_t *> (
+            realloc (offsets_, capacity * sizeof (uint64_t)));
+        if (!offsets)
+          abort ();
+        offsets_ = offsets;
+        offsets_[0] = 0;
+        capacity_ = capacity;
+      }
+    bool added;
+    uint32_t id = ids_.Find (keys_, offsets_,
+                             static_cast<const uint8_t *> (key), size, &added);
+    if (added)
+      {
+        keys_.PutBytes (key, size);
+        offsets_[++count_] = keys_.size_;
+      }
+    return id;
+  }
+
+  CTraceBytes keys_;
+  uint64_t *offsets_;
+  size_t count_;
+  size_t capacity_;
+  Ids ids_;
+};
+
+struct ThreadKey
+{
+  int32_t pid_;
+  int32_t tid_;
+};
+
+class Indexer
+{
+public:
+  Indexer () : spool_ (tmpfile ()), spooled_ (0), entries_ (NULL),
+               count_ (0), capacity_ (0)
+  {
+  }
+
+  ~Indexer ()
+  {
+    if (spool_)
+      fclose (spool_);
+    free (entries_);
+  }
+
+  bool
+  Add (FILE *in, const char *path)
+  {
+    if (!spool_)
+      {
+        perror ("tmpfile");
+        return false;
+      }
+    int first = getc (in);
+    int second = getc (in);
+    rewind (in);
+    if (first == 0x1f && second == 0x8b)
+      {
+        fprintf (stderr, "%s: gzip trace, gunzip it first\n", path);
+        return false;
+      }
+    CTraceBytes json;
+    if (first == kCTraceMagic[0] && second == kCTraceMagic[1])
+      {
+        CTraceBinaryReader reader (in);
+        if (!reader.ReadHeader ())
+          {
+            fprintf (stderr, "%s: not a binary trace\n", path);
+            return false;
+          }
+        CTraceBinaryReader::Event event;
+        while (reader.Next (&event))
+          {
+            json.size_ = 0;
+            if (event.counter_)
+              CTraceJson::AppendCounterValue (&json, false, event.cat_,
+                                              event.pid_, event.tid_,
+                                              event.ts_, event.name_,
+                                              event.value_);
+            else
+              CTraceJson::AppendEvent (&json, false, event.cat_, event.pid_,
+                                       event.tid_, event.ts_, event.name_,
+                                       event.dur_, event.has_thread_time_,
+                                       event.tts_, event.tdur_);
+            AddEvent (json);
+          }
+        for (size_t i = 0; i < reader.MetadataCount (); ++i)
+          {
+            const char *key = reader.MetadataKey (i);
+            other_data_.Add (key, strlen (key), reader.MetadataValue (i));
+          }
+        return true;
+      }
+    CTraceJsonReader reader (in);
+    while (reader.Next (&json))
+      AddEvent (json);
+    const CTraceOtherData &read = reader.OtherData ();
+    for (size_t i = 0; i < read.Count (); ++i)
+      other_data_.Add (read.Key (i), strlen (read.Key (i)), read.Value (i));
+    return true;
+  }
+
+  bool
+  Write (FILE *out)
+  {
+    if (fflush (spool_) != 0)
+      return false;
+    const uint8_t *spool = NULL;
+    if (spooled_)
+      {
+        void *mapping = mmap (NULL, spooled_, PROT_READ, MAP_PRIVATE,
+                              fileno (spool_), 0);
+        if (mapping == MAP_FAILED)
+          return false;
+        spool = static_cast<const uint8_t *> (mapping);
+      }
+    qsort (entries_, count_, sizeof (Entry), CompareEntries);
+
+    CTraceStoreHeader header;
+    memcpy (header.magic_, kCTraceStoreMagic, sizeof (header.magic_));
+    header.version_ = kCTraceStoreVersion;
+    fwrite (&header, sizeof (header), 1, out);
+    uint64_t offset = sizeof (header);
+
+    size_t thread_count = threads_.count_;
+    CTraceStoreThread *threads = static_cast<CTraceStoreThread *> (
+        calloc (thread_count ? thread_count : 1, sizeof (CTraceStoreThread)));
+    CTraceStoreChunk *chunks = NULL;
+    size_t chunk_count = 0, chunk_capacity = 0;
+    CTraceStoreFooter footer;
+    memset (&footer, 0, sizeof (footer));
+    footer.first_ts_ = count_ ? UINT64_MAX : 0;
+    CTraceBytes data;
+    for (size_t i = 0; i < count_;)
+      {
+        uint32_t thread = entries_[i].thread_;
+        const ThreadKey *key = reinterpret_cast<const ThreadKey *> (
+            threads_.keys_.data_ + threads_.offsets_[thread]);
+        CTraceStoreThread *t = &threads[thread];
+        t->pid_ = key->pid_;
+        t->tid_ = key->tid_;
+        t->first_chunk_ = chunk_count;
+        uint64_t max_end = 0;
+        for (; i < count_ && entries_[i].thread_ == thread;)
+          {
+            if (chunk_count == chunk_capacity)
+              {
+                chunk_capacity = chunk_capacity ? chunk_capacity * 2 : 1024;
+                chunks = static_cast<CTraceStoreChunk *> (realloc (
+                    chunks, chunk_capacity * sizeof (CTraceStoreChunk)));
+                if (!chunks)
+                  return false;
+              }
+            CTraceStoreChunk *chunk = &chunks[chunk_count++];
+            chunk->offset_ = offset;
+            chunk->first_ts_ = entries_[i].ts_;
+            chunk->count_ = 0;
+            data.size_ = 0;
+            uint64_t last_ts = entries_[i].ts_;
+            for (; i < count_ && entries_[i].thread_ == thread
+                   && data.size_ < kCTraceStoreChunkBytes;
+                 ++i)
+              {
+                const Entry &entry = entries_[i];
+                CTraceStoreEvent event;
+                event.ts_ = entry.ts_;
+                event.dur_ = entry.dur_;
+                event.name_ = entry.name_;
+                event.json_ = spool + entry.offset_;
+                event.size_ = entry.size_;
+                CTraceStoreChunkFormat::AppendEvent (&data, last_ts, event);
+                last_ts = entry.ts_;
+                if (entry.ts_ + entry.dur_ > max_end)
+                  max_end = entry.ts_ + entry.dur_;
+                chunk->count_++;
+              }
+            chunk->last_ts_ = last_ts;
+            chunk->max_end_ = max_end;
+            chunk->size_ = data.size_;
+            fwrite (data.data_, data.size_, 1, out);
+            offset += data.size_;
+            t->event_count_ += chunk->count_;
+            if (chunk->first_ts_ < footer.first_ts_)
+              footer.first_ts_ = chunk->first_ts_;
+          }
+        t->chunk_count_ = chunk_count - t->first_chunk_;
+        if (max_end > footer.last_end_)
+          footer.last_end_ = max_end;
+      }
+    if (spool)
+      munmap (const_cast<uint8_t *> (spool), spooled_);
+
+    footer.names_offset_ = offset;
+    for (size_t id = 0; id < names_.count_; ++id)
+      {
+        fwrite (names_.keys_.data_ + names_.offsets_[id],
+                names_.offsets_[id + 1] - names_.offsets_[id], 1, out);
+        fputc ('\0', out);
+      }
+    footer.names_size_ = names_.keys_.size_ + names_.count_;
+    offset += footer.names_size_;
+    footer.threads_offset_ = offset;
+    footer.thread_count_ = thread_count;
+    fwrite (threads, sizeof (CTraceStoreThread), thread_count, out);
+    offset += thread_count * sizeof (CTraceStoreThread);
+    footer.chunks_offset_ = offset;
+    footer.chunk_count_ = chunk_count;
+    fwrite (chunks, sizeof (CTraceStoreChunk), chunk_count, out);
+    offset += chunk_count * sizeof (CTraceStoreChunk);
+    data.size_ = 0;
+    other_data_.AppendTo (&data);
+    footer.other_data_offset_ = offset;
+    footer.other_data_size_ = data.size_;
+    fwrite (data.data_, data.size_, 1, out);
+    memcpy (footer.magic_, kCTraceStoreMagic, sizeof (footer.magic_));
+    footer.version_ = kCTraceStoreVersion;
+    fwrite (&footer, sizeof (footer), 1, out);
+    free (threads);
+    free (chunks);
+    return !ferror (out);
+  }
+
+private:
+  // Threads, then time; an event before the ones it encloses.
+  static int
+  CompareEntries (const void *a, const void *b)
+  {
+    const Entry *x = static_cast<const Entry *> (a);
+    const Entry *y = static_cast<const Entry *> (b);
+    if (x->thread_ != y->thread_)
+      return x->thread_ < y->thread_ ? -1 : 1;
+    if (x->ts_ != y->ts_)
+      return x->ts_ < y->ts_ ? -1 : 1;
+    if (x->dur_ != y->dur_)
+      return x->dur_ > y->dur_ ? -1 : 1;
+    return x->offset_ < y->offset_ ? -1 : x->offset_ > y->offset_;
+  }
+
+  // Finds the value of key among the top level members of the event.
+  static const char *
+  FindValue (const char *json, size_t size, const char *key)
+  {
+    size_t length = strlen (key);
+    int depth = 0;
+    const char *string = NULL;
+    for (size_t i = 0; i < size; ++i)
+      {
+        char c = json[i];
+        if (string)
+          {
+            if (c == '\\')
+              i++;
+            else if (c == '"')
+              {
+                bool match = depth == 1
+                             && static_cast<size_t> (json + i - string)
+                                    == length
+                             && memcmp (string, key, length) == 0;
+                string = NULL;
+                size_t j = i + 1;
+                while (j < size && json[j] == ' ')
+                  j++;
+                if (match && j < size && json[j] == ':')
+                  {
+                    for (j++; j < size && json[j] == ' '; j++)
+                      ;
+                    return json + j;
+                  }
+              }
+            continue;
+          }
+        if (c == '"')
+          string = json + i + 1;
+        else if (c == '{' || c == '[')
+          depth++;
+        else if (c == '}' || c == ']')
+          depth--;
+      }
+    return NULL;
+  }
+
+  static uint64_t
+  Number (const char *value)
+  {
+    if (!value)
+      return 0;
+    double number = strtod (value, NULL);
+    return number > 0 ? static_cast<uint64_t> (number) : 0;
+  }
+
+  void
+  AddEvent (CTraceBytes &json)
+  {
+    // so the numbers end, whatever the event looks like.
+    json.PutByte ('\0');
+    json.size_--;
+    const char *text = reinterpret_cast<const char *> (json.data_);
+    ThreadKey thread;
+    memset (&thread, 0, sizeof (thread));
+    const char *pid = FindValue (text, json.size_, "pid");
+    const char *tid = FindValue (text, json.size_, "tid");
+    thread.pid_ = pid ? atoi (pid) : 0;
+    thread.tid_ = tid ? atoi (tid) : 0;
+    const char *name = FindValue (text, json.size_, "name");
+    size_t name_size = 0;
+    if (name && *name == '"')
+      {
+        name++;
+        while (name[name_size] && name[name_size] != '"')
+          name_size += name[name_size] == '\\' && name[name_size + 1] ? 2 : 1;
+      }
+    else
+      {
+        name = "";
+      }
+
+    if (count_ == capacity_)
+      {
+        capacity_ = capacity_ ? capacity_ * 2 : 1 << 16;
+        entries_ = static_cast<Entry *> (
+            realloc (entries_, capacity_ * sizeof (Entry)));
+        if (!entries_)
+          abort ();
+      }
+    Entry *entry = &entries_[count_++];
+    entry->ts_ = Number (FindValue (text, json.size_, "ts"));
+    entry->dur_ = Number (FindValue (text, json.size_, "dur"));
+    entry->offset_ = spooled_;
+    entry->size_ = json.size_;
+    entry->name_ = names_.Intern (name, name_size);
+    entry->thread_ = threads_.Intern (&thread, sizeof (thread));
+    fwrite (json.data_, json.size_, 1, spool_);
+    spooled_ += json.size_;
+  }
+
+  FILE *spool_;
+  uint64_t spooled_;
+  Entry *entries_;
+  size_t count_;
+  size_t capacity_;
+  KeySet names_;
+  KeySet threads_;
+  CTraceOtherData other_data_;
+
+  Indexer (const Indexer &);
+  void operator= (const Indexer &);
+};
+
+int
+main (int argc, char **argv)
+{
+  if (argc < 3)
+    {
+      fprintf (stderr, "usage: %s <trace.ctidx> <trace>...\n", argv[0]);
+      return 1;
+    }
+  Indexer indexer;
+  for (int i = 2; i < argc; ++i)
+    {
+      FILE *in = fopen (argv[i], "rb");
+      if (!in)
+        {
+          perror (argv[i]);
+          return 1;
+        }
+      bool ok = indexer.Add (in, argv[i]);
+      fclose (in);
+      if (!ok)
+        return 1;
+    }
+  FILE *out = fopen (argv[1], "wb");
+  if (!out)
+    {
+      perror (argv[1]);
+      return 1;
+    }
+  bool ok = indexer.Write (out);
+  if (fclose (out) != 0 || !ok)
+    {
+      fprintf (stderr, "%s: write failed\n", argv[1]);
+      return 1;
+    }
+  return 0;
+}
@@ -0,0 +1,135 @@
+// C Headers
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ctrace_format.h"
+
+// Merges the traces of a process tree, trace.json and the
+// trace.<pid>.json of the children a fork left (ctrace_fork.h), into one
+// chrome://tracing JSON trace.  All processes time their events with the
+// same clock, and every event carries its pid, so the events only need
+// to be put together.  Inputs can be JSON or binary traces, in any
+// order; gzip ones have to be decompressed first.
+//
+//   ctrace_merge <trace>... > merged.json
+//
+// A JSON trace is copied event by event, so one cut short by a kill or
+// a crash only loses the event it ends in.  The otherData of the merged
+// trace has the first value of every key found in the inputs.
+
+// Merged events are written out in chunks of this size.
+static const size_t kFlushBytes = 1 << 20;
+
+static void
+Flush (FILE *out, CTraceBytes *json)
+{
+  fwrite (json->data_, json->size_, 1, out);
+  json->size_ = 0;
+}
+
+static void
+MergeBinary (CTraceBinaryReader *reader, FILE *out, CTraceBytes *json,
+             bool *needComma, CTraceOtherData *other_data)
+{
+  CTraceBinaryReader::Event event;
+  int pid = 0;
+  while (reader->Next (&event))
+    {
+      if (!pid)
+        pid = event.pid_;
+      if (event.counter_)
+        CTraceJson::AppendCounterValue (json, *needComma, event.cat_,
+                                        event.pid_, event.tid_, event.ts_,
+                                        event.name_, event.value_);
+      else
+        CTraceJson::AppendEvent (json, *needComma, event.cat_, event.pid_,
+                                 event.tid_, event.ts_, event.name_,
+                                 event.dur_, event.has_thread_time_,
+                                 event.tts_, event.tdur_);
+      *needComma = true;
+      if (json->size_ >= kFlushBytes)
+        Flush (out, json);
+    }
+  *needComma = reader->AppendSources (json, *needComma, pid);
+  for (size_t i = 0; i < reader->MetadataCount (); ++i)
+    {
+      const char *key = reader->MetadataKey (i);
+      other_data->Add (key, strlen (key), reader->MetadataValue (i));
+    }
+}
+
+static void
+MergeJson (CTraceJsonReader *reader, FILE *out, CTraceBytes *json,
+           bool *needComma, CTraceOtherData *other_data)
+{
+  CTraceBytes event;
+  while (reader->Next (&event))
+    {
+      if (*needComma)
+        json->PutRaw (", ");
+      json->PutBytes (event.data_, event.size_);
+      *needComma = true;
+      if (json->size_ >= kFlushBytes)
+        Flush (out, json);
+    }
+  const CTraceOtherData &read = reader->OtherData ();
+  for (size_t i = 0; i < read.Count (); ++i)
+    other_data->Add (read.Key (i), strlen (read.Key (i)), read.Value (i));
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc < 2)
+    {
+      fprintf (stderr, "usage: %s <trace>... > <merged.json>\n", argv[0]);
+      return 1;
+    }
+  FILE *out = stdout;
+  CTraceBytes json;
+  CTraceOtherData other_data;
+  bool needComma = false;
+  int status = 0;
+  CTraceJson::AppendHeader (&json);
+  for (int i = 1; i < argc; ++i)
+    {
+      FILE *in = fopen (argv[i], "rb");
+      if (!in)
+        {
+          perror (argv[i]);
+          status = 1;
+          continue;
+        }
+      int first = getc (in);
+      int second = getc (in);
+      rewind (in);
+      if (first == 0x1f && second == 0x8b)
+        {
+          fprintf (stderr, "%s: gzip trace, gunzip it first\n", argv[i]);
+          status = 1;
+        }
+      else if (first == kCTraceMagic[0] && second == kCTraceMagic[1])
+        {
+          CTraceBinaryReader reader (in);
+          if (reader.ReadHeader ())
+            MergeBinary (&reader, out, &json, &needComma, &other_data);
+          else
+            {
+              fprintf (stderr, "%s: not a binary trace\n", argv[i]);
+              status = 1;
+            }
+        }
+      else
+        {
+          CTraceJsonReader reader (in);
+          MergeJson (&reader, out, &json, &needComma, &other_data);
+        }
+      fclose (in);
+    }
+  json.PutRaw ("]");
+  other_data.AppendTo (&json);
+  json.PutRaw ("}\n");
+  Flush (out, &json);
+  return status;
+}
@@ -0,0 +1,166 @@
+#ifndef CTRACE_MMAP_H
+#define CTRACE_MMAP_H
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Trace output through a shared mapping of the file, used by the
+// runtimes when built with CTRACE_MMAP_OUTPUT.
+//
+// The file is grown CTRACE_MMAP_SEGMENT_BYTES at a time and only the
+// segment being written is mapped.  Appending is a memcpy; the only
+// syscalls are the ftruncate/mmap of a new segment and the msync of a
+// checkpoint.  A checkpoint writes the trailer of the format right after
+// the data without moving the cursor, and the rest of the segment holds
+// a filler byte the readers skip (whitespace for JSON, 0 for the binary
+// format, which also ends a binary trace).  So once a checkpoint is
+// done the file is complete as it stands, even if the process is
+// killed; at worst a batch being copied at that moment is cut short.
+// Close truncates the file to the data and the last checkpoint's
+// trailer.
+
+// Bytes the file grows by at a time, rounded up to the page size.
+#ifndef CTRACE_MMAP_SEGMENT_BYTES
+#define CTRACE_MMAP_SEGMENT_BYTES (32 << 20)
+#endif // CTRACE_MMAP_SEGMENT_BYTES
+
+class CTraceMappedFile
+{
+public:
+  CTraceMappedFile ()
+      : fd_ (-1), window_ (NULL), window_offset_ (0), segment_ (0),
+        cursor_ (0), trailer_size_ (0), filler_ (0)
+  {
+  }
+  ~CTraceMappedFile () { Close (); }
+
+  bool
+  IsOpen () const
+  {
+    return fd_ >= 0;
+  }
+
+  // Takes over fd, which must be open for reading and writing.  On
+  // failure fd is closed.
+  bool
+  Open (int fd, uint8_t filler)
+  {
+    size_t page = sysconf (_SC_PAGESIZE);
+    fd_ = fd;
+    filler_ = filler;
+    segment_ = (CTRACE_MMAP_SEGMENT_BYTES + page - 1) / page * page;
+    if (!Map (0))
+      {
+        close (fd_);
+        fd_ = -1;
+        // Appends find it full.
+        cursor_ = segment_;
+        return false;
+      }
+    return true;
+  }
+
+  void
+  Append (const void *data, size_t size)
+  {
+    const uint8_t *bytes = static_cast<const uint8_t *> (data);
+    if (size)
+      trailer_size_ = 0;
+    while (size)
+      {
+        if (cursor_ == segment_ && !Map (window_offset_ + segment_))
+          return;
+        size_t n = segment_ - cursor_;
+        if (n > size)
+          n = size;
+        memcpy (window_ + cursor_, bytes, n);
+        cursor_ += n;
+        bytes += n;
+        size -= n;
+      }
+  }
+
+  // Writes trailer after the data, the next Append overwrites it, and
+  // starts the writeback of what has been appended.
+  void
+  Checkpoint (const void *trailer, size_t size)
+  {
+    if (!window_)
+      return;
+    if (segment_ - cursor_ >= size)
+      memcpy (window_ + cursor_, trailer, size);
+    else if (pwrite (fd_, trailer, size, window_offset_ + cursor_) < 0)
+      return;
+    trailer_size_ = size;
+    msync (window_, cursor_, MS_ASYNC);
+  }
+
+  void
+  Close ()
+  {
+    if (fd_ < 0)
+      return;
+    if (window_)
+      munmap (window_, segment_);
+    window_ = NULL;
+    // If this fails the filler stays, which the readers skip anyway.
+    int truncated
+        = ftruncate (fd_, window_offset_ + cursor_ + trailer_size_);
+    (void)truncated;
+    close (fd_);
+    fd_ = -1;
+  }
+
+  // Lets go of a file another process goes on writing, the parent after
+  // a fork, without touching it.
+  void
+  Abandon ()
+  {
+    if (fd_ < 0)
+      return;
+    if (window_)
+      munmap (window_, segment_);
+    window_ = NULL;
+    cursor_ = segment_;
+    close (fd_);
+    fd_ = -1;
+  }
+
+private:
+  // Grows the file to hold the segment at offset and maps it.  On
+  // failure the current segment stays the last one, and stays full.
+  bool
+  Map (off_t offset)
+  {
+    if (window_)
+      munmap (window_, segment_);
+    window_ = NULL;
+    if (ftruncate (fd_, offset + segment_) != 0)
+      return false;
+    void *window = mmap (NULL, segment_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd_, offset);
+    if (window == MAP_FAILED)
+      return false;
+    window_ = static_cast<uint8_t *> (window);
+    window_offset_ = offset;
+    cursor_ = 0;
+    if (filler_)
+      memset (window_, filler_, segment_);
+    return true;
+  }
+
+  int fd_;
+  uint8_t *window_;
+  off_t window_offset_;
+  size_t segment_;
+  size_t cursor_;
+  size_t trailer_size_;
+  uint8_t filler_;
+
+  CTraceMappedFile (const CTraceMappedFile &);
+  void operator= (const CTraceMappedFile &);
+};
+
+#endif /* CTRACE_MMAP_H */
@@ -0,0 +1,141 @@
+#ifndef CTRACE_OVERHEAD_H
+#define CTRACE_OVERHEAD_H
+#include <stdint.h>
+
+#include "ctrace_clock.h"
+#include "ctrace_format.h"
+
+// Compensation of the runtimes' own cost.
+//
+// Every traced call costs its caller the runtime's enter and exit, so a
+// scope with many traced callees looks slower than it is.  Unless built
+// with CTRACE_COMPENSATE_OVERHEAD=0, a runtime times a loop of empty
+// scopes once before tracing anything, and keeps what one of them costs
+// the scope around it.  Each thread then adds up the cost of the scopes
+// it finished since its outermost open scope began, and the runtime
+// takes that off the timestamps: a scope starts earlier by what was
+// spent before it, and its dur and tdur shrink by what its callees
+// cost.  Callees stay inside their callers, and outermost scopes keep
+// their true start, so threads stay aligned.  The costs are written
+// into the metadata of the trace.
+//
+// One scope costs well under a microsecond, so costs are kept in
+// 1/65536 of a wall clock tick and of a thread cpu microsecond.
+
+#ifndef CTRACE_COMPENSATE_OVERHEAD
+#define CTRACE_COMPENSATE_OVERHEAD 1
+#endif // CTRACE_COMPENSATE_OVERHEAD
+
+// Empty scopes per round of the calibration.  The cheapest round counts,
+// which leaves out preemption and errs on the low side.
+#ifndef CTRACE_CALIBRATION_SCOPES
+#define CTRACE_CALIBRATION_SCOPES 1000
+#endif // CTRACE_CALIBRATION_SCOPES
+#ifndef CTRACE_CALIBRATION_ROUNDS
+#define CTRACE_CALIBRATION_ROUNDS 5
+#endif // CTRACE_CALIBRATION_ROUNDS
+
+class CTraceOverhead
+{
+public:
+  static const int kFractionBits = 16;
+
+  // Times CTRACE_CALIBRATION_ROUNDS calls of run (arg, count), each of
+  // which runs count empty scopes, and keeps the cost of one.
+  static void
+  Calibrate (void (*run) (void *arg, int count), void *arg)
+  {
+    const int count = CTRACE_CALIBRATION_SCOPES;
+    uint64_t best = ~static_cast<uint64_t> (0);
+    uint64_t best_thread = ~static_cast<uint64_t> (0);
+    // the first round warms up the caches.
+    run (arg, count);
+    for (int i = 0; i < CTRACE_CALIBRATION_ROUNDS; ++i)
+      {
+        uint64_t start = CTraceClock::Now ();
+        uint64_t start_thread = CTraceClock::ThreadNow ();
+        run (arg, count);
+        uint64_t end_thread = CTraceClock::ThreadNow ();
+        uint64_t end = CTraceClock::Now ();
+        if (end - start < best)
+          best = end - start;
+        if (end_thread - start_thread < best_thread)
+          best_thread = end_thread - start_thread;
+      }
+    State &state = Get ();
+    state.scope_ = (best << kFractionBits) / count;
+    state.scope_thread_ = (best_thread << kFractionBits) / count;
+    state.calibrated_ = true;
+  }
+
+  // Cost of one scope in 1/65536 wall ticks, 0 until calibrated.
+  static uint64_t
+  Scope ()
+  {
+    return Get ().scope_;
+  }
+
+  // Cost of one scope in 1/65536 thread cpu microseconds.
+  static uint64_t
+  ScopeThread ()
+  {
+    return Get ().scope_thread_;
+  }
+
+  // The JSON header, with the costs in nanoseconds as "otherData" once
+  // calibrated.
+  static void
+  AppendJsonHeader (CTraceBytes *out)
+  {
+    const char *keys[2];
+    uint64_t values[2];
+    size_t count = Metadata (keys, values);
+    if (count)
+      CTraceJson::AppendHeader (out, keys, values, count);
+    else
+      CTraceJson::AppendHeader (out);
+  }
+
+  // The same as meta chunks of the binary format.
+  static void
+  AppendBinaryMetadata (CTraceBytes *out)
+  {
+    const char *keys[2];
+    uint64_t values[2];
+    size_t count = Metadata (keys, values);
+    for (size_t i = 0; i < count; ++i)
+      CTraceBinaryWriter::AppendMetadata (out, keys[i], values[i]);
+  }
+
+private:
+  struct State
+  {
+    bool calibrated_;
+    uint64_t scope_;
+    uint64_t scope_thread_;
+  };
+
+  // Zero initialized, so reading it on the hot path needs no guard.
+  static State &
+  Get ()
+  {
+    static State state;
+    return state;
+  }
+
+  static size_t
+  Metadata (const char **keys, uint64_t *values)
+  {
+    const State &state = Get ();
+    if (!state.calibrated_)
+      return 0;
+    keys[0] = "ctrace_scope_overhead_ns";
+    values[0] = (state.scope_ * 1000 / CTraceClock::TicksPerMicrosecond ())
+                >> kFractionBits;
+    keys[1] = "ctrace_scope_overhead_thread_ns";
+    values[1] = (state.scope_thread_ * 1000) >> kFractionBits;
+    return 2;
+  }
+};
+
+#endif /* CTRACE_OVERHEAD_H */
@@ -0,0 +1,453 @@
+#ifndef CTRACE_PERFETTO_H
+#define CTRACE_PERFETTO_H
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ctrace_format.h"
+
+// Perfetto protobuf trace format.
+//
+// The output is a perfetto.protos.Trace, a sequence of TracePacket
+// fields, encoded by hand so nothing beyond this header is needed.
+// Every thread gets a TrackDescriptor the first time it shows up, and
+// a complete event becomes a TYPE_SLICE_BEGIN and a TYPE_SLICE_END
+// TrackEvent on the track of its thread, with the thread cpu time as
+// thread_time_absolute_us.  Names and categories are interned: the
+// packet of the first event using one carries it in its InternedData,
+// later ones only its iid.  All packets are on one sequence.  A counter
+// gets a counter track of its own under the track of the thread that
+// recorded it, and its samples are TYPE_COUNTER TrackEvents there.
+//
+// Perfetto sorts the packets by timestamp and keeps the order of the
+// file for equal ones, but the events of a thread come in the order
+// they ended, so a caller that began in the same microsecond as its
+// callee comes after it.  Perfetto counts nanoseconds, and the writer
+// uses the spare ones to order them: a begin goes late in its
+// microsecond, the earlier the deeper the calls under it, an end goes
+// early, the later the deeper.  So callers begin before and end after
+// their callees, and ends come before begins.
+//
+// Timestamps stay CLOCK_MONOTONIC, tagged with Perfetto's default
+// clock.
+
+class CTracePerfettoWriter
+{
+public:
+  CTracePerfettoWriter () : threads_ (NULL), threads_size_ (0), last_ (0),
+                            counters_ (NULL), counters_size_ (0), uuids_ (0),
+                            first_ (true)
+  {
+  }
+
+  ~CTracePerfettoWriter ()
+  {
+    for (size_t i = 0; i < threads_size_; ++i)
+      free (threads_[i].levels_);
+    free (threads_);
+    for (size_t i = 0; i < counters_size_; ++i)
+      free (counters_[i].name_);
+    free (counters_);
+  }
+
+  // Appends a sample of a counter, ts in microseconds.
+  void
+  AppendCounter (CTraceBytes *out, int pid, int tid, uint64_t ts,
+                 const char *name, int64_t value)
+  {
+    uint64_t uuid = FindCounter (out, pid, tid, name);
+    if (!uuid)
+      return;
+    size_t packet = BeginPacket (out, ts * 1000);
+    size_t event = BeginMessage (out, kTrackEvent);
+    PutVarintField (out, kType, kCounter);
+    PutVarintField (out, kTrackUuid, uuid);
+    PutVarintField (out, kCounterValue, static_cast<uint64_t> (value));
+    EndMessage (out, event);
+    EndMessage (out, packet);
+  }
+
+  // Appends a complete event, ts, dur, tts and tdur in microseconds.
+  void
+  AppendEvent (CTraceBytes *out, const char *cat, int pid, int tid,
+               uint64_t ts, const char *name, uint64_t dur,
+               bool has_thread_time, uint64_t tts, uint64_t tdur)
+  {
+    Thread *thread = FindThread (out, pid, tid);
+    if (!thread)
+      return;
+    uint64_t height = thread->Place (ts);
+    uint64_t begin = ts * 1000 + 999 - height;
+    uint64_t end = (ts + dur) * 1000 + height;
+    if (end < begin)
+      end = begin;
+    bool new_cat, new_name;
+    uint64_t cat_iid = categories_.Intern (cat, &new_cat);
+    uint64_t name_iid = names_.Intern (name, &new_name);
+
+    size_t packet = BeginPacket (out, begin);
+    if (new_cat || new_name)
+      {
+        size_t interned = BeginMessage (out, kInternedData);
+        if (new_cat)
+          AppendInterned (out, kEventCategories, cat_iid, cat);
+        if (new_name)
+          AppendInterned (out, kEventNames, name_iid, name);
+        EndMessage (out, interned);
+      }
+    size_t event = BeginMessage (out, kTrackEvent);
+    PutVarintField (out, kType, kSliceBegin);
+    PutVarintField (out, kTrackUuid, thread->uuid_);
+    PutVarintField (out, kCategoryIids, cat_iid);
+    PutVarintField (out, kNameIid, name_iid);
+    if (has_thread_time)
+      PutVarintField (out, kThreadTimeAbsoluteUs, tts);
+    EndMessage (out, event);
+    EndMessage (out, packet);
+
+    packet = BeginPacket (out, end);
+    event = BeginMessage (out, kTrackEvent);
+    PutVarintField (out, kType, kSliceEnd);
+    PutVarintField (out, kTrackUuid, thread->uuid_);
+    if (has_thread_time)
+      PutVarintField (out, kThreadTimeAbsoluteUs, tts + tdur);
+    EndMessage (out, event);
+    EndMessage (out, packet);
+  }
+
+private:
+  // Field numbers and values of perfetto/trace/*.proto.
+  enum
+  {
+    // Trace
+    kTracePacket = 1,
+    // TracePacket
+    kTimestamp = 8,
+    kSequenceId = 10,
+    kTrackEvent = 11,
+    kInternedData = 12,
+    kSequenceFlags = 13,
+    kTrackDescriptor = 60,
+    kIncrementalStateCleared = 1,
+    kNeedsIncrementalState = 2,
+    // TrackDescriptor
+    kUuid = 1,
+    kTrackName = 2,
+    kThreadDescriptor = 4,
+    kParentUuid = 5,
+    kCounterDescriptor = 8,
+    // ThreadDescriptor
+    kPid = 1,
+    kTid = 2,
+    // TrackEvent
+    kCategoryIids = 3,
+    kType = 9,
+    kNameIid = 10,
+    kTrackUuid = 11,
+    kThreadTimeAbsoluteUs = 17,
+    kCounterValue = 30,
+    kSliceBegin = 1,
+    kSliceEnd = 2,
+    kCounter = 4,
+    // InternedData
+    kEventCategories = 1,
+    kEventNames = 2,
+    // EventCategory and EventName
+    kIid = 1,
+    kName = 2
+  };
+
+  static const uint64_t kSequence = 1;
+  // Deeper trees share the last nanosecond.
+  static const uint64_t kMaxHeight = 499;
+
+  // What the writer knows of a thread: its track, and for the events
+  // not yet inside a later one, how deep the calls under them go.
+  // Heights only fall from the bottom of levels_ to its top, an event
+  // under a higher one later in the thread being of no further use.
+  struct Level
+  {
+    uint64_t ts_;
+    uint64_t height_;
+  };
+
+  struct Thread
+  {
+    int pid_;
+    int tid_;
+    uint64_t uuid_;
+    Level *levels_;
+    size_t depth_;
+    size_t capacity_;
+
+    // Returns the height of an event starting at ts, the one after all
+    // the events of the thread seen so far: the ones that started at
+    // or after ts are its callees.
+    uint64_t
+    Place (uint64_t ts)
+    {
+      uint64_t height = 0;
+      while (depth_ && levels_[depth_ - 1].ts_ >= ts)
+        {
+          if (levels_[depth_ - 1].height_ + 1 > height)
+            height = levels_[depth_ - 1].height_ + 1;
+          depth_--;
+        }
+      if (height > kMaxHeight)
+        height = kMaxHeight;
+      while (depth_ && levels_[depth_ - 1].height_ <= height)
+        depth_--;
+      if (depth_ == capacity_)
+        {
+          size_t capacity = capacity_ ? capacity_ * 2 : 16;
+          Level *levels = static_cast<Level *> (
+              realloc (levels_, capacity * sizeof (Level)));
+          if (!levels)
+            return height;
+          levels_ = levels;
+          capacity_ = capacity;
+        }
+      levels_[depth_].ts_ = ts;
+      levels_[depth_].height_ = height;
+      depth_++;
+      return height;
+    }
+  };
+
+  struct CounterTrack
+  {
+    int pid_;
+    int tid_;
+    char *name_;
+    uint64_t uuid_;
+  };
+
+  // Interns strings by content, the iids starting at 1.
+  class Strings
+  {
+  public:
+    Strings () : slots_ (NULL), mask_ (0), used_ (0) {}
+
+    ~Strings ()
+    {
+      for (size_t i = 0; slots_ && i <= mask_; ++i)
+        free (slots_[i].str_);
+      free (slots_);
+    }
+
+    uint64_t
+    Intern (const char *str, bool *added)
+    {
+      *added = false;
+      if ((used_ + 1) * 2 > mask_ + 1 && !Grow ())
+        return 0;
+      size_t i = Hash (str) & mask_;
+      while (slots_[i].str_)
+        {
+          if (strcmp (slots_[i].str_, str) == 0)
+            return slots_[i].iid_;
+          i = (i + 1) & mask_;
+        }
+      slots_[i].str_ = strdup (str);
+      if (!slots_[i].str_)
+        return 0;
+      slots_[i].iid_ = ++used_;
+      *added = true;
+      return slots_[i].iid_;
+    }
+
+  private:
+    struct Slot
+    {
+      char *str_;
+      uint64_t iid_;
+    };
+
+    static size_t
+    Hash (const char *str)
+    {
+      // FNV-1a.
+      uint64_t h = 14695981039346656037ull;
+      for (; *str; ++str)
+        h = (h ^ static_cast<uint8_t> (*str)) * 1099511628211ull;
+      return static_cast<size_t> (h ^ (h >> 32));
+    }
+
+    bool
+    Grow ()
+    {
+      size_t size = slots_ ? (mask_ + 1) * 2 : 256;
+      Slot *slots = static_cast<Slot *> (calloc (size, sizeof (Slot)));
+      if (!slots)
+        return false;
+      for (size_t i = 0; slots_ && i <= mask_; ++i)
+        {
+          if (!slots_[i].str_)
+            continue;
+          size_t j = Hash (slots_[i].str_) & (size - 1);
+          while (slots[j].str_)
+            j = (j + 1) & (size - 1);
+          slots[j] = slots_[i];
+        }
+      free (slots_);
+      slots_ = slots;
+      mask_ = size - 1;
+      return true;
+    }
+
+    Slot *slots_;
+    size_t mask_;
+    size_t used_;
+
+    Strings (const Strings &);
+    void operator= (const Strings &);
+  };
+
+  // Returns the thread, appending its track descriptor the first time.
+  Thread *
+  FindThread (CTraceBytes *out, int pid, int tid)
+  {
+    if (last_ < threads_size_ && threads_[last_].tid_ == tid
+        && threads_[last_].pid_ == pid)
+      return &threads_[last_];
+    for (size_t i = 0; i < threads_size_; ++i)
+      if (threads_[i].tid_ == tid && threads_[i].pid_ == pid)
+        {
+          last_ = i;
+          return &threads_[i];
+        }
+    Thread *threads = static_cast<Thread *> (
+        realloc (threads_, (threads_size_ + 1) * sizeof (Thread)));
+    if (!threads)
+      return NULL;
+    threads_ = threads;
+    last_ = threads_size_++;
+    Thread *thread = &threads_[last_];
+    memset (thread, 0, sizeof (Thread));
+    thread->pid_ = pid;
+    thread->tid_ = tid;
+    // numbered, so the uuid every event carries stays one byte or two.
+    thread->uuid_ = ++uuids_;
+
+    size_t packet = BeginMessage (out, kTracePacket);
+    PutVarintField (out, kSequenceId, kSequence);
+    if (first_)
+      PutVarintField (out, kSequenceFlags, kIncrementalStateCleared);
+    first_ = false;
+    size_t track = BeginMessage (out, kTrackDescriptor);
+    PutVarintField (out, kUuid, thread->uuid_);
+    size_t descriptor = BeginMessage (out, kThreadDescriptor);
+    PutVarintField (out, kPid, pid);
+    PutVarintField (out, kTid, tid);
+    EndMessage (out, descriptor);
+    EndMessage (out, track);
+    EndMessage (out, packet);
+    return thread;
+  }
+
+  // Returns the uuid of the counter track, appending its descriptor the
+  // first time, or 0.  Programs have few counters.
+  uint64_t
+  FindCounter (CTraceBytes *out, int pid, int tid, const char *name)
+  {
+    for (size_t i = 0; i < counters_size_; ++i)
+      if (counters_[i].tid_ == tid && counters_[i].pid_ == pid
+          && strcmp (counters_[i].name_, name) == 0)
+        return counters_[i].uuid_;
+    Thread *thread = FindThread (out, pid, tid);
+    CounterTrack *counters = static_cast<CounterTrack *> (realloc (
+        counters_, (counters_size_ + 1) * sizeof (CounterTrack)));
+    if (!thread || !counters)
+      return 0;
+    counters_ = counters;
+    CounterTrack *counter = &counters_[counters_size_];
+    counter->name_ = strdup (name);
+    if (!counter->name_)
+      return 0;
+    counters_size_++;
+    counter->pid_ = pid;
+    counter->tid_ = tid;
+    counter->uuid_ = ++uuids_;
+
+    size_t packet = BeginMessage (out, kTracePacket);
+    PutVarintField (out, kSequenceId, kSequence);
+    size_t track = BeginMessage (out, kTrackDescriptor);
+    PutVarintField (out, kUuid, counter->uuid_);
+    out->PutVarint (kTrackName << 3 | 2);
+    out->PutString (name);
+    PutVarintField (out, kParentUuid, thread->uuid_);
+    size_t descriptor = BeginMessage (out, kCounterDescriptor);
+    EndMessage (out, descriptor);
+    EndMessage (out, track);
+    EndMessage (out, packet);
+    return counter->uuid_;
+  }
+
+  static size_t
+  BeginPacket (CTraceBytes *out, uint64_t timestamp)
+  {
+    size_t packet = BeginMessage (out, kTracePacket);
+    PutVarintField (out, kTimestamp, timestamp);
+    PutVarintField (out, kSequenceId, kSequence);
+    PutVarintField (out, kSequenceFlags, kNeedsIncrementalState);
+    return packet;
+  }
+
+  static void
+  AppendInterned (CTraceBytes *out, int field, uint64_t iid, const char *str)
+  {
+    size_t entry = BeginMessage (out, field);
+    PutVarintField (out, kIid, iid);
+    out->PutVarint (kName << 3 | 2);
+    out->PutString (str);
+    EndMessage (out, entry);
+  }
+
+  static void
+  PutVarintField (CTraceBytes *out, int field, uint64_t value)
+  {
+    out->PutVarint (field << 3);
+    out->PutVarint (value);
+  }
+
+  // Starts a nested message.  Its length is not known yet, so four
+  // bytes are left for it, a varint padded with continuation bits, as
+  // protobuf decoders take it.  Returns where they are.
+  static size_t
+  BeginMessage (CTraceBytes *out, int field)
+  {
+    out->PutVarint (field << 3 | 2);
+    if (!out->Reserve (4))
+      return out->size_;
+    out->size_ += 4;
+    return out->size_ - 4;
+  }
+
+  static void
+  EndMessage (CTraceBytes *out, size_t at)
+  {
+    if (at + 4 > out->size_)
+      return;
+    size_t length = out->size_ - at - 4;
+    out->data_[at] = static_cast<uint8_t> (length | 0x80);
+    out->data_[at + 1] = static_cast<uint8_t> ((length >> 7) | 0x80);
+    out->data_[at + 2] = static_cast<uint8_t> ((length >> 14) | 0x80);
+    out->data_[at + 3] = static_cast<uint8_t> ((length >> 21) & 0x7f);
+  }
+
+  Strings categories_;
+  Strings names_;
+  Thread *threads_;
+  size_t threads_size_;
+  size_t last_;
+  CounterTrack *counters_;
+  size_t counters_size_;
+  // the last uuid given to a track.
+  uint64_t uuids_;
+  bool first_;
+
+  CTracePerfettoWriter (const CTracePerfettoWriter &);
+  void operator= (const CTracePerfettoWriter &);
+};
+
+#endif /* CTRACE_PERFETTO_H */
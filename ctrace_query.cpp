@@ -0,0 +1,228 @@
+// C Headers
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// POSIX Headers
+#include <unistd.h>
+
+#include "ctrace_format.h"
+#include "ctrace_store.h"
+
+// Cuts a window out of a store built by ctrace_index, as a
+// chrome://tracing JSON trace of the events that overlap it.  Only the
+// chunks of the window are read, so a query on a trace of many gigabytes
+// takes as long as one on the window alone.
+//
+//   ctrace_query [-s <start>] [-e <end>] [-p <pid>] [-t <tid>]...
+//                [-n <name>] [-l] <trace.ctidx> [<window.json>]
+//
+// -s and -e are seconds from the start of the trace, the whole trace by
+// default.  -p and -t keep the threads of a process or the given threads,
+// -n the events with a name that contains <name>.  -l lists the threads
+// and their events instead.  The output goes to stdout when no output
+// file is given.
+
+// Events are written out in chunks of this size.
+static const size_t kFlushBytes = 1 << 20;
+
+// Most -t a query takes.
+static const int kMaxTids = 64;
+
+static void
+Flush (FILE *out, CTraceBytes *json)
+{
+  fwrite (json->data_, json->size_, 1, out);
+  json->size_ = 0;
+}
+
+struct Query
+{
+  uint64_t start_;
+  uint64_t end_;
+  bool has_pid_;
+  int pid_;
+  int tids_[kMaxTids];
+  int tid_count_;
+  const char *name_;
+};
+
+static bool
+Wants (const Query &query, const CTraceStoreThread &thread)
+{
+  if (query.has_pid_ && thread.pid_ != query.pid_)
+    return false;
+  if (!query.tid_count_)
+    return true;
+  for (int i = 0; i < query.tid_count_; ++i)
+    if (query.tids_[i] == thread.tid_)
+      return true;
+  return false;
+}
+
+// Appends the events of thread in the window of query.
+static bool
+QueryThread (CTraceStoreReader *reader, const CTraceStoreThread &thread,
+             const Query &query, const bool *names, FILE *out,
+             CTraceBytes *json, bool *needComma)
+{
+  CTraceBytes data;
+  size_t last = thread.first_chunk_ + thread.chunk_count_;
+  for (size_t i = reader->FindChunk (thread, query.start_);
+       i < last && reader->Chunk (i).first_ts_ <= query.end_; ++i)
+    {
+      if (!reader->ReadChunk (i, &data))
+        return false;
+      const uint8_t *p = data.data_;
+      const uint8_t *end = data.data_ + data.size_;
+      uint64_t last_ts = reader->Chunk (i).first_ts_;
+      CTraceStoreEvent event;
+      while (p < end)
+        {
+          if (!CTraceStoreChunkFormat::NextEvent (&p, end, last_ts, &event))
+            return false;
+          last_ts = event.ts_;
+          if (event.ts_ > query.end_)
+            break;
+          if (event.ts_ + event.dur_ < query.start_
+              || event.name_ >= reader->NameCount () || !names[event.name_])
+            continue;
+          if (*needComma)
+            json->PutRaw (", ");
+          json->PutBytes (event.json_, event.size_);
+          *needComma = true;
+          if (json->size_ >= kFlushBytes)
+            Flush (out, json);
+        }
+    }
+  return true;
+}
+
+static void
+List (const CTraceStoreReader &reader, const Query &query, FILE *out)
+{
+  fprintf (out, "%10s %10s %12s %8s\n", "pid", "tid", "events", "chunks");
+  for (size_t i = 0; i < reader.ThreadCount (); ++i)
+    {
+      const CTraceStoreThread &thread = reader.Thread (i);
+      if (Wants (query, thread))
+        fprintf (out, "%10d %10d %12llu %8llu\n", thread.pid_, thread.tid_,
+                 static_cast<unsigned long long> (thread.event_count_),
+                 static_cast<unsigned long long> (thread.chunk_count_));
+    }
+  fprintf (out, "%.6f s from %llu us\n",
+           (reader.LastEnd () - reader.FirstTs ()) / 1e6,
+           static_cast<unsigned long long> (reader.FirstTs ()));
+}
+
+static uint64_t
+Microseconds (const char *seconds)
+{
+  double value = strtod (seconds, NULL) * 1e6;
+  return value > 0 ? static_cast<uint64_t> (value) : 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  Query query;
+  memset (&query, 0, sizeof (query));
+  const char *start = NULL;
+  const char *end = NULL;
+  bool list = false;
+  int c;
+  while ((c = getopt (argc, argv, "s:e:p:t:n:l")) != -1)
+    switch (c)
+      {
+      case 's':
+        start = optarg;
+        break;
+      case 'e':
+        end = optarg;
+        break;
+      case 'p':
+        query.has_pid_ = true;
+        query.pid_ = atoi (optarg);
+        break;
+      case 't':
+        if (query.tid_count_ < kMaxTids)
+          query.tids_[query.tid_count_++] = atoi (optarg);
+        break;
+      case 'n':
+        query.name_ = optarg;
+        break;
+      case 'l':
+        list = true;
+        break;
+      default:
+        optind = argc;
+        break;
+      }
+  if (optind != argc - 1 && optind != argc - 2)
+    {
+      fprintf (stderr,
+               "usage: %s [-s <start>] [-e <end>] [-p <pid>] [-t <tid>]... "
+               "[-n <name>] [-l] <trace.ctidx> [<window.json>]\n",
+               argv[0]);
+      return 1;
+    }
+  const char *path = argv[optind];
+  FILE *in = fopen (path, "rb");
+  if (!in)
+    {
+      perror (path);
+      return 1;
+    }
+  CTraceStoreReader reader (in);
+  if (!reader.Open ())
+    {
+      fprintf (stderr, "%s: not a trace store\n", path);
+      return 1;
+    }
+  FILE *out = optind == argc - 2 ? fopen (argv[optind + 1], "wb") : stdout;
+  if (!out)
+    {
+      perror (argv[optind + 1]);
+      return 1;
+    }
+  if (list)
+    {
+      List (reader, query, out);
+      fclose (in);
+      if (out != stdout)
+        fclose (out);
+      return 0;
+    }
+
+  query.start_ = start ? reader.FirstTs () + Microseconds (start) : 0;
+  query.end_ = end ? reader.FirstTs () + Microseconds (end) : UINT64_MAX;
+  // the names to keep, decided once rather than per event.
+  size_t name_count = reader.NameCount ();
+  bool *names = static_cast<bool *> (malloc (name_count ? name_count : 1));
+  if (!names)
+    return 1;
+  for (size_t i = 0; i < name_count; ++i)
+    names[i] = !query.name_ || strstr (reader.Name (i), query.name_);
+
+  CTraceBytes json;
+  bool needComma = false;
+  int status = 0;
+  CTraceJson::AppendHeader (&json);
+  for (size_t i = 0; i < reader.ThreadCount (); ++i)
+    if (Wants (query, reader.Thread (i))
+        && !QueryThread (&reader, reader.Thread (i), query, names, out,
+                         &json, &needComma))
+      {
+        fprintf (stderr, "%s: damaged chunk\n", path);
+        status = 1;
+      }
+  json.PutRaw ("]");
+  json.PutBytes (reader.OtherData ().data_, reader.OtherData ().size_);
+  json.PutRaw ("}\n");
+  Flush (out, &json);
+  free (names);
+  fclose (in);
+  if (out != stdout && fclose (out) != 0)
+    status = 1;
+  return status;
+}
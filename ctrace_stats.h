@@ -0,0 +1,412 @@
+#ifndef CTRACE_STATS_H
+#define CTRACE_STATS_H
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "ctrace_format.h"
+
+// Aggregated statistics, used by the runtimes when built with
+// CTRACE_AGGREGATE instead of writing one event per call.
+//
+// Every thread updates its own CTraceStatTable without locking.  A dump
+// merges all of them into a CTraceStatSummary, writes the summary table
+// to CTRACE_SUMMARY_FILE_NAME and appends a few counter events to the
+// trace, so the trace only grows by a couple of events per dump.
+
+// Slots of a thread's table, a power of two.  Functions beyond three
+// quarters of it are counted under "[other]".
+#ifndef CTRACE_AGGREGATE_FUNCTIONS
+#define CTRACE_AGGREGATE_FUNCTIONS 1024
+#endif // CTRACE_AGGREGATE_FUNCTIONS
+
+// Functions shown in the counter tracks of each dump.
+#ifndef CTRACE_AGGREGATE_COUNTERS
+#define CTRACE_AGGREGATE_COUNTERS 8
+#endif // CTRACE_AGGREGATE_COUNTERS
+
+// Latency buckets: bucket 0 counts calls under 1us, bucket i those in
+// [2^(i-1), 2^i) us, and the last one everything longer.
+static const int kCTraceHistogramBuckets = 32;
+
+struct CTraceStat
+{
+  const char *cat_;
+  const char *name_;
+  // calls seen, and those of them that have times.  The sampling
+  // runtime only times the calls a tick landed in.
+  uint64_t count_;
+  uint64_t timed_;
+  // wall and thread cpu microseconds, inclusive and without the traced
+  // callees.
+  uint64_t total_;
+  uint64_t self_;
+  uint64_t cpu_total_;
+  uint64_t cpu_self_;
+  uint64_t max_;
+  uint32_t histogram_[kCTraceHistogramBuckets];
+
+  void
+  AddCall ()
+  {
+    count_++;
+  }
+
+  void
+  AddTimes (uint64_t total, uint64_t self, uint64_t cpu_total,
+            uint64_t cpu_self)
+  {
+    timed_++;
+    total_ += total;
+    self_ += self;
+    cpu_total_ += cpu_total;
+    cpu_self_ += cpu_self;
+    if (total > max_)
+      max_ = total;
+    histogram_[Bucket (total)]++;
+  }
+
+  void
+  Merge (const CTraceStat &from)
+  {
+    count_ += from.count_;
+    timed_ += from.timed_;
+    total_ += from.total_;
+    self_ += from.self_;
+    cpu_total_ += from.cpu_total_;
+    cpu_self_ += from.cpu_self_;
+    if (from.max_ > max_)
+      max_ = from.max_;
+    for (int i = 0; i < kCTraceHistogramBuckets; ++i)
+      histogram_[i] += from.histogram_[i];
+  }
+
+  // Upper bound in microseconds of the q-th (0..1) quantile.
+  uint64_t
+  Quantile (double q) const
+  {
+    uint64_t rank = static_cast<uint64_t> (timed_ * q);
+    uint64_t seen = 0;
+    for (int i = 0; i < kCTraceHistogramBuckets; ++i)
+      {
+        seen += histogram_[i];
+        if (seen > rank)
+          {
+            uint64_t bound = (uint64_t (1) << i) - 1;
+            return i == kCTraceHistogramBuckets - 1 || bound > max_ ? max_
+                                                                    : bound;
+          }
+      }
+    return max_;
+  }
+
+  static int
+  Bucket (uint64_t us)
+  {
+    int bucket = 0;
+    while (us && bucket < kCTraceHistogramBuckets - 1)
+      {
+        us >>= 1;
+        bucket++;
+      }
+    return bucket;
+  }
+};
+
+// Per thread accumulators, keyed by name pointer.  The table never
+// moves, so a dump can read it while its thread keeps updating it; a
+// slot is claimed by setting name_ last.
+class CTraceStatTable
+{
+public:
+  // Maps a zeroed table; mmap since the thread may be inside malloc.
+  static CTraceStatTable *
+  New ()
+  {
+    void *table = mmap (NULL, sizeof (CTraceStatTable),
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+    if (table == MAP_FAILED)
+      return NULL;
+    CTraceStatTable *stats = static_cast<CTraceStatTable *> (table);
+    stats->other_.cat_ = "";
+    stats->other_.name_ = "[other]";
+    return stats;
+  }
+
+  static void
+  Delete (CTraceStatTable *stats)
+  {
+    munmap (stats, sizeof (CTraceStatTable));
+  }
+
+  // Back to the state New left it in.
+  void
+  Clear ()
+  {
+    memset (this, 0, sizeof (CTraceStatTable));
+    other_.cat_ = "";
+    other_.name_ = "[other]";
+  }
+
+  CTraceStat *
+  Find (const char *cat, const char *name)
+  {
+    const size_t mask = CTRACE_AGGREGATE_FUNCTIONS - 1;
+    size_t i = (reinterpret_cast<uintptr_t> (name) >> 3) & mask;
+    for (;; i = (i + 1) & mask)
+      {
+        CTraceStat *stat = &slots_[i];
+        if (stat->name_ == name && stat->cat_ == cat)
+          return stat;
+        if (!stat->name_)
+          break;
+      }
+    if (used_ >= CTRACE_AGGREGATE_FUNCTIONS / 4 * 3)
+      return &other_;
+    used_++;
+    slots_[i].cat_ = cat;
+    __sync_synchronize ();
+    slots_[i].name_ = name;
+    return &slots_[i];
+  }
+
+  void
+  Merge (const CTraceStatTable &from)
+  {
+    for (int i = 0; i < CTRACE_AGGREGATE_FUNCTIONS; ++i)
+      if (from.slots_[i].name_)
+        Find (from.slots_[i].cat_, from.slots_[i].name_)
+            ->Merge (from.slots_[i]);
+    other_.Merge (from.other_);
+  }
+
+  int used_;
+  CTraceStat other_;
+  CTraceStat slots_[CTRACE_AGGREGATE_FUNCTIONS];
+};
+
+// The merge of every table, by function name.  It lives across dumps
+// so that the counters show what happened since the previous one.
+class CTraceStatSummary
+{
+public:
+  CTraceStatSummary () : entries_ (NULL), size_ (0), capacity_ (0) {}
+  ~CTraceStatSummary () { free (entries_); }
+
+  // Forgets every function, and what the counters saw.
+  void
+  Reset ()
+  {
+    if (entries_)
+      memset (entries_, 0, capacity_ * sizeof (Entry));
+    size_ = 0;
+  }
+
+  // Starts a dump: clears the sums, keeps what the last counters saw.
+  void
+  Begin ()
+  {
+    for (size_t i = 0; i < capacity_; ++i)
+      if (entries_[i].stat_.name_)
+        {
+          const char *cat = entries_[i].stat_.cat_;
+          const char *name = entries_[i].stat_.name_;
+          memset (&entries_[i].stat_, 0, sizeof (CTraceStat));
+          entries_[i].stat_.cat_ = cat;
+          entries_[i].stat_.name_ = name;
+        }
+  }
+
+  void
+  Add (const CTraceStatTable &table)
+  {
+    for (int i = 0; i < CTRACE_AGGREGATE_FUNCTIONS; ++i)
+      {
+        const char *name = table.slots_[i].name_;
+        if (!name)
+          continue;
+        __sync_synchronize ();
+        Entry *entry = Find (table.slots_[i].cat_, name);
+        if (entry)
+          entry->stat_.Merge (table.slots_[i]);
+      }
+    if (table.other_.count_)
+      {
+        Entry *entry = Find (table.other_.cat_, table.other_.name_);
+        if (entry)
+          entry->stat_.Merge (table.other_);
+      }
+  }
+
+  // One line per function, by self time.
+  void
+  WriteTable (FILE *f)
+  {
+    size_t count;
+    Entry **sorted = Sort (&count, false);
+    if (!sorted)
+      return;
+    fprintf (f, "%12s %12s %14s %14s %14s %14s %10s %10s %10s  %s\n",
+             "calls", "timed", "total_us", "self_us", "cpu_us",
+             "cpu_self_us", "max_us", "p50_us", "p99_us", "name");
+    for (size_t i = 0; i < count; ++i)
+      {
+        const CTraceStat &s = sorted[i]->stat_;
+        fprintf (f,
+                 "%12llu %12llu %14llu %14llu %14llu %14llu %10llu %10llu "
+                 "%10llu  %s%s%s\n",
+                 Ull (s.count_), Ull (s.timed_), Ull (s.total_),
+                 Ull (s.self_), Ull (s.cpu_total_), Ull (s.cpu_self_),
+                 Ull (s.max_), Ull (s.Quantile (0.5)),
+                 Ull (s.Quantile (0.99)), s.cat_, *s.cat_ ? ":" : "",
+                 s.name_);
+      }
+    free (sorted);
+  }
+
+  // Appends the "calls" and "self_us" counter tracks: what the busiest
+  // functions did since the previous dump.
+  void
+  AppendCounters (CTraceBytes *out, bool comma, int pid, uint64_t ts)
+  {
+    size_t count;
+    Entry **sorted = Sort (&count, true);
+    if (!sorted)
+      return;
+    if (count > CTRACE_AGGREGATE_COUNTERS)
+      count = CTRACE_AGGREGATE_COUNTERS;
+    const char *names[CTRACE_AGGREGATE_COUNTERS];
+    uint64_t calls[CTRACE_AGGREGATE_COUNTERS];
+    uint64_t self[CTRACE_AGGREGATE_COUNTERS];
+    for (size_t i = 0; i < count; ++i)
+      {
+        names[i] = sorted[i]->stat_.name_;
+        calls[i] = sorted[i]->stat_.count_ - sorted[i]->last_count_;
+        self[i] = sorted[i]->stat_.self_ - sorted[i]->last_self_;
+      }
+    for (size_t i = 0; i < capacity_; ++i)
+      {
+        entries_[i].last_count_ = entries_[i].stat_.count_;
+        entries_[i].last_self_ = entries_[i].stat_.self_;
+      }
+    free (sorted);
+    CTraceJson::AppendCounter (out, comma, pid, ts, "calls", names, calls,
+                               count);
+    CTraceJson::AppendCounter (out, true, pid, ts, "self_us", names, self,
+                               count);
+  }
+
+private:
+  struct Entry
+  {
+    CTraceStat stat_;
+    uint64_t last_count_;
+    uint64_t last_self_;
+  };
+
+  static unsigned long long
+  Ull (uint64_t value)
+  {
+    return value;
+  }
+
+  static size_t
+  Hash (const char *cat, const char *name)
+  {
+    size_t hash = 2166136261u;
+    for (const char *p = cat; *p; ++p)
+      hash = (hash ^ static_cast<unsigned char> (*p)) * 16777619u;
+    for (const char *p = name; *p; ++p)
+      hash = (hash ^ static_cast<unsigned char> (*p)) * 16777619u;
+    return hash;
+  }
+
+  Entry *
+  Find (const char *cat, const char *name)
+  {
+    if ((size_ + 1) * 2 > capacity_ && !Grow ())
+      return NULL;
+    size_t mask = capacity_ - 1;
+    for (size_t i = Hash (cat, name) & mask;; i = (i + 1) & mask)
+      {
+        Entry *entry = &entries_[i];
+        if (!entry->stat_.name_)
+          {
+            size_++;
+            entry->stat_.cat_ = cat;
+            entry->stat_.name_ = name;
+            return entry;
+          }
+        if (strcmp (entry->stat_.name_, name) == 0
+            && strcmp (entry->stat_.cat_, cat) == 0)
+          return entry;
+      }
+  }
+
+  bool
+  Grow ()
+  {
+    size_t capacity = capacity_ ? capacity_ * 2 : 256;
+    Entry *entries = static_cast<Entry *> (calloc (capacity, sizeof (Entry)));
+    if (!entries)
+      return false;
+    Entry *old = entries_;
+    size_t old_capacity = capacity_;
+    entries_ = entries;
+    capacity_ = capacity;
+    size_ = 0;
+    for (size_t i = 0; i < old_capacity; ++i)
+      if (old[i].stat_.name_)
+        *Find (old[i].stat_.cat_, old[i].stat_.name_) = old[i];
+    free (old);
+    return true;
+  }
+
+  static int
+  CompareSelf (const void *a, const void *b)
+  {
+    uint64_t x = (*static_cast<Entry *const *> (a))->stat_.self_;
+    uint64_t y = (*static_cast<Entry *const *> (b))->stat_.self_;
+    return x < y ? 1 : x > y ? -1 : 0;
+  }
+
+  static int
+  CompareRecentSelf (const void *a, const void *b)
+  {
+    const Entry *x = *static_cast<Entry *const *> (a);
+    const Entry *y = *static_cast<Entry *const *> (b);
+    uint64_t dx = x->stat_.self_ - x->last_self_;
+    uint64_t dy = y->stat_.self_ - y->last_self_;
+    return dx < dy ? 1 : dx > dy ? -1 : 0;
+  }
+
+  // The entries with calls, by self time overall or since the last
+  // counters.  The caller frees the array.
+  Entry **
+  Sort (size_t *count, bool recent)
+  {
+    Entry **sorted
+        = static_cast<Entry **> (malloc ((size_ + 1) * sizeof (Entry *)));
+    if (!sorted)
+      return NULL;
+    *count = 0;
+    for (size_t i = 0; i < capacity_; ++i)
+      if (entries_[i].stat_.name_ && entries_[i].stat_.count_)
+        sorted[(*count)++] = &entries_[i];
+    qsort (sorted, *count, sizeof (Entry *),
+           recent ? CompareRecentSelf : CompareSelf);
+    return sorted;
+  }
+
+  Entry *entries_;
+  size_t size_;
+  size_t capacity_;
+
+  CTraceStatSummary (const CTraceStatSummary &);
+  void operator= (const CTraceStatSummary &);
+};
+
+#endif /* CTRACE_STATS_H */
@@ -0,0 +1,320 @@
+#ifndef CTRACE_STORE_H
+#define CTRACE_STORE_H
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "ctrace_format.h"
+
+// Indexed trace store, written by ctrace_index and read by ctrace_query.
+//
+// The events of every thread are sorted by timestamp and cut into
+// chunks of about kCTraceStoreChunkBytes, one after the other in the
+// file.  The index at the end has an entry per chunk with the time span
+// it covers, so a query reads the index, finds the chunks of the threads
+// it wants that overlap its window with a binary search, and only reads
+// those: its cost follows the size of the window, not of the trace.
+//
+// The file is the header, the chunks, then the names, the threads, the
+// chunks' entries and the otherData of the trace, and a footer with
+// their offsets.  The tables are the structs below, in the byte order
+// of the machine that wrote them.  An event in a chunk is
+//
+//   varint ts delta, varint dur, varint name id, varint size, JSON text
+//
+// with the ts delta relative to the previous event of the chunk (0 for
+// the first one) and the JSON text the event as the trace had it, so a
+// query writes it back unchanged.  Names are NUL terminated, in id
+// order, and keep the escapes they had in the JSON text.  Times are in
+// microseconds.
+
+static const char kCTraceStoreMagic[4] = { 'C', 'T', 'R', 'X' };
+static const uint32_t kCTraceStoreVersion = 1;
+static const size_t kCTraceStoreChunkBytes = 1 << 16;
+
+struct CTraceStoreHeader
+{
+  char magic_[4];
+  uint32_t version_;
+};
+
+struct CTraceStoreChunk
+{
+  uint64_t offset_;
+  uint64_t first_ts_;
+  uint64_t last_ts_;
+  // the latest end of an event of the thread in this chunk or an
+  // earlier one, which only grows along the chunks of a thread.
+  uint64_t max_end_;
+  uint32_t size_;
+  uint32_t count_;
+};
+
+struct CTraceStoreThread
+{
+  int32_t pid_;
+  int32_t tid_;
+  uint64_t first_chunk_;
+  uint64_t chunk_count_;
+  uint64_t event_count_;
+};
+
+struct CTraceStoreFooter
+{
+  uint64_t names_offset_;
+  uint64_t names_size_;
+  uint64_t threads_offset_;
+  uint64_t thread_count_;
+  uint64_t chunks_offset_;
+  uint64_t chunk_count_;
+  // , "otherData":{...} to follow the events, or nothing.
+  uint64_t other_data_offset_;
+  uint64_t other_data_size_;
+  uint64_t first_ts_;
+  uint64_t last_end_;
+  char magic_[4];
+  uint32_t version_;
+};
+
+// An event of a chunk.  json_ points into the chunk.
+struct CTraceStoreEvent
+{
+  uint64_t ts_;
+  uint64_t dur_;
+  uint64_t name_;
+  const uint8_t *json_;
+  size_t size_;
+};
+
+// Encodes and decodes the events of a chunk.
+struct CTraceStoreChunkFormat
+{
+  static void
+  AppendEvent (CTraceBytes *out, uint64_t last_ts,
+               const CTraceStoreEvent &event)
+  {
+    out->PutVarint (event.ts_ - last_ts);
+    out->PutVarint (event.dur_);
+    out->PutVarint (event.name_);
+    out->PutVarint (event.size_);
+    out->PutBytes (event.json_, event.size_);
+  }
+
+  // Decodes the event at *p, the one after an event at last_ts.
+  // Returns false at the end of the chunk or if it is damaged.
+  static bool
+  NextEvent (const uint8_t **p, const uint8_t *end, uint64_t last_ts,
+             CTraceStoreEvent *event)
+  {
+    uint64_t delta, size;
+    if (!GetVarint (p, end, &delta) || !GetVarint (p, end, &event->dur_)
+        || !GetVarint (p, end, &event->name_) || !GetVarint (p, end, &size)
+        || size > static_cast<uint64_t> (end - *p))
+      return false;
+    event->ts_ = last_ts + delta;
+    event->json_ = *p;
+    event->size_ = size;
+    *p += size;
+    return true;
+  }
+
+  static bool
+  GetVarint (const uint8_t **p, const uint8_t *end, uint64_t *value)
+  {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7)
+      {
+        uint8_t byte = *(*p)++;
+        result |= static_cast<uint64_t> (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+          {
+            *value = result;
+            return true;
+          }
+      }
+    return false;
+  }
+};
+
+// Reads the index of a store up front, and its chunks on demand.
+class CTraceStoreReader
+{
+public:
+  CTraceStoreReader (FILE *f)
+      : f_ (f), text_ (NULL), names_ (NULL), name_count_ (0),
+        threads_ (NULL), chunks_ (NULL)
+  {
+    memset (&footer_, 0, sizeof (footer_));
+  }
+
+  ~CTraceStoreReader ()
+  {
+    free (text_);
+    free (names_);
+    free (threads_);
+    free (chunks_);
+  }
+
+  bool
+  Open ()
+  {
+    CTraceStoreHeader header;
+    if (fread (&header, sizeof (header), 1, f_) != 1
+        || memcmp (header.magic_, kCTraceStoreMagic, sizeof (header.magic_))
+               != 0
+        || header.version_ != kCTraceStoreVersion)
+      return false;
+    if (fseeko (f_, -static_cast<off_t> (sizeof (footer_)), SEEK_END) != 0
+        || fread (&footer_, sizeof (footer_), 1, f_) != 1
+        || memcmp (footer_.magic_, kCTraceStoreMagic, sizeof (footer_.magic_))
+               != 0)
+      return false;
+    threads_ = static_cast<CTraceStoreThread *> (
+        Read (footer_.threads_offset_,
+              footer_.thread_count_ * sizeof (CTraceStoreThread)));
+    chunks_ = static_cast<CTraceStoreChunk *> (
+        Read (footer_.chunks_offset_,
+              footer_.chunk_count_ * sizeof (CTraceStoreChunk)));
+    if (!threads_ || !chunks_ || !ReadNames ())
+      return false;
+    void *other_data
+        = Read (footer_.other_data_offset_, footer_.other_data_size_);
+    if (!other_data)
+      return false;
+    other_data_.PutBytes (other_data, footer_.other_data_size_);
+    free (other_data);
+    return true;
+  }
+
+  size_t
+  ThreadCount () const
+  {
+    return footer_.thread_count_;
+  }
+
+  const CTraceStoreThread &
+  Thread (size_t i) const
+  {
+    return threads_[i];
+  }
+
+  const CTraceStoreChunk &
+  Chunk (size_t i) const
+  {
+    return chunks_[i];
+  }
+
+  size_t
+  NameCount () const
+  {
+    return name_count_;
+  }
+
+  const char *
+  Name (size_t id) const
+  {
+    return names_[id];
+  }
+
+  uint64_t
+  FirstTs () const
+  {
+    return footer_.first_ts_;
+  }
+
+  uint64_t
+  LastEnd () const
+  {
+    return footer_.last_end_;
+  }
+
+  const CTraceBytes &
+  OtherData () const
+  {
+    return other_data_;
+  }
+
+  // The first chunk of thread with an event that ends at or after ts,
+  // or the one past its last.
+  size_t
+  FindChunk (const CTraceStoreThread &thread, uint64_t ts) const
+  {
+    size_t low = thread.first_chunk_;
+    size_t high = thread.first_chunk_ + thread.chunk_count_;
+    while (low < high)
+      {
+        size_t middle = low + (high - low) / 2;
+        if (chunks_[middle].max_end_ < ts)
+          low = middle + 1;
+        else
+          high = middle;
+      }
+    return low;
+  }
+
+  bool
+  ReadChunk (size_t i, CTraceBytes *data)
+  {
+    data->size_ = 0;
+    if (!data->Reserve (chunks_[i].size_)
+        || fseeko (f_, chunks_[i].offset_, SEEK_SET) != 0
+        || fread (data->data_, chunks_[i].size_, 1, f_) != 1)
+      return false;
+    data->size_ = chunks_[i].size_;
+    return true;
+  }
+
+private:
+  void *
+  Read (uint64_t offset, uint64_t size)
+  {
+    void *data = malloc (size ? size : 1);
+    if (data && size
+        && (fseeko (f_, offset, SEEK_SET) != 0
+            || fread (data, size, 1, f_) != 1))
+      {
+        free (data);
+        return NULL;
+      }
+    return data;
+  }
+
+  bool
+  ReadNames ()
+  {
+    text_ = static_cast<char *> (
+        Read (footer_.names_offset_, footer_.names_size_));
+    if (!text_)
+      return false;
+    for (size_t i = 0; i < footer_.names_size_; ++i)
+      name_count_ += text_[i] == '\0';
+    names_ = static_cast<char **> (
+        malloc ((name_count_ ? name_count_ : 1) * sizeof (char *)));
+    if (!names_)
+      return false;
+    char *name = text_;
+    for (size_t i = 0; i < name_count_; ++i)
+      {
+        names_[i] = name;
+        name += strlen (name) + 1;
+      }
+    return true;
+  }
+
+  FILE *f_;
+  CTraceStoreFooter footer_;
+  // the names, one after the other, and where each of them starts.
+  char *text_;
+  char **names_;
+  size_t name_count_;
+  CTraceStoreThread *threads_;
+  CTraceStoreChunk *chunks_;
+  CTraceBytes other_data_;
+
+  CTraceStoreReader (const CTraceStoreReader &);
+  void operator= (const CTraceStoreReader &);
+};
+
+#endif /* CTRACE_STORE_H */
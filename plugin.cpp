@@ -22,7 +22,18 @@
 #include "stringpool.h"
 #include "gimplify.h"
 #include "gimple-iterator.h"
+#include "gimple-walk.h"
+#include "basic-block.h"
+#include "cfg.h"
+#include "cgraph.h"
+#include "diagnostic-core.h"
+#include "attribs.h"
+#include "fnmatch.h"
+#include "stor-layout.h"
+#include "varasm.h"
+#include "output.h"
 #define CTRACE_THREAD_SUPPORTED
+#define CTRACE_LAYOUT_ONLY
 #include "ctrace.h"
 
 extern void print_generic_decl (FILE *file, tree decl, int flags);
@@ -40,9 +51,66 @@ static struct pass_data mypass = {
   TODO_mark_first_instance, /* todo_flags_start */
   0,                        /* todo_flags_finish */
 };
+// runs after the ipa inliner, on the functions that survived it.
+static struct pass_data late_pass = {
+  GIMPLE_PASS,                  /* type */
+  "gen_trace_late",             /* name */
+  OPTGROUP_NONE,                /* optinfo_flags */
+  TV_NONE,                      /* tv_id */
+  PROP_ssa | PROP_cfg,          /* properties_required */
+  0,                            /* properties_provided */
+  0,                            /* properties_destroyed */
+  0,                            /* todo_flags_start */
+  TODO_update_ssa_only_virtuals, /* todo_flags_finish */
+};
 extern gcc::context *g;
 int plugin_is_GPL_compatible;
 
+// -fplugin-arg-gentrace-min-stmts=N: skip functions with fewer than N
+// gimple statements.
+static int min_stmts = 0;
+// -fplugin-arg-gentrace-placement=post-inline: instrument after the ipa
+// inliner instead of before omplower.
+static bool post_inline = false;
+// -fplugin-arg-gentrace-report: print what was skipped at the end.
+static bool report = false;
+
+// -fplugin-arg-gentrace-filter=FILE: include/exclude rules, one per
+// line, the first matching rule decides:
+//   -fun:GLOB    do not trace functions matching GLOB
+//   +fun:GLOB    trace functions matching GLOB
+//   -file:GLOB   do not trace functions defined in files matching GLOB
+//   +file:GLOB   trace functions defined in files matching GLOB
+// Empty lines and lines starting with '#' are ignored.  Functions no
+// rule matches are traced.
+struct filter_rule
+{
+  bool include;
+  bool file;
+  char *glob;
+};
+static vec<filter_rule> filter_rules;
+
+// -fplugin-arg-gentrace-descriptors=off: pass the function name to
+// __start_ctrace__/__end_ctrace__ instead of a CTraceFuncDesc to
+// __start_ctrace_fn__/__end_ctrace_fn__.
+static bool descriptors = true;
+// -fplugin-arg-gentrace-category=NAME: category of the descriptors.
+static const char *category = "profile";
+// -fplugin-arg-gentrace-armed: load the runtime's __ctrace_armed__ flag
+// on entry and only call the runtime if it was set.
+static bool armed = false;
+
+static struct
+{
+  int instrumented;
+  int below_min_stmts;
+  int may_throw;
+  int attribute_skipped;
+  int filtered;
+  int before_inline;
+} stats;
+
 static tree
 build_type ()
 {
@@ -66,14 +134,12 @@ build_type ()
 }
 
 static tree
-build_function_decl (const char *name, tree param_type)
+build_function_decl (const char *name, tree param_type, tree arg_type)
 {
   tree func_decl, function_type_list;
 
   function_type_list = build_function_type_list (
-      void_type_node, build_pointer_type (param_type),
-      build_pointer_type (build_type_variant (char_type_node, true, false)),
-      NULL_TREE);
+      void_type_node, build_pointer_type (param_type), arg_type, NULL_TREE);
   func_decl = build_decl (UNKNOWN_LOCATION, FUNCTION_DECL,
                           get_identifier (name), function_type_list);
   if (dump_file)
@@ -117,23 +183,183 @@ make_fname_decl ()
   return decl;
 }
 
+// Mirrors struct CTraceFuncDesc of ctrace_desc.h.
+static tree
+build_desc_type ()
+{
+  static const char *const names[] = { "name_", "cat_", "file_", "line_" };
+  tree type, fields = NULL_TREE, str_type;
+
+  str_type
+      = build_pointer_type (build_type_variant (char_type_node, true, false));
+  type = make_node (RECORD_TYPE);
+  for (int i = 3; i >= 0; --i)
+    {
+      tree field
+          = build_decl (UNKNOWN_LOCATION, FIELD_DECL, get_identifier (names[i]),
+                        i < 3 ? str_type : uint32_type_node);
+      DECL_FIELD_CONTEXT (field) = type;
+      DECL_CHAIN (field) = fields;
+      fields = field;
+    }
+  TYPE_FIELDS (type) = fields;
+  TYPE_NAME (type) = get_identifier ("CTraceFuncDesc");
+  layout_type (type);
+  gcc_assert (tree_to_uhwi (TYPE_SIZE_UNIT (type))
+              == sizeof (CTraceFuncDesc));
+  return type;
+}
+
+static tree
+build_str (const char *str)
+{
+  return build_string_literal (strlen (str) + 1, str);
+}
+
+// Builds the static CTraceFuncDesc of the current function, placed in
+// the ctrace_fdesc section.
+static tree
+make_desc_decl ()
+{
+  const char *name = lang_hooks.decl_printable_name (current_function_decl, 0);
+  const char *file = DECL_SOURCE_FILE (current_function_decl);
+  tree decl, type, field, init;
+  vec<constructor_elt, va_gc> *elts = NULL;
+
+  type = build_desc_type ();
+  field = TYPE_FIELDS (type);
+  CONSTRUCTOR_APPEND_ELT (elts, field, build_str (name));
+  field = DECL_CHAIN (field);
+  CONSTRUCTOR_APPEND_ELT (elts, field, build_str (category));
+  field = DECL_CHAIN (field);
+  CONSTRUCTOR_APPEND_ELT (elts, field, build_str (file ? file : ""));
+  field = DECL_CHAIN (field);
+  CONSTRUCTOR_APPEND_ELT (
+      elts, field,
+      build_int_cst (uint32_type_node,
+                     DECL_SOURCE_LINE (current_function_decl)));
+  init = build_constructor (type, elts);
+  TREE_CONSTANT (init) = 1;
+  TREE_STATIC (init) = 1;
+
+  decl = build_decl (UNKNOWN_LOCATION, VAR_DECL,
+                     get_identifier ("__ctrace_desc__"), type);
+  TREE_STATIC (decl) = 1;
+  DECL_ARTIFICIAL (decl) = 1;
+  DECL_INITIAL (decl) = init;
+  // the section must stay an array of descriptors, no extra padding.
+  DECL_ALIGN (decl) = TYPE_ALIGN (type);
+  DECL_USER_ALIGN (decl) = 1;
+  set_decl_section_name (decl, CTRACE_FDESC_SECTION);
+  // the runtime walks the whole section, keep unreferenced ones too.
+  DECL_PRESERVE_P (decl) = 1;
+  DECL_READ_P (decl) = 1;
+  TREE_USED (decl) = 1;
+  TREE_ADDRESSABLE (decl) = 1;
+  DECL_CONTEXT (decl) = current_function_decl;
+
+  return decl;
+}
+
+// The second argument of the start/end calls and the functions to call.
+// BODY is the gimple body to declare new variables in, NULL if the
+// function already went to ssa.
+static tree
+make_trace_arg (gimple_seq body, const char **start_name,
+                const char **end_name)
+{
+  tree decl;
+
+  if (!descriptors)
+    {
+      *start_name = "__start_ctrace__";
+      *end_name = "__end_ctrace__";
+      if (!body)
+        return build_str (
+            lang_hooks.decl_printable_name (current_function_decl, 0));
+      // mimic __FUNCTION__ builtin.
+      decl = make_fname_decl ();
+      declare_vars (decl, body, false);
+      return build1 (ADDR_EXPR, build_pointer_type (TREE_TYPE (decl)), decl);
+    }
+  *start_name = "__start_ctrace_fn__";
+  *end_name = "__end_ctrace_fn__";
+  decl = make_desc_decl ();
+  if (body)
+    declare_vars (decl, body, false);
+  else
+    varpool_node::add (decl);
+  return build_fold_addr_expr (decl);
+}
+
+// The __ctrace_armed__ flag of ctrace_arm.h, a volatile sig_atomic_t.
+static tree
+build_armed_decl ()
+{
+  tree decl = build_decl (UNKNOWN_LOCATION, VAR_DECL,
+                          get_identifier ("__ctrace_armed__"),
+                          integer_type_node);
+  TREE_PUBLIC (decl) = 1;
+  DECL_EXTERNAL (decl) = 1;
+  TREE_USED (decl) = 1;
+  TREE_THIS_VOLATILE (decl) = 1;
+  TREE_SIDE_EFFECTS (decl) = 1;
+  return decl;
+}
+
+// Appends "if (flag) call;" to SEQ.
+static void
+add_guarded_call (gimple_seq *seq, tree flag, gimple call)
+{
+  tree on = create_artificial_label (UNKNOWN_LOCATION);
+  tree off = create_artificial_label (UNKNOWN_LOCATION);
+  gimple_seq_add_stmt (seq, gimple_build_cond (NE_EXPR, flag,
+                                               integer_zero_node, on, off));
+  gimple_seq_add_stmt (seq, gimple_build_label (on));
+  gimple_seq_add_stmt (seq, call);
+  gimple_seq_add_stmt (seq, gimple_build_label (off));
+}
+
+// Makes CALL, already in the cfg, conditional on FLAG: the block is
+// split around it and a branch skips it.
+static void
+guard_call (gimple call, tree flag)
+{
+  gimple_stmt_iterator gsi = gsi_for_stmt (call);
+  gimple cond = gimple_build_cond (NE_EXPR, flag, integer_zero_node,
+                                   NULL_TREE, NULL_TREE);
+  gsi_insert_before (&gsi, cond, GSI_SAME_STMT);
+  basic_block cond_bb = gimple_bb (cond);
+  edge on = split_block (cond_bb, cond);
+  edge join = split_block (on->dest, call);
+  on->flags = (on->flags & ~EDGE_FALLTHRU) | EDGE_TRUE_VALUE;
+  on->probability = REG_BR_PROB_BASE / 2;
+  edge off = make_edge (cond_bb, join->dest, EDGE_FALSE_VALUE);
+  off->probability = REG_BR_PROB_BASE - on->probability;
+}
+
 static unsigned int
 execute_trace ()
 {
-  gimple_seq body, body_bind_body, inner_cleanup, outer_cleanup;
+  gimple_seq body, body_bind_body, start_seq = NULL, inner_cleanup = NULL,
+                                    outer_cleanup;
   gimple inner_try, outer_try;
-  tree record_type, func_start_decl, func_end_decl, var_decl,
-      function_name_decl, constructor_clobber;
-  gimple call_func_start;
-  gimple_stmt_iterator gsi;
+  tree record_type, func_start_decl, func_end_decl, var_decl, trace_arg,
+      constructor_clobber, flag_decl;
+  gimple call_func_start, call_func_end;
+  const char *start_name, *end_name;
 
+  // init variables of current body
+  body = gimple_body (current_function_decl);
+  // the descriptor or the name of this function
+  trace_arg = make_trace_arg (body, &start_name, &end_name);
   // build record type
   record_type = build_type ();
   // build start & end function decl
-  func_start_decl = build_function_decl ("__start_ctrace__", record_type);
-  func_end_decl = build_function_decl ("__end_ctrace__", record_type);
-  // init variables of current body
-  body = gimple_body (current_function_decl);
+  func_start_decl = build_function_decl (start_name, record_type,
+                                         TREE_TYPE (trace_arg));
+  func_end_decl
+      = build_function_decl (end_name, record_type, TREE_TYPE (trace_arg));
 
   var_decl = build_decl (UNKNOWN_LOCATION, VAR_DECL,
                          get_identifier ("__ctrace_var__"), record_type);
@@ -141,36 +367,48 @@ execute_trace ()
   TREE_ADDRESSABLE (var_decl) = 1;
   declare_vars (var_decl, body, false);
   TREE_USED (var_decl) = 1;
-  // mimic __FUNCTION__ builtin.
-  function_name_decl = make_fname_decl ();
-  declare_vars (function_name_decl, body, false);
   // construct inner try
   // init calls
   call_func_start = gimple_build_call (
       func_start_decl, 2,
       build1 (ADDR_EXPR, build_pointer_type (record_type), var_decl),
-      build1 (ADDR_EXPR, build_pointer_type (TREE_TYPE (function_name_decl)),
-              function_name_decl));
-  // make inner clean up
-  inner_cleanup = gimple_build_call (
+      trace_arg);
+  call_func_end = gimple_build_call (
       func_end_decl, 2,
       build1 (ADDR_EXPR, build_pointer_type (record_type), var_decl),
-      build1 (ADDR_EXPR, build_pointer_type (TREE_TYPE (function_name_decl)),
-              function_name_decl));
+      unshare_expr (trace_arg));
+  if (armed)
+    {
+      // both calls test the value loaded on entry, so they stay paired
+      // whatever the flag does in between.
+      flag_decl = build_decl (UNKNOWN_LOCATION, VAR_DECL,
+                              get_identifier ("__ctrace_on__"),
+                              integer_type_node);
+      DECL_CONTEXT (flag_decl) = current_function_decl;
+      declare_vars (flag_decl, body, false);
+      TREE_USED (flag_decl) = 1;
+      gimple_seq_add_stmt (
+          &start_seq, gimple_build_assign (flag_decl, build_armed_decl ()));
+      add_guarded_call (&start_seq, flag_decl, call_func_start);
+      add_guarded_call (&inner_cleanup, flag_decl, call_func_end);
+    }
+  else
+    {
+      gimple_seq_add_stmt (&start_seq, call_func_start);
+      gimple_seq_add_stmt (&inner_cleanup, call_func_end);
+    }
   // update inner try
   body_bind_body = gimple_bind_body (body);
   inner_try
       = gimple_build_try (body_bind_body, inner_cleanup, GIMPLE_TRY_FINALLY);
-  gsi = gsi_start (inner_try);
-  gsi_insert_before (&gsi, call_func_start, GSI_NEW_STMT);
+  gimple_seq_add_stmt (&start_seq, inner_try);
   // construct outer try
   constructor_clobber = make_node (CONSTRUCTOR);
   TREE_THIS_VOLATILE (constructor_clobber) = 1;
   TREE_TYPE (constructor_clobber) = TREE_TYPE (var_decl);
   outer_cleanup = gimple_build_assign (var_decl, constructor_clobber);
   // update outer try
-  outer_try
-      = gimple_build_try (call_func_start, outer_cleanup, GIMPLE_TRY_FINALLY);
+  outer_try = gimple_build_try (start_seq, outer_cleanup, GIMPLE_TRY_FINALLY);
   // update body bind body
   gimple_bind_set_body (body, outer_try);
   if (dump_file)
@@ -182,37 +420,410 @@ execute_trace ()
   return 0;
 }
 
+// Instruments a function that went through the ipa passes.  The body
+// is in ssa form by now, so instead of wrapping it into a try/finally
+// the start call goes on the entry edge and an end call before every
+// return.
+static unsigned int
+execute_trace_late ()
+{
+  tree record_type, func_start_decl, func_end_decl, var_decl, trace_arg,
+      flag = NULL_TREE;
+  gimple call;
+  gimple_seq entry_seq = NULL;
+  vec<gimple> calls = vNULL;
+  edge e;
+  edge_iterator ei;
+  const char *start_name, *end_name;
+
+  trace_arg = make_trace_arg (NULL, &start_name, &end_name);
+  record_type = build_type ();
+  func_start_decl = build_function_decl (start_name, record_type,
+                                         TREE_TYPE (trace_arg));
+  func_end_decl
+      = build_function_decl (end_name, record_type, TREE_TYPE (trace_arg));
+  DECL_EXTERNAL (func_start_decl) = 1;
+  TREE_PUBLIC (func_start_decl) = 1;
+  DECL_EXTERNAL (func_end_decl) = 1;
+  TREE_PUBLIC (func_end_decl) = 1;
+
+  var_decl = build_decl (UNKNOWN_LOCATION, VAR_DECL,
+                         get_identifier ("__ctrace_var__"), record_type);
+  DECL_CONTEXT (var_decl) = current_function_decl;
+  TREE_ADDRESSABLE (var_decl) = 1;
+  TREE_USED (var_decl) = 1;
+  add_local_decl (cfun, var_decl);
+
+  if (armed)
+    {
+      flag = make_ssa_name (integer_type_node, NULL);
+      gimple_seq_add_stmt (&entry_seq,
+                           gimple_build_assign (flag, build_armed_decl ()));
+    }
+  call = gimple_build_call (func_start_decl, 2,
+                            build_fold_addr_expr (var_decl), trace_arg);
+  gimple_seq_add_stmt (&entry_seq, call);
+  calls.safe_push (call);
+  gsi_insert_seq_on_edge_immediate (
+      single_succ_edge (ENTRY_BLOCK_PTR_FOR_FN (cfun)), entry_seq);
+
+  FOR_EACH_EDGE (e, ei, EXIT_BLOCK_PTR_FOR_FN (cfun)->preds)
+  {
+    gimple_stmt_iterator gsi = gsi_last_bb (e->src);
+    if (gsi_end_p (gsi) || gimple_code (gsi_stmt (gsi)) != GIMPLE_RETURN)
+      continue;
+    call = gimple_build_call (func_end_decl, 2,
+                              build_fold_addr_expr (var_decl),
+                              unshare_expr (trace_arg));
+    gsi_insert_before (&gsi, call, GSI_SAME_STMT);
+    calls.safe_push (call);
+  }
+  // the exit edges move as blocks are split, guard once they are all in.
+  if (armed)
+    {
+      for (unsigned i = 0; i < calls.length (); ++i)
+        guard_call (calls[i], flag);
+      free_dominance_info (CDI_DOMINATORS);
+    }
+  calls.release ();
+  cgraph_edge::rebuild_edges ();
+  if (dump_file)
+    {
+      dump_function_to_file (current_function_decl, dump_file,
+                             TDF_TREE | TDF_BLOCKS | TDF_VERBOSE);
+    }
+  return 0;
+}
+
+static tree
+count_stmt (gimple_stmt_iterator *gsi, bool *handled_ops_p,
+            struct walk_stmt_info *wi)
+{
+  switch (gimple_code (gsi_stmt (*gsi)))
+    {
+    case GIMPLE_BIND:
+    case GIMPLE_TRY:
+    case GIMPLE_LABEL:
+    case GIMPLE_NOP:
+    case GIMPLE_DEBUG:
+    case GIMPLE_PREDICT:
+      break;
+    default:
+      (*static_cast<int *> (wi->info))++;
+      break;
+    }
+  // still walk into binds and trys.
+  *handled_ops_p = false;
+  return NULL_TREE;
+}
+
+static int
+count_stmts (function *fun)
+{
+  int count = 0;
+  if (fun->cfg)
+    {
+      basic_block bb;
+      FOR_EACH_BB_FN (bb, fun)
+      {
+        gimple_stmt_iterator gsi;
+        for (gsi = gsi_start_bb (bb); !gsi_end_p (gsi); gsi_next (&gsi))
+          {
+            enum gimple_code code = gimple_code (gsi_stmt (gsi));
+            if (code != GIMPLE_LABEL && code != GIMPLE_DEBUG
+                && code != GIMPLE_PREDICT && code != GIMPLE_NOP)
+              count++;
+          }
+      }
+    }
+  else
+    {
+      struct walk_stmt_info wi;
+      memset (&wi, 0, sizeof (wi));
+      wi.info = &count;
+      walk_gimple_seq (gimple_body (fun->decl), count_stmt, NULL, &wi);
+    }
+  return count;
+}
+
+// The end call of the post-inline placement is not exception safe, so
+// leave alone functions an exception can leave.
+static bool
+may_throw_externally (function *fun)
+{
+  basic_block bb;
+  if (fun->calls_setjmp)
+    return true;
+  FOR_EACH_BB_FN (bb, fun)
+  {
+    gimple_stmt_iterator gsi;
+    for (gsi = gsi_start_bb (bb); !gsi_end_p (gsi); gsi_next (&gsi))
+      if (stmt_can_throw_external (gsi_stmt (gsi)))
+        return true;
+  }
+  return false;
+}
+
+static bool
+read_filter_file (const char *path)
+{
+  FILE *f = fopen (path, "r");
+  char line[1024];
+  int lineno = 0;
+
+  if (!f)
+    {
+      error ("gentrace: cannot open filter file %qs", path);
+      return false;
+    }
+  while (fgets (line, sizeof (line), f))
+    {
+      filter_rule rule;
+      char *p = line + strlen (line);
+
+      lineno++;
+      while (p > line && ISSPACE (p[-1]))
+        *--p = '\0';
+      if (line[0] == '\0' || line[0] == '#')
+        continue;
+      if (line[0] != '+' && line[0] != '-')
+        goto bad_line;
+      rule.include = line[0] == '+';
+      if (strncmp (line + 1, "fun:", 4) == 0)
+        {
+          rule.file = false;
+          rule.glob = xstrdup (line + 5);
+        }
+      else if (strncmp (line + 1, "file:", 5) == 0)
+        {
+          rule.file = true;
+          rule.glob = xstrdup (line + 6);
+        }
+      else
+        goto bad_line;
+      filter_rules.safe_push (rule);
+      continue;
+    bad_line:
+      error ("gentrace: %s:%d: expected [+-]fun:GLOB or [+-]file:GLOB", path,
+             lineno);
+      fclose (f);
+      return false;
+    }
+  fclose (f);
+  return true;
+}
+
+// Whether the filter rules let this function be traced.
+static bool
+filter_allows (tree decl)
+{
+  const char *name = lang_hooks.decl_printable_name (decl, 2);
+  const char *file = DECL_SOURCE_FILE (decl);
+  unsigned i;
+  filter_rule *rule;
+
+  FOR_EACH_VEC_ELT (filter_rules, i, rule)
+  {
+    const char *subject = rule->file ? file : name;
+    if (subject && fnmatch (rule->glob, subject, 0) == 0)
+      return rule->include;
+  }
+  return true;
+}
+
+static tree
+handle_gentrace_attribute (tree *node, tree name, tree, int,
+                           bool *no_add_attrs)
+{
+  if (TREE_CODE (*node) != FUNCTION_DECL)
+    {
+      warning (OPT_Wattributes, "%qE attribute only applies to functions",
+               name);
+      *no_add_attrs = true;
+    }
+  return NULL_TREE;
+}
+
+// __attribute__ ((gentrace_skip)) never traces a function,
+// __attribute__ ((gentrace_force)) always does, whatever the filters
+// and min-stmts say.
+static struct attribute_spec gentrace_skip_attr
+    = { "gentrace_skip", 0, 0, true, false, false, handle_gentrace_attribute,
+        false };
+static struct attribute_spec gentrace_force_attr
+    = { "gentrace_force", 0, 0, true, false, false, handle_gentrace_attribute,
+        false };
+
+static void
+register_attributes (void *, void *)
+{
+  register_attribute (&gentrace_skip_attr);
+  register_attribute (&gentrace_force_attr);
+}
+
 class trace_pass : public gimple_opt_pass
 {
 public:
-  trace_pass (pass_data &mydata, gcc::context *context)
-      : gimple_opt_pass (mydata, context)
+  trace_pass (pass_data &mydata, gcc::context *context, bool late)
+      : gimple_opt_pass (mydata, context), late_ (late)
   {
   }
 
   virtual bool
-  gate (function *)
+  gate (function *fun)
   {
+    tree attrs = DECL_ATTRIBUTES (fun->decl);
+    if (lookup_attribute ("gentrace_skip", attrs))
+      {
+        stats.attribute_skipped++;
+        return false;
+      }
+    bool forced = lookup_attribute ("gentrace_force", attrs) != NULL_TREE;
+    if (!forced && !filter_allows (fun->decl))
+      {
+        stats.filtered++;
+        return false;
+      }
+    if (!forced && min_stmts > 0 && count_stmts (fun) < min_stmts)
+      {
+        stats.below_min_stmts++;
+        return false;
+      }
+    // even a forced function can not take the late placement if it may
+    // throw.
+    if (late_ && may_throw_externally (fun))
+      {
+        stats.may_throw++;
+        return false;
+      }
+    stats.instrumented++;
     return true;
   }
   unsigned int
   execute (function *)
   {
-    return execute_trace ();
+    return late_ ? execute_trace_late () : execute_trace ();
   }
+
+private:
+  bool late_;
 };
 
+// Counts the functions with a body before the ipa passes run, the ones
+// that do not show up in the late pass were inlined or removed.
+static void
+count_functions_before_inline (void *, void *)
+{
+  cgraph_node *node;
+  FOR_EACH_FUNCTION_WITH_GIMPLE_BODY (node)
+    stats.before_inline++;
+}
+
+static void
+print_report (void *, void *)
+{
+  int skipped = stats.below_min_stmts + stats.may_throw
+                + stats.attribute_skipped + stats.filtered;
+  fprintf (stderr, "gentrace: %s: %d functions instrumented, %d skipped "
+                   "(%d below min-stmts, %d may throw, %d gentrace_skip, "
+                   "%d filtered",
+           main_input_filename, stats.instrumented, skipped,
+           stats.below_min_stmts, stats.may_throw, stats.attribute_skipped,
+           stats.filtered);
+  if (post_inline)
+    {
+      int inlined = stats.before_inline - stats.instrumented - skipped;
+      fprintf (stderr, ", %d inlined or removed", inlined > 0 ? inlined : 0);
+    }
+  fprintf (stderr, ")\n");
+}
+
+static bool
+parse_args (struct plugin_name_args *plugin_info)
+{
+  for (int i = 0; i < plugin_info->argc; ++i)
+    {
+      const char *key = plugin_info->argv[i].key;
+      const char *value = plugin_info->argv[i].value;
+      if (strcmp (key, "min-stmts") == 0 && value)
+        {
+          min_stmts = atoi (value);
+        }
+      else if (strcmp (key, "placement") == 0 && value)
+        {
+          if (strcmp (value, "post-inline") == 0)
+            post_inline = true;
+          else if (strcmp (value, "early") == 0)
+            post_inline = false;
+          else
+            {
+              error ("gentrace: unknown placement %qs", value);
+              return false;
+            }
+        }
+      else if (strcmp (key, "report") == 0)
+        {
+          report = true;
+        }
+      else if (strcmp (key, "descriptors") == 0)
+        {
+          descriptors = !value || strcmp (value, "off") != 0;
+        }
+      else if (strcmp (key, "category") == 0 && value)
+        {
+          category = xstrdup (value);
+        }
+      else if (strcmp (key, "armed") == 0)
+        {
+          armed = true;
+        }
+      else if (strcmp (key, "filter") == 0 && value)
+        {
+          if (!read_filter_file (value))
+            return false;
+        }
+      else
+        {
+          error ("gentrace: unknown argument %qs", key);
+          return false;
+        }
+    }
+  return true;
+}
+
 int
 plugin_init (struct plugin_name_args *plugin_info,
              struct plugin_gcc_version *version)
 {
-  struct register_pass_info pass_info
-      = { new trace_pass (mypass, g), "omplower", 1, PASS_POS_INSERT_BEFORE };
+  struct register_pass_info pass_info;
+
+  if (!parse_args (plugin_info))
+    return 1;
 
   /* Code to fill in the pass_info object with new pass information.  */
+  if (post_inline)
+    {
+      pass_info.pass = new trace_pass (late_pass, g, true);
+      pass_info.reference_pass_name = "ehdisp";
+    }
+  else
+    {
+      pass_info.pass = new trace_pass (mypass, g, false);
+      pass_info.reference_pass_name = "omplower";
+    }
+  pass_info.ref_pass_instance_number = 1;
+  pass_info.pos_op = PASS_POS_INSERT_BEFORE;
 
   /* Register the new pass.  */
   register_callback (plugin_info->base_name, PLUGIN_PASS_MANAGER_SETUP, NULL,
                      &pass_info);
+  register_callback (plugin_info->base_name, PLUGIN_ATTRIBUTES,
+                     register_attributes, NULL);
+  if (post_inline)
+    register_callback (plugin_info->base_name, PLUGIN_ALL_IPA_PASSES_START,
+                       count_functions_before_inline, NULL);
+  if (report)
+    register_callback (plugin_info->base_name, PLUGIN_FINISH, print_report,
+                       NULL);
   return 0;
 }
@@ -1,10 +1,17 @@
 #include <new>
 #define CTRACE_THREAD_SUPPORTED
 #include "ctrace.h"
+#define CTRACE_ARM_IMPLEMENTATION
+#include "ctrace_arm.h"
 
 extern "C" {
 extern void __start_ctrace__ (void *c, const char *name);
 extern void __end_ctrace__ (CTrace *c, const char *name);
+extern void __start_ctrace_fn__ (void *c, const CTraceFuncDesc *desc);
+extern void __end_ctrace_fn__ (CTrace *c, const CTraceFuncDesc *desc);
+#ifdef CTRACE_FLIGHT_RECORDER
+extern int ctrace_dump_flight_recorder ();
+#endif // CTRACE_FLIGHT_RECORDER
 }
 
 void
@@ -18,3 +25,23 @@ __end_ctrace__ (CTrace *c, const char *name)
 {
   c->~CTrace ();
 }
+
+void
+__start_ctrace_fn__ (void *c, const CTraceFuncDesc *desc)
+{
+  new (c) CTrace (desc);
+}
+
+void
+__end_ctrace_fn__ (CTrace *c, const CTraceFuncDesc *)
+{
+  c->~CTrace ();
+}
+
+#ifdef CTRACE_FLIGHT_RECORDER
+int
+ctrace_dump_flight_recorder ()
+{
+  return CTraceFlightRecorder::Dump ();
+}
+#endif // CTRACE_FLIGHT_RECORDER
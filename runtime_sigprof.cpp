@@ -5,25 +5,159 @@
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 // POSIX Headers
 #include <unistd.h>
 #include <pthread.h>
 #include <signal.h>
 #include <sys/time.h>
 #include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#ifdef CTRACE_SAMPLE_PC
+#include <dlfcn.h>
+#endif // CTRACE_SAMPLE_PC
+#ifdef CTRACE_RESOURCE_COUNTERS
+#include <sys/resource.h>
+#endif // CTRACE_RESOURCE_COUNTERS
 // C++ Headers
 #include <new>
 
+#define CTRACE_ARM_IMPLEMENTATION
+#include "ctrace_arm.h"
+#include "ctrace_clock.h"
+#include "ctrace_crash.h"
+#include "ctrace_desc.h"
+#include "ctrace_fork.h"
+#include "ctrace_format.h"
+#include "ctrace_overhead.h"
+#ifdef CTRACE_MMAP_OUTPUT
+#include "ctrace_mmap.h"
+#endif // CTRACE_MMAP_OUTPUT
+#ifdef CTRACE_GZIP_OUTPUT
+#include "ctrace_gzip.h"
+#endif // CTRACE_GZIP_OUTPUT
+#ifdef CTRACE_AGGREGATE
+#include "ctrace_stats.h"
+#endif // CTRACE_AGGREGATE
+#ifdef CTRACE_FLIGHT_RECORDER
+#include "ctrace_flight.h"
+#endif // CTRACE_FLIGHT_RECORDER
+
 #ifndef CTRACE_FILE_NAME
+#if defined(CTRACE_BINARY_OUTPUT)
+#define CTRACE_FILE_NAME "/sdcard/trace.ctrace"
+#elif defined(CTRACE_GZIP_OUTPUT)
+#define CTRACE_FILE_NAME "/sdcard/trace.json.gz"
+#else
 #define CTRACE_FILE_NAME "/sdcard/trace.json"
+#endif
 #endif // CTRACE_FILE_NAME
-#define CRASH()                                                               \
-  do                                                                          \
-    {                                                                         \
-      (*(int *)0xeadbaddc = 0);                                               \
-    }                                                                         \
-  while (0)
+// With CTRACE_GZIP_OUTPUT the writer deflates its batches into a
+// .json.gz (ctrace_gzip.h).
+#if defined(CTRACE_GZIP_OUTPUT)                                         \
+    && (defined(CTRACE_BINARY_OUTPUT) || defined(CTRACE_MMAP_OUTPUT))
+#error "CTRACE_GZIP_OUTPUT only writes JSON, through write()"
+#endif
+// Records a thread may have in flight before new ones are dropped.
+#ifndef CTRACE_MAX_RECORDS_PER_THREAD
+#define CTRACE_MAX_RECORDS_PER_THREAD 65536
+#endif // CTRACE_MAX_RECORDS_PER_THREAD
+// Formatted bytes the writer collects before it calls write().
+#ifndef CTRACE_WRITE_BATCH_BYTES
+#define CTRACE_WRITE_BATCH_BYTES (1 << 20)
+#endif // CTRACE_WRITE_BATCH_BYTES
+// The writer drains the pending records every CTRACE_WRITER_INTERVAL_MS
+// on its own; traced threads only wake it early once this many records
+// are pending.
+#ifndef CTRACE_WRITER_INTERVAL_MS
+#define CTRACE_WRITER_INTERVAL_MS 50
+#endif // CTRACE_WRITER_INTERVAL_MS
+#ifndef CTRACE_WRITER_HIGH_WATER
+#define CTRACE_WRITER_HIGH_WATER 4096
+#endif // CTRACE_WRITER_HIGH_WATER
+// Deepest nesting tracked per thread; deeper frames are not recorded.
+#ifndef CTRACE_MAX_STACK_DEPTH
+#define CTRACE_MAX_STACK_DEPTH 65536
+#endif // CTRACE_MAX_STACK_DEPTH
+// With CTRACE_THREAD_TIMERS every traced thread gets its own SIGPROF
+// timer on its cpu clock, created in ThreadInfo::New and deleted with
+// the thread, instead of the process-wide ITIMER_PROF, which lands on
+// arbitrary threads.  Either way the CTRACE_SAMPLE_INTERVAL_US
+// environment variable overrides the interval.
+// With CTRACE_SAMPLING every SIGPROF tick also snapshots the innermost
+// CTRACE_SAMPLE_DEPTH frames of the shadow stack, and with
+// CTRACE_SAMPLE_PC the interrupted pc, into a ring of
+// CTRACE_SAMPLES_PER_THREAD (a power of two) samples.  The writer folds
+// them into a call tree, written to CTRACE_FOLDED_FILE_NAME at exit as
+// folded stacks for flame graphs.
+// With CTRACE_AGGREGATE finished calls update per thread statistics
+// (ctrace_stats.h) instead of becoming records.  Calls a tick landed in
+// are timed from the same estimates the records would have; the others
+// are only counted.  Every CTRACE_AGGREGATE_INTERVAL_MS, and at exit,
+// the writer rewrites CTRACE_SUMMARY_FILE_NAME and adds counter tracks
+// to the trace.  Self time is tracked for the outermost
+// CTRACE_AGGREGATE_MAX_DEPTH frames.
+// A forked child drops what it inherited, starts its own writer and
+// timer, and writes a file of its own from its first batch on
+// (ctrace_fork.h).
+// With CTRACE_RESOURCE_COUNTERS the writer adds counter tracks of the
+// process to the trace every CTRACE_RESOURCE_COUNTERS_INTERVAL_MS: its
+// resident set in bytes, and the minor and major page faults and
+// voluntary context switches since the sample before, or since the
+// process started for the first one.  The writer reads them itself, so
+// the traced threads pay nothing for them.
+#ifdef CTRACE_AGGREGATE
+#ifndef CTRACE_AGGREGATE_INTERVAL_MS
+#define CTRACE_AGGREGATE_INTERVAL_MS 1000
+#endif // CTRACE_AGGREGATE_INTERVAL_MS
+#ifndef CTRACE_AGGREGATE_MAX_DEPTH
+#define CTRACE_AGGREGATE_MAX_DEPTH 256
+#endif // CTRACE_AGGREGATE_MAX_DEPTH
+#ifndef CTRACE_SUMMARY_FILE_NAME
+#define CTRACE_SUMMARY_FILE_NAME CTRACE_FILE_NAME ".summary"
+#endif // CTRACE_SUMMARY_FILE_NAME
+#endif // CTRACE_AGGREGATE
+// With CTRACE_FLIGHT_RECORDER the records go to per thread rings in
+// memory instead of the trace file, and are only written out by a dump
+// (ctrace_flight.h, or ctrace_dump_flight_recorder).  Open calls show
+// once a tick gave them a start time.
+#if defined(CTRACE_FLIGHT_RECORDER) && defined(CTRACE_AGGREGATE)
+#error "CTRACE_FLIGHT_RECORDER and CTRACE_AGGREGATE do not mix"
+#endif
+#ifdef CTRACE_RESOURCE_COUNTERS
+#ifdef CTRACE_FLIGHT_RECORDER
+#error "CTRACE_RESOURCE_COUNTERS and CTRACE_FLIGHT_RECORDER do not mix"
+#endif // CTRACE_FLIGHT_RECORDER
+#ifndef CTRACE_RESOURCE_COUNTERS_INTERVAL_MS
+#define CTRACE_RESOURCE_COUNTERS_INTERVAL_MS 100
+#endif // CTRACE_RESOURCE_COUNTERS_INTERVAL_MS
+#endif // CTRACE_RESOURCE_COUNTERS
+#ifdef CTRACE_SAMPLING
+#ifndef CTRACE_SAMPLE_DEPTH
+#define CTRACE_SAMPLE_DEPTH 32
+#endif // CTRACE_SAMPLE_DEPTH
+#ifndef CTRACE_SAMPLES_PER_THREAD
+#define CTRACE_SAMPLES_PER_THREAD 256
+#endif // CTRACE_SAMPLES_PER_THREAD
+#ifndef CTRACE_FOLDED_FILE_NAME
+#define CTRACE_FOLDED_FILE_NAME CTRACE_FILE_NAME ".folded"
+#endif // CTRACE_FOLDED_FILE_NAME
+#endif // CTRACE_SAMPLING
+// Unless built with CTRACE_COMPENSATE_OVERHEAD=0 the time of the calls
+// finished since the outermost open one began is taken off the wall
+// times a tick gives the frames (ctrace_overhead.h).  Thread times count
+// ticks of the timer rather than read a cpu clock and are left alone.
+// The writer's counters belong to no call and stay on the raw clock,
+// which is that of the outermost calls.
+#ifndef CTRACE_COMPENSATE_OVERHEAD
+#define CTRACE_COMPENSATE_OVERHEAD 1
+#endif // CTRACE_COMPENSATE_OVERHEAD
 
 #ifdef CTRACE_ENABLE_STAT
 int stat_find_miss = 0;
@@ -31,18 +165,69 @@ int stat_find_miss = 0;
 namespace
 {
 pthread_key_t thread_info_key;
-FILE *file_to_write;
+int fd_to_write = -1;
 static const uint64_t invalid_time = static_cast<uint64_t> (-1);
+// default sampling interval in microseconds of cpu time.
 static const int frequency = 100;
+int sample_interval_us = frequency;
 static const int ticks = 1;
+// ticks of the wall clock (CTraceClock) in one microsecond.
+uint64_t wall_ticks = 1;
 static const int max_idle_times = 1000;
 
-// for WriterThread
-pthread_mutex_t writer_waitup_mutex = PTHREAD_MUTEX_INITIALIZER;
-volatile bool writer_waitup = false;
-pthread_cond_t writer_waitup_cond = PTHREAD_COND_INITIALIZER;
+// for WriterThread, which the flight recorder only runs for samples.
+#if !defined(CTRACE_FLIGHT_RECORDER) || defined(CTRACE_SAMPLING)
+// eventfd the writer polls on, -1 if it only wakes on its interval.
+int writer_wakeup_fd = -1;
+// set while the writer sleeps without a timeout, after being idle for
+// max_writer_idle_intervals.
+volatile int writer_parked;
+static const int max_writer_idle_intervals = 20;
+#endif // !CTRACE_FLIGHT_RECORDER || CTRACE_SAMPLING
 struct Record;
 struct Record *pending_records_head;
+volatile int pending_records_count;
+// records lost because a thread's pool was exhausted.
+int dropped_records;
+#ifdef CTRACE_SAMPLING
+// samples lost because the writer did not empty a ring in time.
+int dropped_samples;
+#endif // CTRACE_SAMPLING
+// formatted output of the writer, reused across batches.
+CTraceBytes write_buffer;
+#ifndef CTRACE_BINARY_OUTPUT
+// whether write_buffer's next JSON event follows another one.
+bool need_comma;
+#endif // CTRACE_BINARY_OUTPUT
+// held by the writer while it formats and writes; a crash takes it for
+// good.
+CTraceCrashLock write_lock;
+#if !defined(CTRACE_MMAP_OUTPUT) && !defined(CTRACE_GZIP_OUTPUT)
+// fd_to_write is a file the trailer can be rewritten in after every
+// batch, not a pipe.
+bool seekable_output;
+#endif
+#ifdef CTRACE_MMAP_OUTPUT
+// takes over fd_to_write.
+CTraceMappedFile mapped_file;
+#endif // CTRACE_MMAP_OUTPUT
+#ifdef CTRACE_GZIP_OUTPUT
+// takes over fd_to_write.
+CTraceGzipFile gzip_file;
+#endif // CTRACE_GZIP_OUTPUT
+#ifdef CTRACE_BINARY_OUTPUT
+CTraceBinaryWriter binary_writer;
+// the thread of the block binary_writer has open, 0 if none.
+int binary_block_tid;
+#endif // CTRACE_BINARY_OUTPUT
+// set in a forked child until its first batch: fd_to_write is still the
+// parent's file.
+bool reopen_trace;
+#ifdef CTRACE_FLIGHT_RECORDER
+// The flight recorder writes no trace file, so fd_to_write stays -1;
+// calls are recorded unless this is clear, in a child left alone.
+bool flight_recording;
+#endif // CTRACE_FLIGHT_RECORDER
 
 #ifdef __ARM_EABI__
 
@@ -88,21 +273,94 @@ struct CTraceStruct
   uint64_t min_end_time_;
   uint64_t start_time_thread_;
   uint64_t min_end_time_thread_;
+  const char *cat_;
   const char *name_;
-  CTraceStruct (const char *);
+  // the thread's finished calls when min_end_time_ was taken.  All of
+  // it has to fit in sizeof (CTrace), the plugin's frame.
+  uint64_t scopes_end_;
+  CTraceStruct (const char *, const char *);
+};
+
+struct RecordPool;
+
+// Shadow stack of a thread slot, grown a chunk at a time so that deep
+// recursion costs memory only while it happens.  Frames at or above
+// capacity_ are not tracked.  Chunks come from mmap since the thread may
+// be inside malloc, and MyHandler reads them on the same thread.
+struct ThreadStack
+{
+  static const int frames_per_chunk = 256;
+  static const int max_chunks
+      = (CTRACE_MAX_STACK_DEPTH + frames_per_chunk - 1) / frames_per_chunk;
+  CTraceStruct **chunks_[max_chunks];
+  int capacity_;
+  CTraceStruct *&
+  At (int i)
+  {
+    return chunks_[i / frames_per_chunk][i % frames_per_chunk];
+  }
+  bool Grow ();
+};
+
+#ifdef CTRACE_SAMPLING
+// One tick of a thread.  frames_ runs from the outermost frame kept to
+// the innermost one.
+struct Sample
+{
+  int depth_;
+  // outer frames did not fit.
+  bool truncated_;
+  uintptr_t pc_;
+  const char *frames_[CTRACE_SAMPLE_DEPTH];
 };
 
+// Samples of a thread slot.  MyHandler on the slot's thread is the only
+// producer and the writer the only consumer, so the indices are enough.
+struct SampleRing
+{
+  static const unsigned int size = CTRACE_SAMPLES_PER_THREAD;
+  volatile unsigned int head_;
+  volatile unsigned int tail_;
+  Sample samples_[size];
+};
+#endif // CTRACE_SAMPLING
+
 struct ThreadInfo
 {
-  static const int max_stack = 1000;
   int pid_;
   int tid_;
-  CTraceStruct *stack_[max_stack];
+  ThreadStack *stack_;
   int stack_end_;
   uint64_t current_time_;
   uint64_t current_time_thread_;
   int idle_times_;
   bool blocked_;
+  RecordPool *pool_;
+#if CTRACE_COMPENSATE_OVERHEAD
+  // calls finished since the outermost open one began, and when
+  // current_time_ was taken.
+  uint64_t scopes_;
+  uint64_t scopes_current_;
+#endif // CTRACE_COMPENSATE_OVERHEAD
+#ifdef CTRACE_THREAD_TIMERS
+  timer_t timer_;
+  bool has_timer_;
+#endif // CTRACE_THREAD_TIMERS
+#ifdef CTRACE_SAMPLING
+  SampleRing *samples_;
+#endif // CTRACE_SAMPLING
+#ifdef CTRACE_AGGREGATE
+  CTraceStatTable *stats_;
+  // time of the timed callees of each open frame, wall ticks and
+  // thread microseconds.
+  uint64_t children_[CTRACE_AGGREGATE_MAX_DEPTH];
+  uint64_t children_thread_[CTRACE_AGGREGATE_MAX_DEPTH];
+#endif // CTRACE_AGGREGATE
+#ifdef CTRACE_FLIGHT_RECORDER
+  CTraceFlightRing *flight_;
+#endif // CTRACE_FLIGHT_RECORDER
+  // the alternate stack the crash hook runs on, if the thread took it.
+  void *crash_stack_;
   ThreadInfo ();
   void UpdateCurrentTime ();
   void UpdateCurrentTimeThread ();
@@ -111,8 +369,135 @@ struct ThreadInfo
   static ThreadInfo *Find ();
 };
 
-static const int MAX_THREADS = 100;
-char info_store_char[MAX_THREADS * sizeof (ThreadInfo)];
+struct Record
+{
+  int pid_;
+  int tid_;
+  uint64_t start_time_;
+  uint64_t dur_;
+  uint64_t start_time_thread_;
+  uint64_t dur_thread_;
+  const char *cat_;
+  const char *name_;
+  struct Record *next_;
+  RecordPool *pool_;
+};
+
+// Records of one thread slot.  The slot's thread allocates from free_
+// without any synchronization, the writer thread pushes written records
+// to returned_, and the owner takes them all back at once when free_
+// runs dry.  The pool stays with the slot when its thread exits.
+struct RecordPool
+{
+  static const int records_per_slab = 512;
+  Record *free_;
+  Record *returned_;
+  int allocated_;
+  Record *Alloc ();
+  void Release (Record *);
+  bool Grow ();
+};
+
+// Everything a thread uses, kept together when it exits so the next
+// thread reuses the records and stack chunks.  Slots are mapped
+// slots_per_chunk at a time as threads are created and never unmapped;
+// free ones are linked through the first bytes of info_.
+struct ThreadSlot
+{
+  ThreadInfo info_;
+  RecordPool pool_;
+  ThreadStack stack_;
+#ifdef CTRACE_SAMPLING
+  SampleRing *samples_;
+#endif // CTRACE_SAMPLING
+#ifdef CTRACE_AGGREGATE
+  CTraceStatTable *stats_;
+#endif // CTRACE_AGGREGATE
+  // mapped by the first thread of the slot, and used by each in turn.
+  void *crash_stack_;
+};
+
+static const int slots_per_chunk = 32;
+
+struct SlotChunk
+{
+  SlotChunk *next_;
+  ThreadSlot slots_[slots_per_chunk];
+};
+
+// every chunk mapped so far, newest first.
+SlotChunk *slot_chunks;
+
+bool
+ThreadStack::Grow ()
+{
+  int chunk = capacity_ / frames_per_chunk;
+  if (chunk >= max_chunks)
+    return false;
+  if (!chunks_[chunk])
+    {
+      void *frames = mmap (NULL, frames_per_chunk * sizeof (CTraceStruct *),
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (frames == MAP_FAILED)
+        return false;
+      chunks_[chunk] = static_cast<CTraceStruct **> (frames);
+    }
+  capacity_ += frames_per_chunk;
+  return true;
+}
+
+// Only RecordThis takes records.
+#if !defined(CTRACE_AGGREGATE) && !defined(CTRACE_FLIGHT_RECORDER)
+bool
+RecordPool::Grow ()
+{
+  if (allocated_ + records_per_slab > CTRACE_MAX_RECORDS_PER_THREAD)
+    return false;
+  // mmap rather than malloc: the traced thread may be inside malloc.
+  void *slab = mmap (NULL, records_per_slab * sizeof (Record),
+                     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                     0);
+  if (slab == MAP_FAILED)
+    return false;
+  Record *records = static_cast<Record *> (slab);
+  for (int i = 0; i < records_per_slab; ++i)
+    {
+      records[i].pool_ = this;
+      records[i].next_ = free_;
+      free_ = &records[i];
+    }
+  allocated_ += records_per_slab;
+  return true;
+}
+
+Record *
+RecordPool::Alloc ()
+{
+  if (!free_)
+    free_ = __sync_lock_test_and_set (&returned_, NULL);
+  if (!free_ && !Grow ())
+    {
+      __sync_fetch_and_add (&dropped_records, 1);
+      return NULL;
+    }
+  Record *r = free_;
+  free_ = r->next_;
+  return r;
+}
+#endif // !CTRACE_AGGREGATE && !CTRACE_FLIGHT_RECORDER
+
+void
+RecordPool::Release (Record *r)
+{
+  while (true)
+    {
+      Record *current_head = returned_;
+      r->next_ = current_head;
+      if (__sync_bool_compare_and_swap (&returned_, current_head, r))
+        break;
+    }
+}
 
 struct FreeListNode
 {
@@ -145,28 +530,128 @@ ThreadInfo::UpdateCurrentTime ()
 void
 ThreadInfo::UpdateCurrentTimeThread ()
 {
-  current_time_thread_ += ticks * frequency;
+  current_time_thread_ += ticks * sample_interval_us;
 }
 
-ThreadInfo *
-ThreadInfo::New ()
+void
+PushFreeSlot (FreeListNode *free_node)
+{
+  while (true)
+    {
+      FreeListNode *current_free = free_head;
+      free_node->next_ = current_free;
+      if (__sync_bool_compare_and_swap (&free_head, current_free, free_node))
+        break;
+    }
+}
+
+ThreadSlot *
+PopFreeSlot ()
 {
-  ThreadInfo *free_thread_info;
   while (true)
     {
       FreeListNode *current_free = free_head;
       if (current_free == NULL)
-        CRASH ();
-      if (!__sync_bool_compare_and_swap (&free_head, current_free,
-                                         current_free->next_))
-        continue;
-      free_thread_info = reinterpret_cast<ThreadInfo *> (current_free);
-      break;
+        return NULL;
+      if (__sync_bool_compare_and_swap (&free_head, current_free,
+                                        current_free->next_))
+        return reinterpret_cast<ThreadSlot *> (current_free);
     }
-  if (free_thread_info == NULL)
-    CRASH ();
-  pthread_setspecific (thread_info_key, free_thread_info);
-  return new (free_thread_info) ThreadInfo ();
+}
+
+// Maps a new chunk of slots, keeps the first and frees the others.
+ThreadSlot *
+NewSlots ()
+{
+  void *mapping = mmap (NULL, sizeof (SlotChunk), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
+    return NULL;
+  SlotChunk *chunk = static_cast<SlotChunk *> (mapping);
+  while (true)
+    {
+      SlotChunk *current_head = slot_chunks;
+      chunk->next_ = current_head;
+      if (__sync_bool_compare_and_swap (&slot_chunks, current_head, chunk))
+        break;
+    }
+  ThreadSlot *slots = chunk->slots_;
+  for (int i = slots_per_chunk - 1; i > 0; --i)
+    PushFreeSlot (reinterpret_cast<FreeListNode *> (&slots[i].info_));
+  return &slots[0];
+}
+
+#ifdef CTRACE_THREAD_TIMERS
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif // sigev_notify_thread_id
+
+// Arms a SIGPROF timer on the cpu clock of the calling thread, delivered
+// to that thread only.
+void
+StartThreadTimer (ThreadInfo *tinfo)
+{
+  struct sigevent event;
+  memset (&event, 0, sizeof (event));
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = SIGPROF;
+  event.sigev_notify_thread_id = tinfo->tid_;
+  tinfo->has_timer_
+      = timer_create (CLOCK_THREAD_CPUTIME_ID, &event, &tinfo->timer_) == 0;
+  if (!tinfo->has_timer_)
+    return;
+  struct itimerspec spec;
+  spec.it_value.tv_sec = sample_interval_us / 1000000;
+  spec.it_value.tv_nsec = sample_interval_us % 1000000 * 1000;
+  spec.it_interval = spec.it_value;
+  timer_settime (tinfo->timer_, 0, &spec, NULL);
+}
+#endif // CTRACE_THREAD_TIMERS
+
+ThreadInfo *
+ThreadInfo::New ()
+{
+  ThreadSlot *slot = PopFreeSlot ();
+  if (!slot)
+    slot = NewSlots ();
+  if (!slot)
+    return NULL;
+  pthread_setspecific (thread_info_key, &slot->info_);
+  ThreadInfo *tinfo = new (&slot->info_) ThreadInfo ();
+  tinfo->pool_ = &slot->pool_;
+  tinfo->stack_ = &slot->stack_;
+#ifdef CTRACE_SAMPLING
+  if (!slot->samples_)
+    {
+      void *ring = mmap (NULL, sizeof (SampleRing), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (ring != MAP_FAILED)
+        slot->samples_ = static_cast<SampleRing *> (ring);
+    }
+  tinfo->samples_ = slot->samples_;
+#endif // CTRACE_SAMPLING
+#ifdef CTRACE_AGGREGATE
+  // the table stays with the slot, the next thread adds to it.
+  if (!slot->stats_)
+    slot->stats_ = CTraceStatTable::New ();
+  tinfo->stats_ = slot->stats_;
+#endif // CTRACE_AGGREGATE
+#ifdef CTRACE_FLIGHT_RECORDER
+  CTraceFlightRecorder::Install ();
+  tinfo->flight_ = CTraceFlightRing::Claim (tinfo->pid_, tinfo->tid_, true);
+#endif // CTRACE_FLIGHT_RECORDER
+  tinfo->crash_stack_ = NULL;
+  if (CTRACE_CATCH_FATAL_SIGNALS)
+    {
+      if (!slot->crash_stack_)
+        slot->crash_stack_ = CTraceCrash::NewStack ();
+      if (CTraceCrash::UseStack (slot->crash_stack_))
+        tinfo->crash_stack_ = slot->crash_stack_;
+    }
+#ifdef CTRACE_THREAD_TIMERS
+  StartThreadTimer (tinfo);
+#endif // CTRACE_THREAD_TIMERS
+  return tinfo;
 }
 
 ThreadInfo::ThreadInfo ()
@@ -177,11 +662,16 @@ ThreadInfo::ThreadInfo ()
   idle_times_ = 0;
   current_time_thread_ = 0;
   blocked_ = true;
+#if CTRACE_COMPENSATE_OVERHEAD
+  scopes_ = 0;
+  scopes_current_ = 0;
+#endif // CTRACE_COMPENSATE_OVERHEAD
 }
 
-CTraceStruct::CTraceStruct (const char *name)
+CTraceStruct::CTraceStruct (const char *cat, const char *name)
 {
   start_time_ = invalid_time;
+  cat_ = cat;
   name_ = name;
 }
 
@@ -198,23 +688,15 @@ _GetThreadInfo ()
 uint64_t
 GetTimesFromClock ()
 {
-  static const int64_t kMillisecondsPerSecond = 1000;
-  static const int64_t kMicrosecondsPerMillisecond = 1000;
-  static const int64_t kMicrosecondsPerSecond = kMicrosecondsPerMillisecond
-                                                * kMillisecondsPerSecond;
-  static const int64_t kNanosecondsPerMicrosecond = 1000;
-
-  struct timespec ts_thread;
-  clock_gettime (CLOCK_MONOTONIC, &ts_thread);
-  return (static_cast<uint64_t> (ts_thread.tv_sec) * kMicrosecondsPerSecond)
-         + (static_cast<uint64_t> (ts_thread.tv_nsec)
-            / kNanosecondsPerMicrosecond);
+  return CTraceClock::Now ();
 }
 
 ThreadInfo *
 GetThreadInfo ()
 {
   ThreadInfo *tinfo = _GetThreadInfo ();
+  if (!tinfo)
+    return NULL;
   if (tinfo->blocked_)
     {
       tinfo->UpdateCurrentTime ();
@@ -230,15 +712,103 @@ GetThreadInfo ()
 void
 DeleteThreadInfo (void *tinfo)
 {
-  FreeListNode *free_node = static_cast<FreeListNode *> (tinfo);
-  while (true)
+#ifdef CTRACE_THREAD_TIMERS
+  ThreadInfo *dying = static_cast<ThreadInfo *> (tinfo);
+  if (dying->has_timer_)
+    timer_delete (dying->timer_);
+#endif // CTRACE_THREAD_TIMERS
+#ifdef CTRACE_FLIGHT_RECORDER
+  ThreadInfo *exiting = static_cast<ThreadInfo *> (tinfo);
+  if (exiting->flight_)
+    exiting->flight_->Release ();
+#endif // CTRACE_FLIGHT_RECORDER
+  // the next thread of the slot takes the stack over.
+  CTraceCrash::LeaveStack (static_cast<ThreadInfo *> (tinfo)->crash_stack_);
+  // a thread leaving from inside traced calls leaves no open calls.
+  static_cast<ThreadInfo *> (tinfo)->stack_end_ = 0;
+  PushFreeSlot (static_cast<FreeListNode *> (tinfo));
+}
+
+#if CTRACE_COMPENSATE_OVERHEAD
+// What scopes calls cost, in wall ticks and thread microseconds.
+uint64_t
+Stolen (uint64_t scopes)
+{
+  return scopes * CTraceOverhead::Scope () >> CTraceOverhead::kFractionBits;
+}
+
+// Takes the cost of the calls finished before c's end off it, as the
+// tick that gave c its start did; c keeps some length.
+void
+Compensate (CTraceStruct *c)
+{
+  uint64_t end = c->min_end_time_ - Stolen (c->scopes_end_);
+  if (end <= c->start_time_)
+    end = c->start_time_ + wall_ticks;
+  c->min_end_time_ = end;
+}
+#endif // CTRACE_COMPENSATE_OVERHEAD
+
+#ifdef CTRACE_SAMPLING
+void WakeWriter ();
+
+#ifdef CTRACE_SAMPLE_PC
+uintptr_t
+ContextPC (void *context)
+{
+  struct sigcontext *mcontext
+      = &static_cast<ucontext *> (context)->uc_mcontext;
+#if defined(__ARM_EABI__)
+  return mcontext->arm_pc;
+#elif defined(__aarch64__)
+  return mcontext->pc;
+#elif defined(__x86_64__)
+  return mcontext->rip;
+#elif defined(__i386__)
+  return mcontext->eip;
+#else
+  return 0;
+#endif
+}
+#endif // CTRACE_SAMPLE_PC
+
+void
+TakeSample (ThreadInfo *tinfo, void *context)
+{
+  SampleRing *ring = tinfo->samples_;
+  if (!ring)
+    return;
+  int depth = tinfo->stack_end_;
+  if (depth > tinfo->stack_->capacity_)
+    depth = tinfo->stack_->capacity_;
+#ifdef CTRACE_SAMPLE_PC
+  uintptr_t pc = ContextPC (context);
+#else
+  (void) context;
+  uintptr_t pc = 0;
+#endif // CTRACE_SAMPLE_PC
+  if (depth == 0 && pc == 0)
+    return;
+  unsigned int head = ring->head_;
+  if (head - ring->tail_ >= SampleRing::size)
     {
-      FreeListNode *current_free = free_head;
-      free_node->next_ = current_free;
-      if (__sync_bool_compare_and_swap (&free_head, current_free, free_node))
-        break;
+      __sync_fetch_and_add (&dropped_samples, 1);
+      return;
     }
+  Sample *sample = &ring->samples_[head % SampleRing::size];
+  int first = depth > CTRACE_SAMPLE_DEPTH ? depth - CTRACE_SAMPLE_DEPTH : 0;
+  sample->truncated_ = first != 0;
+  sample->depth_ = depth - first;
+  for (int i = first; i < depth; ++i)
+    sample->frames_[i - first] = tinfo->stack_->At (i)->name_;
+  sample->pc_ = pc;
+  // publishes the sample before the index.
+  __sync_synchronize ();
+  ring->head_ = head + 1;
+  if (writer_parked && __sync_bool_compare_and_swap (&writer_parked, 1, 0))
+    WakeWriter ();
 }
+#endif // CTRACE_SAMPLING
 
 void
 MyHandler (int, siginfo_t *, void *context)
@@ -255,36 +825,56 @@ MyHandler (int, siginfo_t *, void *context)
       sigaddset (&static_cast<ucontext *> (context)->uc_sigmask, SIGPROF);
       return;
     }
+#ifdef CTRACE_SAMPLING
+  TakeSample (tinfo, context);
+#endif // CTRACE_SAMPLING
   uint64_t old_time = tinfo->current_time_;
   tinfo->UpdateCurrentTime ();
+#if CTRACE_COMPENSATE_OVERHEAD
+  // a start is old_time, so it loses what was spent before old_time.
+  uint64_t old_stolen = Stolen (tinfo->scopes_current_);
+  tinfo->scopes_current_ = tinfo->scopes_;
+#endif // CTRACE_COMPENSATE_OVERHEAD
   uint64_t current_time = tinfo->current_time_;
 
   uint64_t old_time_thread = tinfo->current_time_thread_;
   tinfo->UpdateCurrentTimeThread ();
   uint64_t current_time_thread = tinfo->current_time_thread_;
 
-  if (tinfo->stack_end_ >= ThreadInfo::max_stack)
+  // frames beyond the tracked depth are simply not seen.
+  ThreadStack *stack = tinfo->stack_;
+  int depth = tinfo->stack_end_;
+  if (depth > stack->capacity_)
+    depth = stack->capacity_;
+  for (int i = 0; i < depth;
+       ++i, old_time += wall_ticks, old_time_thread += ticks)
     {
-      CRASH ();
-    }
-  for (int i = 0; i < tinfo->stack_end_;
-       ++i, old_time += ticks, old_time_thread += ticks)
-    {
-      CTraceStruct *cur = tinfo->stack_[i];
+      CTraceStruct *cur = stack->At (i);
       if (cur->start_time_ != invalid_time)
         continue;
+#if CTRACE_COMPENSATE_OVERHEAD
+      cur->start_time_ = old_time - old_stolen;
+#else
       cur->start_time_ = old_time;
+#endif // CTRACE_COMPENSATE_OVERHEAD
       cur->start_time_thread_ = old_time_thread;
+#ifdef CTRACE_FLIGHT_RECORDER
+      if (tinfo->flight_)
+        tinfo->flight_->SetOpenTime (i, cur->start_time_,
+                                     cur->start_time_thread_);
+#endif // CTRACE_FLIGHT_RECORDER
     }
-  if (tinfo->stack_end_ != 0)
+  if (depth != 0)
     {
-      tinfo->stack_[tinfo->stack_end_ - 1]->min_end_time_thread_
+      stack->At (depth - 1)->min_end_time_thread_
           = current_time_thread + ticks;
 
-      tinfo->stack_[tinfo->stack_end_ - 1]->min_end_time_ = current_time
-                                                            + ticks;
+      stack->At (depth - 1)->min_end_time_ = current_time + wall_ticks;
+#if CTRACE_COMPENSATE_OVERHEAD
+      stack->At (depth - 1)->scopes_end_ = tinfo->scopes_;
+#endif // CTRACE_COMPENSATE_OVERHEAD
     }
-  else
+  else if (tinfo->stack_end_ == 0)
     {
       tinfo->idle_times_++;
       if (tinfo->idle_times_ >= max_idle_times)
@@ -297,63 +887,179 @@ MyHandler (int, siginfo_t *, void *context)
     }
 }
 
+#if !defined(CTRACE_FLIGHT_RECORDER) || defined(CTRACE_SAMPLING)
 void *WriterThread (void *);
+#endif // !CTRACE_FLIGHT_RECORDER || CTRACE_SAMPLING
+#ifdef CTRACE_SAMPLING
+void FinishSampling ();
+#endif // CTRACE_SAMPLING
+#ifdef CTRACE_AGGREGATE
+void DumpStats (bool final);
+#endif // CTRACE_AGGREGATE
+#ifdef CTRACE_RESOURCE_COUNTERS
+void SampleResources ();
+#endif // CTRACE_RESOURCE_COUNTERS
+void FinishTrace (bool crashing);
+#ifndef CTRACE_FLIGHT_RECORDER
+void FinishOnCrash (int);
+#endif // CTRACE_FLIGHT_RECORDER
+#if CTRACE_COMPENSATE_OVERHEAD
+void CalibrateOverhead ();
+#endif // CTRACE_COMPENSATE_OVERHEAD
+void PrepareFork ();
+void ParentAfterFork ();
+void ChildAfterFork ();
 
-struct Initializer
+// Creates the trace file of this process and points fd_to_write at it,
+// -1 if it can not be written.
+void
+OpenTrace ()
 {
-  void
-  InitFreeList ()
-  {
-    ThreadInfo *info_store = reinterpret_cast<ThreadInfo *> (info_store_char);
-    free_head
-        = reinterpret_cast<FreeListNode *> (&info_store[MAX_THREADS - 1]);
-    free_head->next_ = NULL;
-    for (int i = MAX_THREADS - 2; i >= 0; --i)
-      {
-        FreeListNode *current
-            = reinterpret_cast<FreeListNode *> (&info_store[i]);
-        current->next_ = free_head;
-        free_head = current;
-      }
-  }
+  char path[PATH_MAX];
+  CTraceFork::FileName (CTRACE_FILE_NAME, path, sizeof (path));
+#ifdef CTRACE_MMAP_OUTPUT
+  int fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+#ifdef CTRACE_BINARY_OUTPUT
+  const uint8_t filler = 0;
+#else
+  const uint8_t filler = ' ';
+#endif // CTRACE_BINARY_OUTPUT
+  if (fd >= 0 && !mapped_file.Open (fd, filler))
+    fd = -1;
+#else
+  int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#ifdef CTRACE_GZIP_OUTPUT
+  if (fd >= 0 && !gzip_file.Open (fd, CTraceGzipFile::Level ()))
+    fd = -1;
+#else
+  seekable_output = fd >= 0 && lseek (fd, 0, SEEK_CUR) >= 0;
+#endif // CTRACE_GZIP_OUTPUT
+#endif // CTRACE_MMAP_OUTPUT
+  fd_to_write = fd;
+}
+
+// Lets go of fd_to_write without writing to it, the parent going on
+// with it.  fd_to_write keeps its value.
+void
+AbandonTrace ()
+{
+#if defined(CTRACE_MMAP_OUTPUT)
+  mapped_file.Abandon ();
+#elif defined(CTRACE_GZIP_OUTPUT)
+  gzip_file.Abandon ();
+#else
+  if (fd_to_write >= 0)
+    close (fd_to_write);
+#endif
+}
+
+#ifndef CTRACE_FLIGHT_RECORDER
+// Starts the file with the header, which the first batch writes out.
+void
+AppendHeader ()
+{
+#ifdef CTRACE_BINARY_OUTPUT
+  CTraceBinaryWriter::AppendHeader (&write_buffer);
+  CTraceOverhead::AppendBinaryMetadata (&write_buffer);
+  binary_writer.AddDescriptors (CTraceFuncDescBegin (), CTraceFuncDescEnd ());
+#else
+  CTraceOverhead::AppendJsonHeader (&write_buffer);
+  need_comma = CTraceJson::AppendDescriptors (&write_buffer, false, getpid (),
+                                              CTraceFuncDescBegin (),
+                                              CTraceFuncDescEnd ());
+#endif // CTRACE_BINARY_OUTPUT
+}
+#endif // CTRACE_FLIGHT_RECORDER
 
+#ifndef CTRACE_THREAD_TIMERS
+void
+StartProcessTimer ()
+{
+  struct itimerval timer;
+  timer.it_value.tv_sec = sample_interval_us / 1000000;
+  timer.it_value.tv_usec = sample_interval_us % 1000000;
+  timer.it_interval = timer.it_value;
+  setitimer (ITIMER_PROF, &timer, NULL);
+}
+#endif // CTRACE_THREAD_TIMERS
+
+// The flight recorder only has samples for the writer.
+#if !defined(CTRACE_FLIGHT_RECORDER) || defined(CTRACE_SAMPLING)
+void
+StartWriter ()
+{
+  writer_wakeup_fd = eventfd (0, EFD_CLOEXEC);
+  pthread_t my_writer_thread;
+  pthread_create (&my_writer_thread, NULL, WriterThread, NULL);
+}
+#endif // !CTRACE_FLIGHT_RECORDER || CTRACE_SAMPLING
+
+struct Initializer
+{
   Initializer ()
   {
     pthread_key_create (&thread_info_key, DeleteThreadInfo);
-    InitFreeList ();
+    // calibrates the clock before any thread is traced.
+    CTraceClock::Calibrate ();
+    wall_ticks = CTraceClock::TicksPerMicrosecond ();
+#if CTRACE_COMPENSATE_OVERHEAD
+    CalibrateOverhead ();
+#endif // CTRACE_COMPENSATE_OVERHEAD
+    const char *interval = getenv ("CTRACE_SAMPLE_INTERVAL_US");
+    if (interval && atoi (interval) > 0)
+      sample_interval_us = atoi (interval);
     struct sigaction myaction = { 0 };
-    struct itimerval timer;
     myaction.sa_sigaction = MyHandler;
     myaction.sa_flags = SA_SIGINFO;
     sigaction (SIGPROF, &myaction, NULL);
 
-    timer.it_value.tv_sec = 0;
-    timer.it_value.tv_usec = frequency;
-    timer.it_interval = timer.it_value;
-    setitimer (ITIMER_PROF, &timer, NULL);
-    file_to_write = fopen (CTRACE_FILE_NAME, "w");
-    fprintf (file_to_write, "{\"traceEvents\": [");
-    pthread_t my_writer_thread;
-    pthread_create (&my_writer_thread, NULL, WriterThread, NULL);
+#ifndef CTRACE_THREAD_TIMERS
+    StartProcessTimer ();
+#endif // CTRACE_THREAD_TIMERS
+    CTraceFork::Init ();
+#ifdef CTRACE_FLIGHT_RECORDER
+    // the dump signal is handled before the first thread registers.
+    CTraceFlightRecorder::Install ();
+    flight_recording = true;
+#ifdef CTRACE_SAMPLING
+    // only to fold the samples.
+    StartWriter ();
+#endif // CTRACE_SAMPLING
+#else
+    OpenTrace ();
+    // a crash formats into it without growing it.
+    write_buffer.Reserve (CTRACE_WRITE_BATCH_BYTES + (1 << 16));
+    AppendHeader ();
+    StartWriter ();
+    if (CTRACE_CATCH_FATAL_SIGNALS)
+      CTraceCrash::AddHook (FinishOnCrash);
+#endif // CTRACE_FLIGHT_RECORDER
+    pthread_atfork (PrepareFork, ParentAfterFork, ChildAfterFork);
   }
 
-  ~Initializer () { fclose (file_to_write); }
+  ~Initializer ()
+  {
+    // a child left alone.
+    if (!CTraceFork::Traces ())
+      return;
+#ifdef CTRACE_SAMPLING
+    FinishSampling ();
+#endif // CTRACE_SAMPLING
+#ifdef CTRACE_AGGREGATE
+    DumpStats (true);
+#endif // CTRACE_AGGREGATE
+    // kept, so the writer stops for good.
+    write_lock.Lock ();
+    FinishTrace (false);
+    if (dropped_records)
+      fprintf (stderr, "ctrace: %d records dropped, raise "
+                       "CTRACE_MAX_RECORDS_PER_THREAD\n",
+               dropped_records);
+  }
 };
 
 Initializer __init__;
 
-struct Record
-{
-  int pid_;
-  int tid_;
-  uint64_t start_time_;
-  uint64_t dur_;
-  uint64_t start_time_thread_;
-  uint64_t dur_thread_;
-  const char *name_;
-  struct Record *next_;
-};
-
 struct Lock
 {
   Lock (pthread_mutex_t *mutex) : mutex_ (mutex)
@@ -364,16 +1070,30 @@ struct Lock
   pthread_mutex_t *mutex_;
 };
 
+// Only records and samples wake the writer.
+#if defined(CTRACE_SAMPLING)                                            \
+    || (!defined(CTRACE_AGGREGATE) && !defined(CTRACE_FLIGHT_RECORDER))
+void
+WakeWriter ()
+{
+  uint64_t one = 1;
+  if (write (writer_wakeup_fd, &one, sizeof (one)) < 0)
+    return;
+}
+#endif // CTRACE_SAMPLING || (!CTRACE_AGGREGATE && !CTRACE_FLIGHT_RECORDER)
+
+#if !defined(CTRACE_AGGREGATE) && !defined(CTRACE_FLIGHT_RECORDER)
 void
 RecordThis (CTraceStruct *c, ThreadInfo *tinfo)
 {
-  Record *r = static_cast<Record *> (malloc (sizeof (Record)));
+  Record *r = tinfo->pool_->Alloc ();
   if (!r)
-    CRASH ();
+    return;
   r->pid_ = tinfo->pid_;
   r->tid_ = tinfo->tid_;
   r->start_time_ = c->start_time_;
   r->start_time_thread_ = c->start_time_thread_;
+  r->cat_ = c->cat_;
   r->name_ = c->name_;
   r->dur_ = c->min_end_time_ - c->start_time_;
   r->dur_thread_ = c->min_end_time_thread_ - c->start_time_thread_;
@@ -385,134 +1105,973 @@ RecordThis (CTraceStruct *c, ThreadInfo *tinfo)
                                         r))
         break;
     }
-  {
-    Lock lock (&writer_waitup_mutex);
-    writer_waitup = true;
-    pthread_cond_signal (&writer_waitup_cond);
-  }
+  // No syscall in the steady state: the writer comes by on its own
+  // unless it is parked or the queue is getting long.
+  int pending = __sync_add_and_fetch (&pending_records_count, 1);
+  if (pending == CTRACE_WRITER_HIGH_WATER
+      || (writer_parked
+          && __sync_bool_compare_and_swap (&writer_parked, 1, 0)))
+    WakeWriter ();
 }
+#endif // !CTRACE_AGGREGATE && !CTRACE_FLIGHT_RECORDER
 
+#if !defined(CTRACE_MMAP_OUTPUT) && !defined(CTRACE_GZIP_OUTPUT)
 void
-DoWriteRecursive (struct Record *current)
+WriteAll (int fd, const uint8_t *data, size_t size)
 {
-  if (current->next_)
-    DoWriteRecursive (current->next_);
+  while (size)
+    {
+      ssize_t written = write (fd, data, size);
+      if (written < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return;
+        }
+      data += written;
+      size -= written;
+    }
+}
 
-  static bool needComma = false;
-  if (!needComma)
+// Appends the trailer of the format.
+void
+WriteTrailer (int fd)
+{
+#ifdef CTRACE_BINARY_OUTPUT
+  WriteAll (fd, reinterpret_cast<const uint8_t *> (kCTraceBinaryTrailer),
+            sizeof (kCTraceBinaryTrailer));
+#else
+  WriteAll (fd, reinterpret_cast<const uint8_t *> (kCTraceJsonTrailer),
+            sizeof (kCTraceJsonTrailer));
+#endif // CTRACE_BINARY_OUTPUT
+}
+#endif
+
+void
+FlushWriteBuffer ()
+{
+  if (reopen_trace)
     {
-      needComma = true;
+      reopen_trace = false;
+      AbandonTrace ();
+      OpenTrace ();
     }
-  else
+#if defined(CTRACE_MMAP_OUTPUT)
+  mapped_file.Append (write_buffer.data_, write_buffer.size_);
+#elif defined(CTRACE_GZIP_OUTPUT)
+  gzip_file.Append (write_buffer.data_, write_buffer.size_);
+#else
+  WriteAll (fd_to_write, write_buffer.data_, write_buffer.size_);
+#endif
+  write_buffer.size_ = 0;
+}
+
+void
+FormatRecord (struct Record *current)
+{
+  uint64_t start_time = CTraceClock::ToMicroseconds (current->start_time_);
+  uint64_t dur = CTraceClock::ToMicroseconds (current->start_time_
+                                              + current->dur_)
+                 - start_time;
+#ifdef CTRACE_BINARY_OUTPUT
+  // consecutive records of one thread share a block.
+  if (current->tid_ != binary_block_tid)
+    {
+      if (binary_block_tid != 0)
+        binary_writer.EndBlock (&write_buffer);
+      binary_writer.BeginBlock (current->pid_, current->tid_, true);
+      binary_block_tid = current->tid_;
+    }
+  binary_writer.AddEvent (current->cat_, current->name_, start_time, dur,
+                          current->start_time_thread_, current->dur_thread_);
+#else
+  CTraceJson::AppendEvent (&write_buffer, need_comma, current->cat_,
+                           current->pid_, current->tid_, start_time,
+                           current->name_, dur, true,
+                           current->start_time_thread_, current->dur_thread_);
+  need_comma = true;
+#endif // CTRACE_BINARY_OUTPUT
+}
+
+void
+FinishWrite ()
+{
+#ifdef CTRACE_BINARY_OUTPUT
+  if (binary_block_tid != 0)
+    {
+      binary_writer.EndBlock (&write_buffer);
+      binary_block_tid = 0;
+    }
+#endif // CTRACE_BINARY_OUTPUT
+  FlushWriteBuffer ();
+#ifdef CTRACE_MMAP_OUTPUT
+  // leaves the file loadable after every batch.
+#ifdef CTRACE_BINARY_OUTPUT
+  mapped_file.Checkpoint (kCTraceBinaryTrailer, sizeof (kCTraceBinaryTrailer));
+#else
+  mapped_file.Checkpoint (kCTraceJsonTrailer, sizeof (kCTraceJsonTrailer));
+#endif // CTRACE_BINARY_OUTPUT
+#elif !defined(CTRACE_GZIP_OUTPUT)
+  // the same through write(): the next batch overwrites the trailer, so
+  // a process killed between batches still leaves a complete file.
+  if (seekable_output)
+    {
+      off_t end = lseek (fd_to_write, 0, SEEK_CUR);
+      WriteTrailer (fd_to_write);
+      lseek (fd_to_write, end, SEEK_SET);
+    }
+#endif // CTRACE_MMAP_OUTPUT
+}
+
+// Writes a batch taken off pending_records_head and returns its size.
+// The list is newest first; it is reversed in place rather than
+// recursed, so a burst of records cannot overflow the writer's stack.
+int
+WriteRecords (struct Record *head)
+{
+  int count = 0;
+  Record *ordered = NULL;
+  while (head)
+    {
+      Record *next = head->next_;
+      head->next_ = ordered;
+      ordered = head;
+      head = next;
+      count++;
+    }
+  while (ordered)
     {
-      fprintf (file_to_write, ", ");
+      Record *next = ordered->next_;
+      FormatRecord (ordered);
+      ordered->pool_->Release (ordered);
+      ordered = next;
+      if (write_buffer.size_ >= CTRACE_WRITE_BATCH_BYTES)
+        FlushWriteBuffer ();
     }
-  fprintf (file_to_write,
-           "{\"cat\":\"%s\", \"pid\":%d, \"tid\":%d, \"ts\":%" PRIu64 ", "
-           "\"ph\":\"X\", \"name\":\"%s\", \"dur\": %" PRIu64
-           ", \"tts\":%" PRIu64 ", \"tdur\":%" PRIu64 "}",
-           "profile", current->pid_, current->tid_, current->start_time_,
-           current->name_, current->dur_, current->start_time_thread_,
-           current->dur_thread_);
-  static int flushCount = 0;
-  if (flushCount++ == 5)
+  return count;
+}
+
+#if !defined(CTRACE_FLIGHT_RECORDER) || defined(CTRACE_SAMPLING)
+// Sleeps until the next interval, or until a traced thread wakes the
+// writer.  Once idle for a while the writer parks without a timeout;
+// the next record then wakes it.
+void
+WaitForRecords (int idle_intervals)
+{
+  int timeout = CTRACE_WRITER_INTERVAL_MS;
+#ifdef CTRACE_AGGREGATE
+  // the dumps are due whether or not anything is traced.
+  idle_intervals = 0;
+#endif // CTRACE_AGGREGATE
+#ifdef CTRACE_RESOURCE_COUNTERS
+  // so are the samples.
+  idle_intervals = 0;
+  if (CTRACE_RESOURCE_COUNTERS_INTERVAL_MS < timeout)
+    timeout = CTRACE_RESOURCE_COUNTERS_INTERVAL_MS;
+#endif // CTRACE_RESOURCE_COUNTERS
+  if (writer_wakeup_fd >= 0 && idle_intervals >= max_writer_idle_intervals)
+    {
+      writer_parked = 1;
+      __sync_synchronize ();
+      if (pending_records_head)
+        {
+          writer_parked = 0;
+          return;
+        }
+      timeout = -1;
+    }
+  struct pollfd pfd = { writer_wakeup_fd, POLLIN, 0 };
+  if (poll (&pfd, 1, timeout) > 0)
+    {
+      uint64_t value;
+      if (read (writer_wakeup_fd, &value, sizeof (value)) < 0)
+        value = 0;
+    }
+  writer_parked = 0;
+}
+#endif // !CTRACE_FLIGHT_RECORDER || CTRACE_SAMPLING
+
+#ifdef CTRACE_SAMPLING
+// A call tree node: name_ is a shadow stack frame, or the symbol of a
+// sampled pc at address_ (name_ NULL if it has none).  self_ counts the
+// samples that ended here.
+struct SampleNode
+{
+  const char *name_;
+  uintptr_t address_;
+  uint64_t self_;
+  SampleNode *child_;
+  SampleNode *sibling_;
+};
+
+SampleNode sample_root;
+// serializes the writer's DrainSamples with FinishSampling at exit.
+pthread_mutex_t samples_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+SampleNode *
+SampleChild (SampleNode *parent, const char *name, uintptr_t address)
+{
+  for (SampleNode *child = parent->child_; child; child = child->sibling_)
+    {
+      if (name ? child->name_ && strcmp (child->name_, name) == 0
+               : !child->name_ && child->address_ == address)
+        return child;
+    }
+  SampleNode *child
+      = static_cast<SampleNode *> (calloc (1, sizeof (SampleNode)));
+  if (!child)
+    return NULL;
+  child->name_ = name;
+  child->address_ = address;
+  child->sibling_ = parent->child_;
+  parent->child_ = child;
+  return child;
+}
+
+void
+AddSample (const Sample *sample)
+{
+  SampleNode *node = &sample_root;
+  if (sample->truncated_)
+    node = SampleChild (node, "[truncated]", 0);
+  for (int i = 0; node && i < sample->depth_; ++i)
+    node = SampleChild (node, sample->frames_[i], 0);
+#ifdef CTRACE_SAMPLE_PC
+  if (node && sample->pc_)
+    {
+      // pcs of one function share a node.
+      Dl_info info;
+      if (dladdr (reinterpret_cast<void *> (sample->pc_), &info)
+          && info.dli_sname)
+        node = SampleChild (node, info.dli_sname,
+                            reinterpret_cast<uintptr_t> (info.dli_saddr));
+      else
+        node = SampleChild (node, NULL, sample->pc_);
+    }
+#endif // CTRACE_SAMPLE_PC
+  if (node)
+    node->self_++;
+}
+
+// Moves the samples of every ring into the call tree.
+void
+DrainSamples ()
+{
+  Lock lock (&samples_mutex);
+  for (SlotChunk *chunk = slot_chunks; chunk; chunk = chunk->next_)
+    for (int i = 0; i < slots_per_chunk; ++i)
+      {
+        SampleRing *ring = chunk->slots_[i].samples_;
+        if (!ring)
+          continue;
+        unsigned int head = ring->head_;
+        __sync_synchronize ();
+        unsigned int tail;
+        for (tail = ring->tail_; tail != head; ++tail)
+          AddSample (&ring->samples_[tail % SampleRing::size]);
+        __sync_synchronize ();
+        ring->tail_ = tail;
+      }
+}
+
+// Names a pc without a symbol as module+offset, for addr2line.
+void
+FormatAddress (char *name, size_t size, uintptr_t address)
+{
+#ifdef CTRACE_SAMPLE_PC
+  Dl_info info;
+  if (dladdr (reinterpret_cast<void *> (address), &info) && info.dli_fname)
+    {
+      const char *module = strrchr (info.dli_fname, '/');
+      module = module ? module + 1 : info.dli_fname;
+      snprintf (name, size, "%s+0x%lx", module,
+                static_cast<unsigned long> (
+                    address - reinterpret_cast<uintptr_t> (info.dli_fbase)));
+      return;
+    }
+#endif // CTRACE_SAMPLE_PC
+  snprintf (name, size, "0x%lx", static_cast<unsigned long> (address));
+}
+
+// Writes one "outer;...;inner count" line per node with samples.
+void
+WriteFolded (FILE *f, const SampleNode *node, char *path, size_t length,
+             size_t capacity)
+{
+  for (const SampleNode *child = node->child_; child;
+       child = child->sibling_)
+    {
+      char name[256];
+      const char *frame = child->name_;
+      if (!frame)
+        {
+          FormatAddress (name, sizeof (name), child->address_);
+          frame = name;
+        }
+      size_t child_length = length;
+      if (length)
+        child_length += snprintf (path + length, capacity - length, ";");
+      if (child_length < capacity)
+        child_length += snprintf (path + child_length,
+                                  capacity - child_length, "%s", frame);
+      if (child_length >= capacity)
+        child_length = capacity - 1;
+      if (child->self_)
+        fprintf (f, "%s %" PRIu64 "\n", path, child->self_);
+      WriteFolded (f, child, path, child_length, capacity);
+      path[length] = '\0';
+    }
+}
+
+void
+FinishSampling ()
+{
+  DrainSamples ();
+  Lock lock (&samples_mutex);
+  char file_name[PATH_MAX];
+  CTraceFork::FileName (CTRACE_FOLDED_FILE_NAME, file_name,
+                        sizeof (file_name));
+  FILE *f = fopen (file_name, "w");
+  if (f)
+    {
+      static char path[16384];
+      path[0] = '\0';
+      WriteFolded (f, &sample_root, path, 0, sizeof (path));
+      fclose (f);
+    }
+  if (dropped_samples)
+    fprintf (stderr, "ctrace: %d samples dropped, raise "
+                     "CTRACE_SAMPLES_PER_THREAD\n",
+             dropped_samples);
+}
+#endif // CTRACE_SAMPLING
+
+#ifdef CTRACE_FLIGHT_RECORDER
+// Keeps a finished call in the thread's ring.
+void
+RecordFlight (CTraceStruct *c, ThreadInfo *tinfo)
+{
+  if (!tinfo->flight_)
+    return;
+  CTraceFlightEvent e;
+  e.cat_ = c->cat_;
+  e.name_ = c->name_;
+  e.ts_ = c->start_time_;
+  e.dur_ = c->min_end_time_ - c->start_time_;
+  e.tts_ = c->start_time_thread_;
+  e.tdur_ = c->min_end_time_thread_ - c->start_time_thread_;
+  tinfo->flight_->Push (e);
+}
+#endif // CTRACE_FLIGHT_RECORDER
+
+#ifdef CTRACE_AGGREGATE
+CTraceStatSummary stat_summary;
+uint64_t next_stat_dump;
+
+// Merges the tables of every slot, rewrites the summary and adds the
+// counters to the trace.
+void
+DumpStats (bool final)
+{
+  CTraceCrashLock::Hold hold (&write_lock);
+  uint64_t now = CTraceClock::ToMicroseconds (CTraceClock::Now ());
+  if (!final && now < next_stat_dump)
+    return;
+  next_stat_dump = now + CTRACE_AGGREGATE_INTERVAL_MS * 1000;
+  stat_summary.Begin ();
+  for (SlotChunk *chunk = slot_chunks; chunk; chunk = chunk->next_)
+    for (int i = 0; i < slots_per_chunk; ++i)
+      if (chunk->slots_[i].stats_)
+        stat_summary.Add (*chunk->slots_[i].stats_);
+  char path[PATH_MAX];
+  CTraceFork::FileName (CTRACE_SUMMARY_FILE_NAME, path, sizeof (path));
+  FILE *f = fopen (path, "w");
+  if (f)
     {
-      fflush (file_to_write);
-      flushCount = 0;
+      stat_summary.WriteTable (f);
+      fclose (f);
     }
-  free (current);
+#ifndef CTRACE_BINARY_OUTPUT
+  stat_summary.AppendCounters (&write_buffer, need_comma, getpid (), now);
+  need_comma = true;
+#endif // CTRACE_BINARY_OUTPUT
+  FinishWrite ();
+}
+
+// Counts a finished call, and times it if a tick landed in it.
+void
+Account (CTraceStruct *c, ThreadInfo *tinfo, bool timed)
+{
+  int depth = tinfo->stack_end_;
+  uint64_t children = 0;
+  uint64_t children_thread = 0;
+  uint64_t dur = 0;
+  uint64_t dur_thread = 0;
+  if (timed)
+    {
+      dur = c->min_end_time_ - c->start_time_;
+      dur_thread = c->min_end_time_thread_ - c->start_time_thread_;
+      if (depth < CTRACE_AGGREGATE_MAX_DEPTH)
+        {
+          children = tinfo->children_[depth];
+          children_thread = tinfo->children_thread_[depth];
+        }
+      if (depth > 0 && depth <= CTRACE_AGGREGATE_MAX_DEPTH)
+        {
+          tinfo->children_[depth - 1] += dur;
+          tinfo->children_thread_[depth - 1] += dur_thread;
+        }
+    }
+  if (!tinfo->stats_)
+    return;
+  CTraceStat *stat = tinfo->stats_->Find (c->cat_, c->name_);
+  stat->AddCall ();
+  if (!timed)
+    return;
+  uint64_t start = CTraceClock::ToMicroseconds (c->start_time_);
+  uint64_t self = dur > children ? dur - children : 0;
+  stat->AddTimes (CTraceClock::ToMicroseconds (c->start_time_ + dur) - start,
+                  CTraceClock::ToMicroseconds (c->start_time_ + self) - start,
+                  dur_thread,
+                  dur_thread > children_thread ? dur_thread - children_thread
+                                               : 0);
+}
+#endif // CTRACE_AGGREGATE
+
+#ifdef CTRACE_RESOURCE_COUNTERS
+uint64_t next_resource_sample;
+// the usage of the sample before, the next one counts from.
+struct rusage last_usage;
+
+// Pages of the resident set, -1 if they can not be read.
+int64_t
+ResidentPages ()
+{
+  int fd = open ("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  char text[128];
+  ssize_t size = read (fd, text, sizeof (text) - 1);
+  close (fd);
+  if (size <= 0)
+    return -1;
+  text[size] = '\0';
+  // after the total size.
+  const char *resident = strchr (text, ' ');
+  return resident ? atoll (resident + 1) : -1;
+}
+
+void
+AppendResourceCounter (int pid, uint64_t ts, const char *name, int64_t value)
+{
+#ifdef CTRACE_BINARY_OUTPUT
+  binary_writer.AddCounter (&write_buffer, pid, pid, "ctrace", name, ts,
+                            value);
+#else
+  CTraceJson::AppendCounterValue (&write_buffer, need_comma, "ctrace", pid,
+                                  pid, ts, name, value);
+  need_comma = true;
+#endif // CTRACE_BINARY_OUTPUT
+}
+
+// Adds a sample of every resource counter once one is due.
+void
+SampleResources ()
+{
+  uint64_t now = CTraceClock::ToMicroseconds (CTraceClock::Now ());
+  if (now < next_resource_sample)
+    return;
+  next_resource_sample = now + CTRACE_RESOURCE_COUNTERS_INTERVAL_MS * 1000;
+  struct rusage usage;
+  if (getrusage (RUSAGE_SELF, &usage) != 0)
+    return;
+  int64_t pages = ResidentPages ();
+  int pid = getpid ();
+  CTraceCrashLock::Hold hold (&write_lock);
+  if (pages >= 0)
+    AppendResourceCounter (pid, now, "rss_bytes",
+                           pages * sysconf (_SC_PAGESIZE));
+  AppendResourceCounter (pid, now, "minor_faults",
+                         usage.ru_minflt - last_usage.ru_minflt);
+  AppendResourceCounter (pid, now, "major_faults",
+                         usage.ru_majflt - last_usage.ru_majflt);
+  AppendResourceCounter (pid, now, "voluntary_switches",
+                         usage.ru_nvcsw - last_usage.ru_nvcsw);
+  last_usage = usage;
+  FinishWrite ();
+}
+#endif // CTRACE_RESOURCE_COUNTERS
+
+#if !defined(CTRACE_BINARY_OUTPUT) && !defined(CTRACE_AGGREGATE)        \
+    && !defined(CTRACE_FLIGHT_RECORDER)
+// Writes the calls still open as "B" events, those a tick gave a start
+// time.  Their threads may be running on, so a frame is only used if it
+// is still on the stack once it has been copied.
+void
+WriteOpenCalls ()
+{
+  for (SlotChunk *chunk = slot_chunks; chunk; chunk = chunk->next_)
+    for (int i = 0; i < slots_per_chunk; ++i)
+      {
+        ThreadInfo *tinfo = &chunk->slots_[i].info_;
+        ThreadStack *stack = tinfo->stack_;
+        if (!stack)
+          continue;
+        int depth = tinfo->stack_end_;
+        if (depth > stack->capacity_)
+          depth = stack->capacity_;
+        for (int j = 0; j < depth; ++j)
+          {
+            CTraceStruct *frame = stack->At (j);
+            CTraceStruct open = *frame;
+            __sync_synchronize ();
+            if (tinfo->stack_end_ <= j || stack->At (j) != frame)
+              break;
+            if (open.start_time_ == invalid_time)
+              continue;
+            CTraceJson::AppendBegin (
+                &write_buffer, need_comma, open.cat_, tinfo->pid_,
+                tinfo->tid_, CTraceClock::ToMicroseconds (open.start_time_),
+                open.name_, true, open.start_time_thread_);
+            need_comma = true;
+            if (write_buffer.size_ >= CTRACE_WRITE_BATCH_BYTES)
+              FlushWriteBuffer ();
+          }
+      }
+}
+#endif
+
+// Writes the pending records and the open calls and closes the file,
+// which is complete from then on.  Called with write_lock held, at exit
+// or from a crash; only async signal safe calls are made for the
+// latter.
+void
+FinishTrace (bool crashing)
+{
+  if (fd_to_write < 0)
+    return;
+  // A child that has written nothing yet: without records it leaves no
+  // file, and a crash can not create one.
+  if (reopen_trace && (crashing || !pending_records_head))
+    {
+      if (!crashing)
+        AbandonTrace ();
+      fd_to_write = -1;
+      return;
+    }
+  Record *records = __sync_lock_test_and_set (&pending_records_head, NULL);
+#ifdef CTRACE_BINARY_OUTPUT
+  // a name seen for the first time is interned, which allocates.
+  if (crashing)
+    records = NULL;
+#endif // CTRACE_BINARY_OUTPUT
+  WriteRecords (records);
+#if !defined(CTRACE_BINARY_OUTPUT) && !defined(CTRACE_AGGREGATE)        \
+    && !defined(CTRACE_FLIGHT_RECORDER)
+  WriteOpenCalls ();
+#endif
+  FinishWrite ();
+#if defined(CTRACE_MMAP_OUTPUT)
+  // stops the traced threads.
+  fd_to_write = -1;
+  mapped_file.Close ();
+#elif defined(CTRACE_GZIP_OUTPUT)
+  fd_to_write = -1;
+  gzip_file.Append (kCTraceJsonTrailer, sizeof (kCTraceJsonTrailer));
+  // Close frees zlib's state, which a crash can not risk.
+  if (crashing)
+    gzip_file.Finish ();
+  else
+    gzip_file.Close ();
+#else
+  if (!seekable_output)
+    WriteTrailer (fd_to_write);
+  int fd = fd_to_write;
+  fd_to_write = -1;
+  close (fd);
+#endif
 }
 
+#ifndef CTRACE_FLIGHT_RECORDER
+// Gives up if the writer does not finish its batch in time, or if the
+// crash is its own.
+void
+FinishOnCrash (int)
+{
+  if (write_lock.LockForCrash ())
+    FinishTrace (true);
+}
+#endif // CTRACE_FLIGHT_RECORDER
+
+#if !defined(CTRACE_FLIGHT_RECORDER) || defined(CTRACE_SAMPLING)
 void *
 WriterThread (void *)
 {
   pthread_setname_np (pthread_self (), "WriterThread");
 
+  int idle_intervals = 0;
   while (true)
     {
-      Record *record_to_write;
-
-      {
-        Lock lock (&writer_waitup_mutex);
-        if (writer_waitup == false)
-          pthread_cond_wait (&writer_waitup_cond, &writer_waitup_mutex);
-        assert (writer_waitup == true);
-        writer_waitup = false;
-      }
-      while (pending_records_head)
+      WaitForRecords (idle_intervals);
+#ifdef CTRACE_SAMPLING
+      DrainSamples ();
+#endif // CTRACE_SAMPLING
+#ifdef CTRACE_AGGREGATE
+      DumpStats (false);
+#endif // CTRACE_AGGREGATE
+#ifdef CTRACE_RESOURCE_COUNTERS
+      SampleResources ();
+#endif // CTRACE_RESOURCE_COUNTERS
+      Record *record_to_write
+          = __sync_lock_test_and_set (&pending_records_head, NULL);
+      if (record_to_write == NULL)
         {
-          while (true)
-            {
-              record_to_write = pending_records_head;
-              if (record_to_write == NULL)
-                break;
-              if (__sync_bool_compare_and_swap (&pending_records_head,
-                                                record_to_write, NULL))
-                break;
-            }
-          if (record_to_write == NULL)
-            break;
-          DoWriteRecursive (record_to_write);
+          idle_intervals++;
+          continue;
         }
+      idle_intervals = 0;
+      CTraceCrashLock::Hold hold (&write_lock);
+      __sync_sub_and_fetch (&pending_records_count,
+                            WriteRecords (record_to_write));
+      FinishWrite ();
     }
   return NULL;
 }
+#endif // !CTRACE_FLIGHT_RECORDER || CTRACE_SAMPLING
+
+#ifdef CTRACE_SAMPLING
+void
+FreeSampleNodes (SampleNode *node)
+{
+  while (node)
+    {
+      SampleNode *sibling = node->sibling_;
+      FreeSampleNodes (node->child_);
+      free (node);
+      node = sibling;
+    }
 }
+#endif // CTRACE_SAMPLING
 
-extern "C" {
-extern void __start_ctrace__ (void *c, const char *name);
-extern void __end_ctrace__ (CTraceStruct *c, const char *name);
+// Keeps the writer still across fork(), so the child gets a copy with no
+// batch half written.
+void
+PrepareFork ()
+{
+#ifdef CTRACE_SAMPLING
+  pthread_mutex_lock (&samples_mutex);
+#endif // CTRACE_SAMPLING
+  write_lock.Lock ();
 }
 
 void
-__start_ctrace__ (void *c, const char *name)
+ParentAfterFork ()
+{
+  write_lock.Unlock ();
+#ifdef CTRACE_SAMPLING
+  pthread_mutex_unlock (&samples_mutex);
+#endif // CTRACE_SAMPLING
+}
+
+// In the child, where only the thread that forked is left: the pending
+// records, samples and statistics are the parent's, every other slot
+// is free, and neither the writer nor the timers survived the fork.
+void
+ChildAfterFork ()
+{
+  write_lock.Unlock ();
+#ifdef CTRACE_SAMPLING
+  pthread_mutex_unlock (&samples_mutex);
+#endif // CTRACE_SAMPLING
+  int pid = getpid ();
+  int tid = syscall (__NR_gettid, 0);
+  Record *records = __sync_lock_test_and_set (&pending_records_head, NULL);
+  while (records)
+    {
+      Record *next = records->next_;
+      records->pool_->Release (records);
+      records = next;
+    }
+  pending_records_count = 0;
+  dropped_records = 0;
+  ThreadInfo *self = ThreadInfo::Find ();
+  free_head = NULL;
+  for (SlotChunk *chunk = slot_chunks; chunk; chunk = chunk->next_)
+    for (int i = slots_per_chunk - 1; i >= 0; --i)
+      {
+        ThreadSlot *slot = &chunk->slots_[i];
+#ifdef CTRACE_SAMPLING
+        if (slot->samples_)
+          slot->samples_->tail_ = slot->samples_->head_;
+#endif // CTRACE_SAMPLING
+#ifdef CTRACE_AGGREGATE
+        if (slot->stats_)
+          slot->stats_->Clear ();
+#endif // CTRACE_AGGREGATE
+        if (&slot->info_ == self)
+          continue;
+        slot->info_.stack_end_ = 0;
+        PushFreeSlot (reinterpret_cast<FreeListNode *> (&slot->info_));
+      }
+  if (self)
+    {
+      self->pid_ = pid;
+      self->tid_ = tid;
+    }
+#ifdef CTRACE_SAMPLING
+  FreeSampleNodes (sample_root.child_);
+  memset (&sample_root, 0, sizeof (sample_root));
+  dropped_samples = 0;
+#endif // CTRACE_SAMPLING
+#ifdef CTRACE_AGGREGATE
+  stat_summary.Reset ();
+#endif // CTRACE_AGGREGATE
+#ifdef CTRACE_RESOURCE_COUNTERS
+  // the child's own usage starts from zero.
+  memset (&last_usage, 0, sizeof (last_usage));
+  next_resource_sample = 0;
+#endif // CTRACE_RESOURCE_COUNTERS
+#ifdef CTRACE_FLIGHT_RECORDER
+  CTraceFlightRecorder::AfterFork (self ? self->flight_ : NULL, pid, tid);
+  // stopped in the parent already, or left alone.
+  if (!flight_recording || !CTraceFork::Traces ())
+    {
+      flight_recording = false;
+      return;
+    }
+#else
+  // stopped in the parent already, or left alone.
+  if (fd_to_write < 0 || !CTraceFork::Traces ())
+    {
+      AbandonTrace ();
+      fd_to_write = -1;
+      return;
+    }
+  write_buffer.size_ = 0;
+#ifdef CTRACE_BINARY_OUTPUT
+  binary_writer.Reset ();
+  binary_block_tid = 0;
+#else
+  need_comma = false;
+#endif // CTRACE_BINARY_OUTPUT
+  AppendHeader ();
+  reopen_trace = true;
+#endif // CTRACE_FLIGHT_RECORDER
+#if !defined(CTRACE_FLIGHT_RECORDER) || defined(CTRACE_SAMPLING)
+  if (writer_wakeup_fd >= 0)
+    close (writer_wakeup_fd);
+  writer_parked = 0;
+  StartWriter ();
+#endif // !CTRACE_FLIGHT_RECORDER || CTRACE_SAMPLING
+#ifdef CTRACE_THREAD_TIMERS
+  if (self)
+    StartThreadTimer (self);
+#else
+  StartProcessTimer ();
+#endif // CTRACE_THREAD_TIMERS
+}
+
+// Pushes a call on the shadow stack of tinfo.
+void
+PushFrame (ThreadInfo *tinfo, CTraceStruct *cs)
 {
-  if (file_to_write == 0)
-    return;
-  CTraceStruct *cs = new (c) CTraceStruct (name);
-  ThreadInfo *tinfo = GetThreadInfo ();
   if (tinfo->stack_end_ == 0)
     {
       // always update the time in the first entry.
       // Or if it sleep too long, will make this entry looks
       // very time consuming.
       tinfo->UpdateCurrentTime ();
+#if CTRACE_COMPENSATE_OVERHEAD
+      tinfo->scopes_ = 0;
+      tinfo->scopes_current_ = 0;
+#endif // CTRACE_COMPENSATE_OVERHEAD
+    }
+  // only grows at the edge, so a failed Grow leaves every deeper frame
+  // untracked until the stack unwinds back to it.
+  if (tinfo->stack_end_ == tinfo->stack_->capacity_)
+    tinfo->stack_->Grow ();
+  if (tinfo->stack_end_ < tinfo->stack_->capacity_)
+    {
+      tinfo->stack_->At (tinfo->stack_end_) = cs;
     }
-  if (tinfo->stack_end_ < ThreadInfo::max_stack)
+#ifdef CTRACE_AGGREGATE
+  if (tinfo->stack_end_ < CTRACE_AGGREGATE_MAX_DEPTH)
     {
-      tinfo->stack_[tinfo->stack_end_] = cs;
+      tinfo->children_[tinfo->stack_end_] = 0;
+      tinfo->children_thread_[tinfo->stack_end_] = 0;
     }
+#endif // CTRACE_AGGREGATE
+#ifdef CTRACE_FLIGHT_RECORDER
+  if (tinfo->flight_)
+    tinfo->flight_->Open (cs->cat_, cs->name_, 0, 0);
+#endif // CTRACE_FLIGHT_RECORDER
   tinfo->stack_end_++;
 }
 
+// Pops c, the innermost call of tinfo, and records it if a tick gave it
+// a start time.
 void
-__end_ctrace__ (CTraceStruct *c, const char *name)
+PopFrame (ThreadInfo *tinfo, CTraceStruct *c)
 {
-  if (file_to_write == 0)
-    return;
-  ThreadInfo *tinfo = GetThreadInfo ();
   tinfo->stack_end_--;
-  if (tinfo->stack_end_ < ThreadInfo::max_stack)
+#ifdef CTRACE_FLIGHT_RECORDER
+  if (tinfo->flight_)
+    tinfo->flight_->Close ();
+#endif // CTRACE_FLIGHT_RECORDER
+  bool timed = tinfo->stack_end_ < tinfo->stack_->capacity_
+               && c->start_time_ != invalid_time;
+  if (timed)
     {
-      if (c->start_time_ != invalid_time)
+      if (tinfo->stack_end_ == 0)
         {
-          if (tinfo->stack_end_ == 0)
-            {
-              tinfo->UpdateCurrentTime ();
-              c->min_end_time_ = tinfo->current_time_ + ticks;
-            }
-          // we should record this
-          RecordThis (c, tinfo);
-          if (tinfo->stack_end_ != 0)
-            {
-              // propagate the back's mini end time
-              tinfo->stack_[tinfo->stack_end_ - 1]->min_end_time_
-                  = c->min_end_time_ + ticks;
-              tinfo->stack_[tinfo->stack_end_ - 1]->min_end_time_thread_
-                  = c->min_end_time_thread_ + ticks;
-              tinfo->current_time_ += ticks;
-              tinfo->current_time_thread_ += ticks;
-            }
+          tinfo->UpdateCurrentTime ();
+          c->min_end_time_ = tinfo->current_time_ + wall_ticks;
+#if CTRACE_COMPENSATE_OVERHEAD
+          c->scopes_end_ = tinfo->scopes_;
+#endif // CTRACE_COMPENSATE_OVERHEAD
         }
+      // the parent ends after the call as the ticks saw it.
+      uint64_t end = c->min_end_time_;
+      uint64_t end_thread = c->min_end_time_thread_;
+#if CTRACE_COMPENSATE_OVERHEAD
+      Compensate (c);
+#endif // CTRACE_COMPENSATE_OVERHEAD
+#if defined(CTRACE_AGGREGATE)
+      Account (c, tinfo, true);
+#elif defined(CTRACE_FLIGHT_RECORDER)
+      RecordFlight (c, tinfo);
+#else
+      // we should record this
+      RecordThis (c, tinfo);
+#endif // CTRACE_AGGREGATE
+      if (tinfo->stack_end_ != 0)
+        {
+          // propagate the back's mini end time
+          CTraceStruct *parent = tinfo->stack_->At (tinfo->stack_end_ - 1);
+          parent->min_end_time_ = end + wall_ticks;
+          parent->min_end_time_thread_ = end_thread + ticks;
+#if CTRACE_COMPENSATE_OVERHEAD
+          // and loses as much as c did, so it still ends after it.
+          parent->scopes_end_ = c->scopes_end_;
+#endif // CTRACE_COMPENSATE_OVERHEAD
+          tinfo->current_time_ += wall_ticks;
+          tinfo->current_time_thread_ += ticks;
+        }
+    }
+#ifdef CTRACE_AGGREGATE
+  else
+    {
+      Account (c, tinfo, false);
+    }
+#endif // CTRACE_AGGREGATE
+#if CTRACE_COMPENSATE_OVERHEAD
+  tinfo->scopes_++;
+#endif // CTRACE_COMPENSATE_OVERHEAD
+}
+
+void
+StartCTrace (void *c, const char *cat, const char *name)
+{
+#ifdef CTRACE_FLIGHT_RECORDER
+  if (!flight_recording)
+    return;
+#else
+  if (fd_to_write < 0)
+    return;
+#endif // CTRACE_FLIGHT_RECORDER
+  CTraceStruct *cs = new (c) CTraceStruct (cat, name);
+  ThreadInfo *tinfo = GetThreadInfo ();
+  if (!tinfo)
+    return;
+  PushFrame (tinfo, cs);
+}
+
+void
+EndCTrace (CTraceStruct *c)
+{
+#ifdef CTRACE_FLIGHT_RECORDER
+  if (!flight_recording)
+    return;
+#else
+  if (fd_to_write < 0)
+    return;
+#endif // CTRACE_FLIGHT_RECORDER
+  ThreadInfo *tinfo = GetThreadInfo ();
+  if (!tinfo || tinfo->stack_end_ == 0)
+    return;
+  PopFrame (tinfo, c);
+}
+
+#if CTRACE_COMPENSATE_OVERHEAD
+// Runs count empty calls on a ThreadInfo no tick ever sees, so they are
+// never timed; the lookups stand for those of GetThreadInfo.
+void
+RunCalibration (void *arg, int count)
+{
+  ThreadInfo *tinfo = static_cast<ThreadInfo *> (arg);
+  for (int i = 0; i < count; ++i)
+    {
+      CTraceStruct frame ("ctrace", "calibration");
+      ThreadInfo::Find ();
+      PushFrame (tinfo, &frame);
+      ThreadInfo::Find ();
+      PopFrame (tinfo, &frame);
     }
 }
+
+void
+CalibrateOverhead ()
+{
+  // static, so what the constructor leaves is zero: no records, ring,
+  // samples or statistics.
+  static ThreadSlot slot;
+  ThreadInfo *tinfo = &slot.info_;
+  tinfo->stack_ = &slot.stack_;
+  tinfo->pool_ = &slot.pool_;
+  tinfo->blocked_ = false;
+  CTraceOverhead::Calibrate (RunCalibration, tinfo);
+}
+#endif // CTRACE_COMPENSATE_OVERHEAD
+}
+
+extern "C" {
+extern void __start_ctrace__ (void *c, const char *name);
+extern void __end_ctrace__ (CTraceStruct *c, const char *name);
+extern void __start_ctrace_fn__ (void *c, const CTraceFuncDesc *desc);
+extern void __end_ctrace_fn__ (CTraceStruct *c, const CTraceFuncDesc *desc);
+#ifdef CTRACE_FLIGHT_RECORDER
+extern int ctrace_dump_flight_recorder ();
+#endif // CTRACE_FLIGHT_RECORDER
+}
+
+void
+__start_ctrace__ (void *c, const char *name)
+{
+  StartCTrace (c, "profile", name);
+}
+
+void
+__end_ctrace__ (CTraceStruct *c, const char *name)
+{
+  EndCTrace (c);
+}
+
+void
+__start_ctrace_fn__ (void *c, const CTraceFuncDesc *desc)
+{
+  StartCTrace (c, desc->cat_, desc->name_);
+}
+
+void
+__end_ctrace_fn__ (CTraceStruct *c, const CTraceFuncDesc *)
+{
+  EndCTrace (c);
+}
+
+#ifdef CTRACE_FLIGHT_RECORDER
+int
+ctrace_dump_flight_recorder ()
+{
+  return CTraceFlightRecorder::Dump ();
+}
+#endif // CTRACE_FLIGHT_RECORDER
@@ -15,3 +15,7 @@ g++ -O2 -o test_thread test_thread.o -lpthread
 ./test_thread
 mv trace.json test_thread.json
 
+g++ -O2 -c test_thread_churn.cpp
+g++ -O2 -o test_thread_churn test_thread_churn.o -lpthread
+./test_thread_churn || exit 1
+mv trace.json test_thread_churn.json
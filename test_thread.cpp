@@ -6,6 +6,7 @@ thread_start (void *)
 {
   C_TRACE_0 ("test", __FUNCTION__);
   sleep (1);
+  return NULL;
 }
 
 int
@@ -0,0 +1,46 @@
+#define CTRACE_THREAD_SUPPORTED
+#include "ctrace.h"
+#include <malloc.h>
+
+// Threads that come and go must hand their buffers back rather than leak
+// them: the heap after many rounds stays close to the heap after one.
+
+static const int kThreads = 16;
+static const int kRounds = 64;
+
+static void *
+thread_start (void *)
+{
+  C_TRACE_0 ("test", __FUNCTION__);
+  return NULL;
+}
+
+static void
+Round ()
+{
+  pthread_t threads[kThreads];
+  for (int i = 0; i < kThreads; ++i)
+    pthread_create (&threads[i], NULL, thread_start, NULL);
+  for (int i = 0; i < kThreads; ++i)
+    pthread_join (threads[i], NULL);
+}
+
+int
+main ()
+{
+  C_TRACE_0 ("test", __FUNCTION__);
+  Round ();
+  size_t before = mallinfo2 ().uordblks;
+  for (int i = 1; i < kRounds; ++i)
+    Round ();
+  size_t after = mallinfo2 ().uordblks;
+  // one round's worth of buffers is the most the churn may add.
+  size_t limit = kThreads * sizeof (CTrace::Buffer);
+  if (after > before + limit)
+    {
+      fprintf (stderr, "heap grew by %zu bytes over %d rounds\n",
+               after - before, kRounds);
+      return 1;
+    }
+  return 0;
+}